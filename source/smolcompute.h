@@ -12,11 +12,12 @@
 //   #define SMOL_COMPUTE_IMPLEMENTATION 1
 //   #define SMOL_COMPUTE_<graphicsapi> 1
 //   #include "smolcompute.h"
-// in one of your compiled files. Current implementations are for D3D11 (SMOL_COMPUTE_D3D11)
-// and Metal (SMOL_COMPUTE_METAL).
+// in one of your compiled files. Current implementations are for D3D11 (SMOL_COMPUTE_D3D11),
+// Metal (SMOL_COMPUTE_METAL) and Vulkan (SMOL_COMPUTE_VULKAN; Windows and Linux).
 
 
 #include <stddef.h>
+#include <stdint.h>
 
 
 // Small utility to implement bitwise operators on strongly typed C++11 enums
@@ -43,6 +44,14 @@ enum class SmolBackend
     Vulkan,
 };
 
+// Result of calls that can refuse to do work instead of blocking (see SmolBackpressureLimits), or fail
+enum class SmolResult
+{
+    Success = 0,
+    WouldBlock,
+    OutOfMemory, // e.g. could not allocate Vulkan descriptor sets
+};
+
 // Initialization flags (can be combined)
 enum class SmolComputeCreateFlags
 {
@@ -55,7 +64,20 @@ enum class SmolComputeCreateFlags
     // Enable debug/validation layers when possible.
     EnableDebugLayers = 1 << 1,
     // Use software CPU device when possible.
+    // - D3D11: WARP device,
+    // - Vulkan: a CPU device (e.g. lavapipe) if there is one.
     UseSoftwareRenderer = 1 << 2,
+    // Enable GPU timing of dispatches and SmolProfileBegin/SmolProfileEnd scopes.
+    // Only supported on Vulkan (needs timestamp support on the compute queue).
+    EnableProfiling = 1 << 3,
+    // Count compute shader invocations of dispatches, see SmolKernelGetStats.
+    // Only supported on Vulkan (needs pipelineStatisticsQuery device feature).
+    EnableInvocationStats = 1 << 4,
+    // Do all GPU queue submissions on a library-owned submission thread, instead of on the threads
+    // that flush or wait for work. Only supported on Vulkan; see SmolComputeGetSubmitStats.
+    // Retiring finished work (fence checks, freeing staging memory) still happens on the threads
+    // that check or wait for it, and on the completion callback thread.
+    EnableSubmitThread = 1 << 5,
 };
 SMOL_COMPUTE_ENUM_FLAGS(SmolComputeCreateFlags);
 
@@ -64,7 +86,27 @@ enum class SmolBufferType
 {
     Constant = 0,   // D3D11: constant buffer, Metal: does not care
     Structured,     // D3D11: structured buffer, Metal: does not care
+    Indirect,       // Indirect dispatch arguments (uint group counts), can also be bound as kernel input/output.
+                    // D3D11: raw buffer (ByteAddressBuffer/RWByteAddressBuffer), Metal: does not care
+};
+
+// Data buffer usage hint: how the buffer is going to be accessed
+enum class SmolBufferUsage
+{
+    Dynamic = 0,    // CPU writes and reads back often. D3D11: default, Vulkan: host visible memory, Metal: managed.
+    GpuOnly,        // Mostly accessed by the GPU. D3D11: default, Vulkan: device local memory (set/get data go through staging memory), Metal: managed.
+    Upload,         // CPU writes, GPU reads. D3D11: dynamic for constant buffers, Vulkan: host visible memory, Metal: shared.
+    Readback,       // GPU writes, CPU reads. D3D11: keeps a staging buffer around, Vulkan: host visible cached memory, Metal: shared.
+};
+
+// Buffer mapping access (can be combined)
+enum class SmolBufferMapAccess
+{
+    Read = 1 << 0,
+    Write = 1 << 1,
+    ReadWrite = Read | Write,
 };
+SMOL_COMPUTE_ENUM_FLAGS(SmolBufferMapAccess);
 
 // Binding "space" for buffer usage
 enum class SmolBufferBinding
@@ -84,34 +126,339 @@ enum class SmolKernelCreateFlags
 };
 SMOL_COMPUTE_ENUM_FLAGS(SmolKernelCreateFlags);
 
+// Kernel specialization constant: value for a constant with a given id, see SmolKernelCreate.
+struct SmolKernelSpecialization
+{
+    enum class Type
+    {
+        Int = 0,
+        Float,
+        Bool,
+    };
+    SmolKernelSpecialization() : constantId(0), type(Type::Int) { intValue = 0; }
+    SmolKernelSpecialization(int id, int value) : constantId(id), type(Type::Int) { intValue = value; }
+    SmolKernelSpecialization(int id, float value) : constantId(id), type(Type::Float) { floatValue = value; }
+    SmolKernelSpecialization(int id, bool value) : constantId(id), type(Type::Bool) { intValue = 0; boolValue = value; }
+
+    int constantId;
+    Type type;
+    union
+    {
+        int intValue;
+        float floatValue;
+        bool boolValue;
+    };
+};
+
+
+// Task scheduler: how the library runs work that it splits into parallel tasks (currently, CPU-side
+// copies of large buffer data). Pass one to SmolComputeCreate to run these tasks on your own thread
+// pool; without one, a built-in work-stealing pool is used, with its threads started on first use.
+// - workerCount: number of threads tasks can run on, besides the calling thread. With zero, all the
+//   work is done on the calling thread.
+// - enqueue: run task(taskData, index) for each index in [0, count), and return a wait group for them.
+// - wait: wait until all tasks of a wait group are done (the calling thread can help running tasks),
+//   and release the wait group.
+typedef void (*SmolTaskFunction)(void* taskData, int index);
+struct SmolTaskScheduler
+{
+    void* userData = nullptr;
+    int (*workerCount)(void* userData) = nullptr;
+    void* (*enqueue)(void* userData, SmolTaskFunction task, void* taskData, int count) = nullptr;
+    void (*wait)(void* userData, void* waitGroup) = nullptr;
+};
 
 // Initialize the library. This has to be called before doing other work.
-bool SmolComputeCreate(SmolComputeCreateFlags flags = SmolComputeCreateFlags::None);
+// - pipelineCachePath: optional file to load compiled kernel pipelines from, and save them into
+//   on shutdown. Only used on Vulkan; cache is discarded if it was produced by a different
+//   device or driver version.
+// - scheduler: optional task scheduler (see above); it is copied.
+bool SmolComputeCreate(SmolComputeCreateFlags flags = SmolComputeCreateFlags::None, const char* pipelineCachePath = nullptr, const SmolTaskScheduler* scheduler = nullptr);
 // Shutdown the library.
 void SmolComputeDelete();
 // Get backend implementation type.
 SmolBackend SmolComputeGetBackend();
 
+// Recording contexts, for recording and submitting GPU work from several threads at once.
+// - Buffer data, kernel setup (SmolKernelSet etc.), dispatches and profile scopes go into the
+//   current context of the calling thread; a thread that did not set one uses the default context.
+// - A context must only be used by one thread at a time. Buffers and kernels can be shared between
+//   contexts; work recorded in a context reaches the GPU when it is flushed, or when a buffer read
+//   from that context needs it. Reading back data written by another context requires that context
+//   to be flushed first. Likewise, other contexts that recorded work using a buffer, kernel or
+//   command list have to be flushed before deleting it.
+// - SmolContextDelete waits for the context's GPU work; the default context can not be deleted.
+// - Vulkan: each context records its own command buffers. D3D11 and Metal: contexts are accepted,
+//   but all work is recorded into the one device context / command buffer.
+struct SmolContext;
+SmolContext* SmolContextCreate();
+void SmolContextDelete(SmolContext* context);
+// Set context for the calling thread; nullptr means the default context.
+void SmolContextSetCurrent(SmolContext* context);
+SmolContext* SmolContextGetCurrent();
+// Submit work recorded in the context (nullptr: the current one) to the GPU, without waiting for it.
+// Returns WouldBlock (and submits nothing) if backpressure limits are reached in non-blocking mode.
+SmolResult SmolContextFlush(SmolContext* context = nullptr);
+
+// Automatic flushing: submit the work of a context once it has recorded maxDispatches dispatches,
+// referenced maxBufferBytes bytes of buffers, or maxRecordingUs microseconds have passed since its
+// first recorded command. This lets the GPU start on the work while more of it is being recorded,
+// instead of getting one huge batch at the end. Zero means no limit; by default there are none.
+// - Limits are checked when a dispatch is recorded, so the time limit is not a timer: a context that
+//   stops recording keeps its work until it is flushed.
+// - Vulkan: checked after each dispatch; parts and command lists are never flushed automatically, and
+//   dispatches recorded into them do not count. Metal: checked when a kernel is set, since committing
+//   the command buffer drops the bindings of the current kernel. D3D11: ignored, the driver submits
+//   work on its own.
+struct SmolFlushPolicy
+{
+    int maxDispatches = 0;
+    size_t maxBufferBytes = 0;
+    uint64_t maxRecordingUs = 0;
+};
+void SmolContextSetFlushPolicy(SmolContext* context, const SmolFlushPolicy& policy);
+
+// Fences, for tracking when submitted GPU work is finished. A default-constructed fence is complete.
+// - SmolComputeFlush submits work recorded so far in the current context, without waiting for it, and
+//   returns a fence for it. CPU work can be done while the GPU runs; buffer reads of the results do
+//   not need to wait once the fence is complete.
+// - SmolFenceWait waits for at most timeoutNs nanoseconds, and returns whether the fence is complete.
+// - If backpressure limits are reached in non-blocking mode, SmolComputeFlush submits nothing, sets
+//   result (when given) to WouldBlock and returns the fence of previously submitted work.
+// - Vulkan: backed by a timeline semaphore when VK_KHR_timeline_semaphore is available, by per-batch
+//   fences otherwise. D3D11: event queries. Metal: command buffer status.
+struct SmolFence
+{
+    uint64_t value = 0;
+};
+SmolFence SmolComputeFlush(SmolResult* result = nullptr);
+bool SmolFenceIsComplete(SmolFence fence);
+bool SmolFenceWait(SmolFence fence, uint64_t timeoutNs = ~0ULL);
+
+// Queue submission statistics. Only tracked on Vulkan.
+struct SmolSubmitStats
+{
+    uint64_t submitCount = 0;   // batches submitted to the GPU queue
+    int queueDepth = 0;         // batches waiting for the submission thread (EnableSubmitThread)
+    int maxQueueDepth = 0;      // highest queueDepth so far
+};
+SmolSubmitStats SmolComputeGetSubmitStats();
+
+// Backpressure: limits on GPU work that is submitted but not finished yet, over all contexts, so that
+// a fast producer can not queue up unbounded work and staging memory. Zero means no limit; by
+// default there are none.
+// - maxInFlightBatches: submitted batches, from explicit or automatic flushes.
+// - maxInFlightStagingBytes: upload and readback staging memory used by submitted batches. A batch
+//   that alone is over the limit is still submitted once nothing else is in flight.
+// - Once a limit is reached, SmolComputeFlush and SmolContextFlush wait for the GPU to finish older
+//   batches, and so do dispatches that would flush automatically (SmolFlushPolicy). With nonBlocking
+//   they do nothing and return WouldBlock instead; try again later. Buffer reads and writes still
+//   submit and wait for work as they need to.
+// - Vulkan: all limits. Metal: maxInFlightBatches. D3D11: ignored, the driver limits queued work.
+struct SmolBackpressureLimits
+{
+    int maxInFlightBatches = 0;
+    size_t maxInFlightStagingBytes = 0;
+    bool nonBlocking = false;
+};
+void SmolComputeSetBackpressureLimits(const SmolBackpressureLimits& limits);
+
+// Parallel recording of one batch: split the work of a context into "partCount" parts that several
+// threads record at the same time. Parts are executed in part order, after the work recorded into
+// the context so far, with full barriers between them.
+// - On the thread that uses the context, call SmolContextBeginParts. Then each worker thread does
+//   SmolContextSetCurrent(SmolContextGetPart(context, index)), records kernel setup, dispatches and
+//   profile scopes, and sets its current context back. Once all workers are done, SmolContextEndParts
+//   (on the context thread) adds the parts to the batch.
+// - Buffer data can not be set, read or mapped while recording into a part, and parts can not be flushed.
+// - Returns false if the backend can not record in parallel (D3D11, Metal); record the work
+//   on one thread then.
+// - Vulkan: each part is a secondary command buffer.
+bool SmolContextBeginParts(SmolContext* context, int partCount);
+SmolContext* SmolContextGetPart(SmolContext* context, int index);
+void SmolContextEndParts(SmolContext* context);
+
+// Command lists: record a sequence of kernel setup and dispatch calls once, and execute it many times.
+// - Between SmolCommandListBegin and SmolCommandListEnd, kernel setup and dispatch calls of the
+//   calling thread go into the command list instead of its context. Buffer data can not be set,
+//   read or mapped in between.
+// - Buffer bindings and constants are captured when recording; buffer contents are whatever they
+//   are when the list executes. Buffers and kernels used by a command list must not be deleted
+//   before the list is.
+// - SmolComputeDefragment does not move buffers used by command lists (ones being recorded, or
+//   not deleted yet), since lists refer to buffers directly.
+// - SmolCommandListExecute adds the list to the work of the current context, ordered against
+//   earlier and later work with full barriers.
+// - Dispatches in command lists are not profiled, and not counted in kernel stats.
+// - Returns nullptr if the backend does not support command lists (D3D11, Metal).
+// - Vulkan: a reusable secondary command buffer with pre-written descriptor sets.
+struct SmolCommandList;
+SmolCommandList* SmolCommandListBegin();
+void SmolCommandListEnd(SmolCommandList* list);
+void SmolCommandListExecute(SmolCommandList* list);
+void SmolCommandListDelete(SmolCommandList* list);
+
+// Kernel pipeline creation statistics since SmolComputeCreate. Only tracked on Vulkan;
+// cache hits/misses and time need VK_EXT_pipeline_creation_feedback support from the driver.
+struct SmolPipelineCacheStats
+{
+    int pipelinesCreated = 0;
+    int cacheHits = 0;
+    int cacheMisses = 0;
+    double creationTimeMs = 0.0;
+    size_t loadedBytes = 0; // pipeline cache data loaded from the cache file; zero if there was none or it did not match
+};
+SmolPipelineCacheStats SmolComputeGetPipelineCacheStats();
+
 // Data buffers: create, delete, set and get data.
 // - All sizes are in bytes.
 // - structElementSize is for structured buffers, some APIs need to know that.
+// - usage is a hint for which kind of memory to use for the buffer.
 
-SmolBuffer* SmolBufferCreate(size_t byteSize, SmolBufferType type, size_t structElementSize = 0);
+SmolBuffer* SmolBufferCreate(size_t byteSize, SmolBufferType type, size_t structElementSize = 0, SmolBufferUsage usage = SmolBufferUsage::Dynamic);
 void SmolBufferDelete(SmolBuffer* buffer);
 void SmolBufferSetData(SmolBuffer* buffer, const void* src, size_t size, size_t dstOffset = 0);
 void SmolBufferGetData(SmolBuffer* buffer, void* dst, size_t size, size_t srcOffset = 0);
 
+// Asynchronous readback: record a GPU copy of buffer data range into pooled readback memory, without
+// waiting for any GPU work. The returned handle completes once that copy is done on the GPU, and the
+// data is then written into dst (which has to stay valid until then). Work recorded after the readback
+// does not affect the data it gets.
+// - The copy goes to the GPU with the rest of the current context's work: on SmolComputeFlush or
+//   SmolContextFlush, or on SmolReadbackWait from the recording thread.
+// - SmolReadbackIsComplete does not wait; SmolReadbackWait waits for at most timeoutNs nanoseconds.
+//   Both return whether the data is in dst.
+// - SmolReadbackDelete releases the handle; data of a readback that did not complete yet is dropped.
+// - D3D11 and Metal: each readback uses its own staging buffer.
+struct SmolReadback;
+SmolReadback* SmolBufferGetDataAsync(SmolBuffer* buffer, void* dst, size_t size, size_t srcOffset = 0);
+bool SmolReadbackIsComplete(SmolReadback* readback);
+bool SmolReadbackWait(SmolReadback* readback, uint64_t timeoutNs = ~0ULL);
+void SmolReadbackDelete(SmolReadback* readback);
+
+// Completion callbacks: call a function once GPU work of a fence, or a readback (with its data in dst),
+// is complete. Pipelined work can chain on completion without a poll loop; a callback can e.g. fulfil
+// a std::promise.
+// - Callback of work that is already complete can be called before the function returns.
+// - A readback must not be used until its callback was called.
+// - Vulkan: callbacks are called on a completion thread, started on first use. It waits on the timeline
+//   semaphore, or polls batch fences when timeline semaphores are not available. Callbacks should be
+//   short; to record GPU work from one, set a context for the completion thread first.
+// - Metal: called from command buffer completion handlers, or a dispatch queue.
+// - D3D11: called on the calling thread, from SmolComputeFlush and fence or readback checks.
+typedef void (*SmolCompletionCallback)(void* userData);
+void SmolFenceOnComplete(SmolFence fence, SmolCompletionCallback callback, void* userData);
+void SmolReadbackOnComplete(SmolReadback* readback, SmolCompletionCallback callback, void* userData);
+
+// Map buffer data range for direct CPU access, and unmap it when done. This avoids an extra
+// memory copy compared to SetData/GetData when possible.
+// - size of zero means "until the end of the buffer".
+// - Read access waits for GPU work writing into the buffer to finish.
+// - Only one range of a buffer can be mapped at a time, and the buffer has to be unmapped
+//   before using it in a dispatch.
+// - D3D11: goes through a staging buffer, Vulkan: buffers in host visible memory are mapped
+//   directly, GpuOnly buffers get a staging buffer for each map, so the pointer stays valid until
+//   unmap regardless of other buffer data uploads and reads. Unmap records the upload of written
+//   data into the current context.
+void* SmolBufferMap(SmolBuffer* buffer, SmolBufferMapAccess access, size_t offset = 0, size_t size = 0);
+void SmolBufferUnmap(SmolBuffer* buffer);
+
+// Buffer memory statistics. Only tracked on Vulkan, where buffers are sub-allocated out of larger
+// memory blocks (in power of two size classes); large buffers get dedicated allocations.
+struct SmolMemoryStats
+{
+    size_t blockCount = 0;      // memory blocks for sub-allocation
+    size_t blockBytes = 0;      // total size of memory blocks
+    size_t blockUsedBytes = 0;  // allocated part of memory blocks (rounded up to size classes)
+    size_t bufferCount = 0;     // buffers in memory blocks
+    size_t bufferBytes = 0;     // size of buffers in memory blocks
+    size_t dedicatedCount = 0;  // dedicated allocations
+    size_t dedicatedBytes = 0;
+    float fragmentation = 0.0f; // fraction of memory block space that is not used
+};
+SmolMemoryStats SmolComputeGetMemoryStats();
+// Compact buffer memory by moving buffers out of sparsely used memory blocks, so that those can be freed.
+// Buffer contents are preserved (copied on the GPU); buffers that are currently mapped, or used by
+// command lists, are not moved.
+// Copies are recorded into the current context; no other context may be recording work at the time.
+// Vulkan only; does nothing on other backends.
+void SmolComputeDefragment();
+
 
 // Computation kernels: create, delete, set them up (Set + SetBuffer), dispatch and wait
 // for dispatches to complete.
 // - Dispatch is number of "threads" launched, not number of "thread groups".
 
 SmolKernel* SmolKernelCreate(const void* shaderCode, size_t shaderCodeSize, const char* entryPoint, SmolKernelCreateFlags flags = SmolKernelCreateFlags::None);
+// Create a kernel variant with specialization constant values, so that e.g. loop counts or
+// work group size can be folded into the kernel code by the compiler.
+// - Vulkan: SPIR-V specialization constants (constant_id); work group size specified with
+//   local_size_x_id etc. (or LocalSizeId) is picked up from them too. Kernels created from the
+//   same code, entry point and specialization values are shared, and have to be deleted as many
+//   times as they were created.
+// - D3D11: passed as SMOL_SPEC_<constantId> macros into HLSL compilation.
+// - Metal: function constants at index <constantId>.
+SmolKernel* SmolKernelCreate(const void* shaderCode, size_t shaderCodeSize, const char* entryPoint, const SmolKernelSpecialization* specializations, int specializationCount, SmolKernelCreateFlags flags = SmolKernelCreateFlags::None);
 SmolKernel* SmolKernelCreate(const void* shaderCode, size_t shaderCodeSize);
 void SmolKernelDelete(SmolKernel* kernel);
 void SmolKernelSet(SmolKernel* kernel);
 void SmolKernelSetBuffer(SmolBuffer* buffer, int index, SmolBufferBinding binding = SmolBufferBinding::Input);
-void SmolKernelDispatch(int threadsX, int threadsY, int threadsZ, int groupSizeX, int groupSizeY, int groupSizeZ);
+// Bind a range of the buffer; size of zero means "until the end of the buffer".
+// - offset has to be a multiple of SmolBufferGetOffsetAlignment for the buffer type.
+// - D3D11: structured buffer offset and size have to be multiples of the element size; constant buffer
+//   ranges need D3D11.1 and are rounded up to 256 bytes.
+// - Metal: only the offset is used; kernel can access data until the end of the buffer.
+void SmolKernelSetBufferRange(SmolBuffer* buffer, int index, size_t offset, size_t size, SmolBufferBinding binding = SmolBufferBinding::Input);
+// Required alignment of buffer range offsets for SmolKernelSetBufferRange, in bytes.
+size_t SmolBufferGetOffsetAlignment(SmolBufferType type);
+// Set small constant data for the following dispatches of the current kernel, without going through
+// a constant buffer. Data is copied at the time of the call. Up to 128 bytes work everywhere.
+// - D3D11: constant buffer at register b<index>. Metal: buffer at index <index>, up to 4KB.
+// - Vulkan: push constants block of the kernel. The index parameter is ignored, since a kernel can only
+//   have one block. Data past the size of the kernel's block is dropped; the block itself can be up to
+//   256 bytes, if the device supports that (128 bytes are always supported).
+void SmolKernelSetConstants(const void* data, size_t size, int index = 0);
+// Returns WouldBlock (and records nothing) if the dispatch would flush the context automatically,
+// but backpressure limits are reached in non-blocking mode. Returns OutOfMemory (and does not
+// dispatch) if resources for the dispatch could not be allocated.
+SmolResult SmolKernelDispatch(int threadsX, int threadsY, int threadsZ, int groupSizeX, int groupSizeY, int groupSizeZ);
+// Dispatch with number of thread groups (3 uints) read from a buffer on the GPU, e.g. written by
+// an earlier kernel. argsBuffer must be created with SmolBufferType::Indirect, argsOffset must be
+// a multiple of 4.
+SmolResult SmolKernelDispatchIndirect(SmolBuffer* argsBuffer, size_t argsOffset, int groupSizeX, int groupSizeY, int groupSizeZ);
+
+// Dispatch statistics of a kernel, accumulated since SmolComputeCreate over all kernels with the same
+// code, entry point and specialization values. Initialization must be done with
+// SmolComputeCreateFlags::EnableInvocationStats flag; counts come in asynchronously as the GPU
+// finishes the work. invocations - requestedThreads is the work wasted by rounding the dispatch
+// size up to whole thread groups.
+struct SmolKernelStats
+{
+    uint64_t dispatchCount = 0;         // dispatches that were measured
+    uint64_t indirectDispatchCount = 0; // out of those, indirect ones (not included in requestedThreads)
+    uint64_t requestedThreads = 0;      // threadsX*threadsY*threadsZ of measured SmolKernelDispatch calls
+    uint64_t invocations = 0;           // compute shader invocations counted by the GPU
+};
+SmolKernelStats SmolKernelGetStats(SmolKernel* kernel);
+
+
+// GPU timings. Initialization must be done with SmolComputeCreateFlags::EnableProfiling flag.
+// - Each dispatch is timed, and named after the kernel entry point.
+// - Begin/End scopes (can be nested) time all the work done between them.
+// - Results come back asynchronously, once the GPU has finished the work; SmolProfileGetResults
+//   does not wait. It returns up to maxResults oldest available results, in the order scopes and
+//   dispatches were started, and removes them from the list.
+// - Vulkan: timestamp queries; results are not available on other backends.
+struct SmolProfileResult
+{
+    char name[64];
+    int depth;              // scope nesting level
+    uint64_t startNs;       // GPU clock time at start; only meaningful relative to other results
+    uint64_t durationNs;
+};
+void SmolProfileBegin(const char* name);
+void SmolProfileEnd();
+int SmolProfileGetResults(SmolProfileResult* results, int maxResults);
 
 
 // Starts and finishes capture into a graphics debugger.
@@ -187,10 +534,15 @@ extern "C" {
 
 static SmolImpl_RENDERDOC_API_1_4_1* s_RenderDocApi;
 
+#if defined(_WIN32)
 #include <wtypes.h>
+#else
+#include <dlfcn.h>
+#endif
 
 static void SmolImpl_LoadRenderDoc()
 {
+#if defined(_WIN32)
     HMODULE dll = LoadLibraryA("C:\\Program Files\\RenderDoc\\renderdoc.dll");
     if (dll)
     {
@@ -198,26 +550,292 @@ static void SmolImpl_LoadRenderDoc()
         if (procGetApi)
             procGetApi(SmolImpl_eRENDERDOC_API_Version_1_4_1, (void**)&s_RenderDocApi);
     }
+#else
+    // on Linux RenderDoc has to inject itself into the process; only grab the API if it is loaded already
+    void* lib = dlopen("librenderdoc.so", RTLD_NOW | RTLD_NOLOAD);
+    if (lib)
+    {
+        SmolImpl_pRENDERDOC_GetAPI procGetApi = (SmolImpl_pRENDERDOC_GetAPI)dlsym(lib, "RENDERDOC_GetAPI");
+        if (procGetApi)
+            procGetApi(SmolImpl_eRENDERDOC_API_Version_1_4_1, (void**)&s_RenderDocApi);
+    }
+#endif
 }
 
 #endif // #if SMOL_COMPUTE_ENABLE_RENDERDOC
 
 
+// ------------------------------------------------------------------------------------------------
+//  Task scheduler, shared by all backends
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+// Built-in scheduler: each worker thread has its own task queue, and steals tasks from the other
+// queues when it runs out. Tasks are coarse (megabytes of data each), so the queues are simply locked.
+struct SmolImpl_TaskGroup
+{
+    std::atomic<int> remaining;
+    std::mutex mutex; // guards the last decrement of remaining, so that the waiter can delete the group
+    std::condition_variable done;
+};
+struct SmolImpl_Task
+{
+    SmolTaskFunction func;
+    void* data;
+    int index;
+    SmolImpl_TaskGroup* group;
+};
+struct SmolImpl_TaskQueue
+{
+    std::mutex mutex;
+    std::deque<SmolImpl_Task> tasks;
+};
+static std::mutex s_TaskPoolMutex; // guards starting/stopping workers, and sleeping
+static std::condition_variable s_TaskPoolWake;
+static std::vector<std::thread> s_TaskWorkers;
+static std::atomic<int> s_TaskWorkerCount { 0 }; // set before workers start
+static std::unique_ptr<SmolImpl_TaskQueue[]> s_TaskQueues; // one per worker
+static std::atomic<int> s_TaskQueued { 0 }; // tasks in the queues, not taken by any thread yet
+static std::atomic<unsigned> s_TaskNextQueue { 0 };
+static bool s_TaskPoolQuit;
+
+static SmolTaskScheduler s_TaskScheduler;
+
+static int SmolImpl_TaskPoolWorkerCount()
+{
+    int count = (int)std::thread::hardware_concurrency() - 1;
+    return count > 0 ? count : 0;
+}
+
+// Take a task: from the back of the preferred queue (own tasks, most recently added), or steal from the front of others.
+static bool SmolImpl_TaskPoolTake(int preferred, SmolImpl_Task& task)
+{
+    const int count = s_TaskWorkerCount.load();
+    for (int i = 0; i < count; ++i)
+    {
+        const int qi = (preferred + i) % count;
+        SmolImpl_TaskQueue& q = s_TaskQueues[qi];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty())
+            continue;
+        if (i == 0)
+        {
+            task = q.tasks.back();
+            q.tasks.pop_back();
+        }
+        else
+        {
+            task = q.tasks.front();
+            q.tasks.pop_front();
+        }
+        s_TaskQueued.fetch_sub(1);
+        return true;
+    }
+    return false;
+}
+
+static void SmolImpl_TaskPoolRun(const SmolImpl_Task& task)
+{
+    task.func(task.data, task.index);
+    SmolImpl_TaskGroup* group = task.group;
+    std::lock_guard<std::mutex> lock(group->mutex);
+    if (group->remaining.fetch_sub(1, std::memory_order_release) == 1)
+        group->done.notify_all();
+}
+
+static void SmolImpl_TaskPoolWorker(int index)
+{
+    SmolImpl_Task task;
+    for (;;)
+    {
+        if (SmolImpl_TaskPoolTake(index, task))
+        {
+            SmolImpl_TaskPoolRun(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(s_TaskPoolMutex);
+        s_TaskPoolWake.wait(lock, [] { return s_TaskPoolQuit || s_TaskQueued.load() > 0; });
+        if (s_TaskPoolQuit)
+            return;
+    }
+}
+
+static int SmolImpl_TaskPoolWorkerCountHook(void* userData)
+{
+    (void)userData;
+    return SmolImpl_TaskPoolWorkerCount();
+}
+
+static void* SmolImpl_TaskPoolEnqueue(void* userData, SmolTaskFunction func, void* data, int count)
+{
+    (void)userData;
+    {
+        std::lock_guard<std::mutex> lock(s_TaskPoolMutex);
+        if (s_TaskWorkers.empty())
+        {
+            const int workerCount = SmolImpl_TaskPoolWorkerCount();
+            s_TaskQueues.reset(new SmolImpl_TaskQueue[workerCount]);
+            s_TaskPoolQuit = false;
+            s_TaskWorkerCount = workerCount;
+            for (int i = 0; i < workerCount; ++i)
+                s_TaskWorkers.push_back(std::thread(SmolImpl_TaskPoolWorker, i));
+        }
+    }
+    SmolImpl_TaskGroup* group = new SmolImpl_TaskGroup();
+    group->remaining = count;
+    const int workerCount = s_TaskWorkerCount.load();
+    if (workerCount == 0)
+    {
+        // no workers: tasks are run on the waiting thread
+        for (int i = 0; i < count; ++i)
+            func(data, i);
+        group->remaining = 0;
+        return group;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        SmolImpl_TaskQueue& q = s_TaskQueues[s_TaskNextQueue.fetch_add(1) % workerCount];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        q.tasks.push_back({ func, data, i, group });
+        s_TaskQueued.fetch_add(1);
+    }
+    {
+        // lock so that a worker between checking for work and going to sleep does not miss the wakeup
+        std::lock_guard<std::mutex> lock(s_TaskPoolMutex);
+    }
+    s_TaskPoolWake.notify_all();
+    return group;
+}
+
+static void SmolImpl_TaskPoolWait(void* userData, void* waitGroup)
+{
+    (void)userData;
+    SmolImpl_TaskGroup* group = (SmolImpl_TaskGroup*)waitGroup;
+    // help running tasks instead of just waiting; once none are queued, sleep until the ones taken by workers are done
+    SmolImpl_Task task;
+    while (group->remaining.load(std::memory_order_acquire) > 0 && SmolImpl_TaskPoolTake(0, task))
+        SmolImpl_TaskPoolRun(task);
+    {
+        std::unique_lock<std::mutex> lock(group->mutex);
+        group->done.wait(lock, [group] { return group->remaining.load(std::memory_order_acquire) == 0; });
+    }
+    delete group;
+}
+
+static void SmolImpl_SetTaskScheduler(const SmolTaskScheduler* scheduler)
+{
+    if (scheduler != nullptr)
+    {
+        SMOL_ASSERT(scheduler->workerCount && scheduler->enqueue && scheduler->wait);
+        s_TaskScheduler = *scheduler;
+        return;
+    }
+    s_TaskScheduler = SmolTaskScheduler();
+    s_TaskScheduler.workerCount = SmolImpl_TaskPoolWorkerCountHook;
+    s_TaskScheduler.enqueue = SmolImpl_TaskPoolEnqueue;
+    s_TaskScheduler.wait = SmolImpl_TaskPoolWait;
+}
+
+// Stop built-in scheduler worker threads, if they were started.
+static void SmolImpl_ShutdownTaskScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(s_TaskPoolMutex);
+        s_TaskPoolQuit = true;
+    }
+    s_TaskPoolWake.notify_all();
+    for (size_t i = 0; i < s_TaskWorkers.size(); ++i)
+        s_TaskWorkers[i].join();
+    s_TaskWorkers.clear();
+    s_TaskWorkerCount = 0;
+    s_TaskQueues.reset();
+    s_TaskScheduler = SmolTaskScheduler();
+}
+
+// Copy memory; large copies are split into tasks on the scheduler.
+static const size_t kSmolImpl_CopyTaskSize = 4 * 1024 * 1024;
+struct SmolImpl_CopyJob
+{
+    uint8_t* dst;
+    const uint8_t* src;
+    size_t size;
+    int count;
+};
+static void SmolImpl_CopyTask(void* data, int index)
+{
+    const SmolImpl_CopyJob* job = (const SmolImpl_CopyJob*)data;
+    const size_t begin = job->size * index / job->count;
+    const size_t end = job->size * (index + 1) / job->count;
+    memcpy(job->dst + begin, job->src + begin, end - begin);
+}
+static void SmolImpl_Memcpy(void* dst, const void* src, size_t size)
+{
+    const int workers = size >= 2 * kSmolImpl_CopyTaskSize && s_TaskScheduler.workerCount ? s_TaskScheduler.workerCount(s_TaskScheduler.userData) : 0;
+    if (workers <= 0)
+    {
+        memcpy(dst, src, size);
+        return;
+    }
+    SmolImpl_CopyJob job = { (uint8_t*)dst, (const uint8_t*)src, size, 0 };
+    const size_t maxCount = size / kSmolImpl_CopyTaskSize;
+    job.count = (size_t)(workers + 1) < maxCount ? workers + 1 : (int)maxCount;
+    void* group = s_TaskScheduler.enqueue(s_TaskScheduler.userData, SmolImpl_CopyTask, &job, job.count);
+    s_TaskScheduler.wait(s_TaskScheduler.userData, group);
+}
+
+
 // ------------------------------------------------------------------------------------------------
 //  D3D11
 
 
 #if SMOL_COMPUTE_D3D11
-#include <d3d11.h>
+#include <d3d11_1.h>
 #include <d3dcompiler.h>
+#include <chrono>
+#include <memory>
+#include <stdio.h>
+#include <thread>
+#include <vector>
 
 static ID3D11Device* s_D3D11Device;
 static ID3D11DeviceContext* s_D3D11Context;
+static ID3D11DeviceContext1* s_D3D11Context1; // for binding constant buffer ranges; null if D3D11.1 is not available
+static ID3D11Buffer* s_D3D11ConstantBuffers[D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT]; // for SmolKernelSetConstants
+static UINT s_D3D11ConstantBufferSizes[D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT];
 
 #define SMOL_RELEASE(o) { if (o) (o)->Release(); (o) = nullptr; }
 
-bool SmolComputeCreate(SmolComputeCreateFlags flags)
+// SmolFence values are tracked with event queries; pending ones are in submit order
+struct SmolImpl_D3D11Fence
+{
+    uint64_t value;
+    ID3D11Query* query;
+};
+static std::vector<SmolImpl_D3D11Fence> s_D3D11Fences;
+static uint64_t s_D3D11FenceValue; // last fence value handed out
+static uint64_t s_D3D11CompletedFenceValue;
+
+// Completion callbacks waiting for their fence or readback
+struct SmolImpl_D3D11Completion
 {
+    SmolFence fence;
+    SmolReadback* readback; // if not null, waits for the readback instead of fence
+    SmolCompletionCallback callback;
+    void* userData;
+};
+static std::vector<SmolImpl_D3D11Completion> s_D3D11Completions;
+static void SmolImpl_D3D11RunCompletions();
+
+bool SmolComputeCreate(SmolComputeCreateFlags flags, const char* pipelineCachePath, const SmolTaskScheduler* scheduler)
+{
+    SmolImpl_SetTaskScheduler(scheduler);
 #if SMOL_COMPUTE_ENABLE_RENDERDOC
     if (HasFlag(flags, SmolComputeCreateFlags::EnableCapture))
         SmolImpl_LoadRenderDoc();
@@ -232,13 +850,27 @@ bool SmolComputeCreate(SmolComputeCreateFlags flags)
         hr = D3D11CreateDevice(NULL, driverType, NULL, 0, levels, 1, D3D11_SDK_VERSION, &s_D3D11Device, NULL, &s_D3D11Context);
     if (FAILED(hr))
         return false;
+    s_D3D11Context->QueryInterface(__uuidof(ID3D11DeviceContext1), (void**)&s_D3D11Context1);
     return true;
 }
 
 void SmolComputeDelete()
 {
+    for (int i = 0; i < D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT; ++i)
+    {
+        SMOL_RELEASE(s_D3D11ConstantBuffers[i]);
+        s_D3D11ConstantBufferSizes[i] = 0;
+    }
+    for (size_t i = 0; i < s_D3D11Fences.size(); ++i)
+        SMOL_RELEASE(s_D3D11Fences[i].query);
+    s_D3D11Fences.clear();
+    s_D3D11FenceValue = 0;
+    s_D3D11CompletedFenceValue = 0;
+    s_D3D11Completions.clear();
+    SMOL_RELEASE(s_D3D11Context1);
     SMOL_RELEASE(s_D3D11Context);
     SMOL_RELEASE(s_D3D11Device);
+    SmolImpl_ShutdownTaskScheduler();
 }
 
 SmolBackend SmolComputeGetBackend()
@@ -246,26 +878,201 @@ SmolBackend SmolComputeGetBackend()
     return SmolBackend::D3D11;
 }
 
+// all contexts record into the immediate device context
+struct SmolContext
+{
+};
+static SmolContext s_D3D11DefaultContext;
+static thread_local SmolContext* s_D3D11CurrentContext;
+
+SmolContext* SmolContextCreate()
+{
+    return new SmolContext();
+}
+
+void SmolContextDelete(SmolContext* context)
+{
+    SMOL_ASSERT(context != &s_D3D11DefaultContext);
+    if (s_D3D11CurrentContext == context)
+        s_D3D11CurrentContext = nullptr;
+    delete context;
+}
+
+void SmolContextSetCurrent(SmolContext* context)
+{
+    s_D3D11CurrentContext = context;
+}
+
+SmolContext* SmolContextGetCurrent()
+{
+    return s_D3D11CurrentContext != nullptr ? s_D3D11CurrentContext : &s_D3D11DefaultContext;
+}
+
+SmolResult SmolContextFlush(SmolContext* context)
+{
+    s_D3D11Context->Flush();
+    return SmolResult::Success;
+}
+
+void SmolContextSetFlushPolicy(SmolContext* context, const SmolFlushPolicy& policy)
+{
+}
+
+// Poll until done() returns true, for at most timeoutNs nanoseconds. Returns whether it did.
+template<typename F>
+static bool SmolImpl_D3D11Poll(F done, uint64_t timeoutNs)
+{
+    const auto start = std::chrono::steady_clock::now();
+    while (!done())
+    {
+        if ((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count() >= timeoutNs)
+            return false;
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+SmolFence SmolComputeFlush(SmolResult* result)
+{
+    if (result != nullptr)
+        *result = SmolResult::Success;
+    SmolFence fence;
+    fence.value = s_D3D11FenceValue;
+    D3D11_QUERY_DESC desc = { D3D11_QUERY_EVENT, 0 };
+    ID3D11Query* query = nullptr;
+    if (SUCCEEDED(s_D3D11Device->CreateQuery(&desc, &query)))
+    {
+        s_D3D11Context->End(query);
+        fence.value = ++s_D3D11FenceValue;
+        s_D3D11Fences.push_back({ fence.value, query });
+    }
+    s_D3D11Context->Flush();
+    SmolImpl_D3D11RunCompletions();
+    return fence;
+}
+
+static bool SmolImpl_D3D11PollFence(SmolFence fence)
+{
+    size_t done = 0;
+    while (done < s_D3D11Fences.size() && s_D3D11Context->GetData(s_D3D11Fences[done].query, nullptr, 0, D3D11_ASYNC_GETDATA_DONOTFLUSH) == S_OK)
+    {
+        s_D3D11CompletedFenceValue = s_D3D11Fences[done].value;
+        SMOL_RELEASE(s_D3D11Fences[done].query);
+        ++done;
+    }
+    s_D3D11Fences.erase(s_D3D11Fences.begin(), s_D3D11Fences.begin() + done);
+    return fence.value <= s_D3D11CompletedFenceValue;
+}
+
+bool SmolFenceIsComplete(SmolFence fence)
+{
+    bool done = SmolImpl_D3D11PollFence(fence);
+    SmolImpl_D3D11RunCompletions();
+    return done;
+}
+
+bool SmolFenceWait(SmolFence fence, uint64_t timeoutNs)
+{
+    return SmolImpl_D3D11Poll([&]() { return SmolFenceIsComplete(fence); }, timeoutNs);
+}
+
+bool SmolContextBeginParts(SmolContext* context, int partCount)
+{
+    return false;
+}
+
+SmolContext* SmolContextGetPart(SmolContext* context, int index)
+{
+    return nullptr;
+}
+
+void SmolContextEndParts(SmolContext* context)
+{
+}
+
+SmolCommandList* SmolCommandListBegin()
+{
+    return nullptr;
+}
+
+void SmolCommandListEnd(SmolCommandList* list)
+{
+}
+
+void SmolCommandListExecute(SmolCommandList* list)
+{
+}
+
+void SmolCommandListDelete(SmolCommandList* list)
+{
+}
+
+SmolPipelineCacheStats SmolComputeGetPipelineCacheStats()
+{
+    return SmolPipelineCacheStats();
+}
+
+SmolMemoryStats SmolComputeGetMemoryStats()
+{
+    return SmolMemoryStats();
+}
+
+SmolSubmitStats SmolComputeGetSubmitStats()
+{
+    return SmolSubmitStats();
+}
+
+void SmolComputeSetBackpressureLimits(const SmolBackpressureLimits& limits)
+{
+}
+
+void SmolComputeDefragment()
+{
+}
+
+
+// Views of a buffer sub-range, in elements
+struct SmolImpl_D3D11RangeViews
+{
+    UINT first = 0;
+    UINT count = 0;
+    ID3D11ShaderResourceView* srv = nullptr;
+    ID3D11UnorderedAccessView* uav = nullptr;
+};
 
 struct SmolBuffer
 {
     ID3D11Buffer* buffer = nullptr;
     ID3D11ShaderResourceView* srv = nullptr;
     ID3D11UnorderedAccessView* uav = nullptr;
+    std::vector<SmolImpl_D3D11RangeViews> rangeViews; // created by SmolKernelSetBufferRange
+    ID3D11Buffer* staging = nullptr; // for Readback usage buffers
+    ID3D11Buffer* mapStaging = nullptr; // while mapped
     size_t size = 0;
     SmolBufferType type = SmolBufferType::Structured;
+    SmolBufferUsage usage = SmolBufferUsage::Dynamic;
     size_t structElementSize = 0;
+    size_t mapOffset = 0;
+    size_t mapSize = 0;
+    SmolBufferMapAccess mapAccess = SmolBufferMapAccess::Read;
 };
 
-SmolBuffer* SmolBufferCreate(size_t byteSize, SmolBufferType type, size_t structElementSize)
+SmolBuffer* SmolBufferCreate(size_t byteSize, SmolBufferType type, size_t structElementSize, SmolBufferUsage usage)
 {
     D3D11_BUFFER_DESC desc = {};
     desc.ByteWidth = (UINT)byteSize;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.CPUAccessFlags = 0;
     if (type == SmolBufferType::Constant)
     {
         SMOL_ASSERT(structElementSize == 0);
         desc.ByteWidth = (desc.ByteWidth + 15) / 16 * 16;
         desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+        if (usage == SmolBufferUsage::Upload)
+        {
+            desc.Usage = D3D11_USAGE_DYNAMIC;
+            desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+        }
     }
     else if (type == SmolBufferType::Structured)
     {
@@ -274,8 +1081,13 @@ SmolBuffer* SmolBufferCreate(size_t byteSize, SmolBufferType type, size_t struct
         desc.StructureByteStride = (UINT)structElementSize;
         desc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
     }
-    desc.Usage = D3D11_USAGE_DEFAULT;
-    desc.CPUAccessFlags = 0;
+    else if (type == SmolBufferType::Indirect)
+    {
+        // indirect arguments can't be in a structured buffer; use raw views for kernel access
+        SMOL_ASSERT(byteSize % 4 == 0);
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_UNORDERED_ACCESS;
+        desc.MiscFlags = D3D11_RESOURCE_MISC_DRAWINDIRECT_ARGS | D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
+    }
     ID3D11Buffer* buffer = nullptr;
     HRESULT hr = s_D3D11Device->CreateBuffer(&desc, NULL, &buffer);
     if (FAILED(hr))
@@ -285,6 +1097,7 @@ SmolBuffer* SmolBufferCreate(size_t byteSize, SmolBufferType type, size_t struct
     buf->buffer = buffer;
     buf->size = byteSize;
     buf->type = type;
+    buf->usage = usage;
     buf->structElementSize = structElementSize;
     return buf;
 }
@@ -299,6 +1112,17 @@ void SmolBufferSetData(SmolBuffer* buffer, const void* src, size_t size, size_t
     {
         SMOL_ASSERT(fullBufferUpdate);
     }
+    if (buffer->usage == SmolBufferUsage::Upload && buffer->type == SmolBufferType::Constant)
+    {
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        HRESULT hr = s_D3D11Context->Map(buffer->buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped);
+        if (SUCCEEDED(hr))
+        {
+            memcpy(mapped.pData, src, size);
+            s_D3D11Context->Unmap(buffer->buffer, 0);
+        }
+        return;
+    }
     D3D11_BOX box = {};
     box.left = (UINT)dstOffset;
     box.right = (UINT)(dstOffset + size);
@@ -311,44 +1135,248 @@ void SmolBufferGetData(SmolBuffer* buffer, void* dst, size_t size, size_t srcOff
     SMOL_ASSERT(buffer);
     SMOL_ASSERT(srcOffset + size <= buffer->size);
 
-    ID3D11Buffer* staging = nullptr;
-    D3D11_BUFFER_DESC desc = {};
-    desc.ByteWidth = (UINT)size;
-    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
-    desc.Usage = D3D11_USAGE_STAGING;
-    desc.BindFlags = 0;
-    desc.MiscFlags = 0;
-    desc.StructureByteStride = (UINT)buffer->structElementSize;
-    HRESULT hr = s_D3D11Device->CreateBuffer(&desc, NULL, &staging);
-    if (FAILED(hr))
-        return;
+    // Readback buffers keep a full size staging buffer around; others create a temporary one
+    const bool keepStaging = buffer->usage == SmolBufferUsage::Readback;
+    ID3D11Buffer* staging = buffer->staging;
+    if (staging == nullptr)
+    {
+        D3D11_BUFFER_DESC desc = {};
+        desc.ByteWidth = (UINT)(keepStaging ? buffer->size : size);
+        desc.CPUAccessFlags = keepStaging ? (D3D11_CPU_ACCESS_READ | D3D11_CPU_ACCESS_WRITE) : D3D11_CPU_ACCESS_READ;
+        desc.Usage = D3D11_USAGE_STAGING;
+        desc.BindFlags = 0;
+        desc.MiscFlags = 0;
+        desc.StructureByteStride = (UINT)buffer->structElementSize;
+        HRESULT hr = s_D3D11Device->CreateBuffer(&desc, NULL, &staging);
+        if (FAILED(hr))
+            return;
+        if (keepStaging)
+            buffer->staging = staging;
+    }
+    const UINT stagingOffset = keepStaging ? (UINT)srcOffset : 0;
 
     D3D11_BOX box = {};
     box.left = (UINT)srcOffset;
     box.right = (UINT)(srcOffset + size);
     box.bottom = box.back = 1;
-    s_D3D11Context->CopySubresourceRegion(staging, 0, 0, 0, 0, buffer->buffer, 0, &box);
+    s_D3D11Context->CopySubresourceRegion(staging, 0, stagingOffset, 0, 0, buffer->buffer, 0, &box);
 
     D3D11_MAPPED_SUBRESOURCE mapped;
-    hr = s_D3D11Context->Map(staging, 0, D3D11_MAP_READ, 0, &mapped);
+    HRESULT hr = s_D3D11Context->Map(staging, 0, D3D11_MAP_READ, 0, &mapped);
     if (SUCCEEDED(hr))
     {
-        memcpy(dst, mapped.pData, size);
+        SmolImpl_Memcpy(dst, (const uint8_t*)mapped.pData + stagingOffset, size);
         s_D3D11Context->Unmap(staging, 0);
     }
-    SMOL_RELEASE(staging);
+    if (!keepStaging)
+        SMOL_RELEASE(staging);
 }
 
-void SmolBufferDelete(SmolBuffer* buffer)
+struct SmolReadback
 {
-    if (buffer == nullptr)
-        return;
-    SMOL_RELEASE(buffer->uav);
-    SMOL_RELEASE(buffer->srv);
-    SMOL_RELEASE(buffer->buffer);
-    delete buffer;
-}
-
+    ID3D11Buffer* staging = nullptr; // released once data is read
+    void* dst = nullptr;
+    size_t size = 0;
+    bool done = false;
+};
+
+SmolReadback* SmolBufferGetDataAsync(SmolBuffer* buffer, void* dst, size_t size, size_t srcOffset)
+{
+    SMOL_ASSERT(buffer);
+    SMOL_ASSERT(size > 0 && srcOffset + size <= buffer->size);
+
+    D3D11_BUFFER_DESC desc = {};
+    desc.ByteWidth = (UINT)size;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.StructureByteStride = (UINT)buffer->structElementSize;
+    ID3D11Buffer* staging = nullptr;
+    HRESULT hr = s_D3D11Device->CreateBuffer(&desc, NULL, &staging);
+    if (FAILED(hr))
+        return nullptr;
+
+    D3D11_BOX box = {};
+    box.left = (UINT)srcOffset;
+    box.right = (UINT)(srcOffset + size);
+    box.bottom = box.back = 1;
+    s_D3D11Context->CopySubresourceRegion(staging, 0, 0, 0, 0, buffer->buffer, 0, &box);
+
+    SmolReadback* readback = new SmolReadback();
+    readback->staging = staging;
+    readback->dst = dst;
+    readback->size = size;
+    return readback;
+}
+
+static bool SmolImpl_D3D11PollReadback(SmolReadback* readback)
+{
+    if (readback->done)
+        return true;
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    HRESULT hr = s_D3D11Context->Map(readback->staging, 0, D3D11_MAP_READ, D3D11_MAP_FLAG_DO_NOT_WAIT, &mapped);
+    if (hr == DXGI_ERROR_WAS_STILL_DRAWING)
+        return false;
+    if (SUCCEEDED(hr))
+    {
+        SmolImpl_Memcpy(readback->dst, mapped.pData, readback->size);
+        s_D3D11Context->Unmap(readback->staging, 0);
+    }
+    SMOL_RELEASE(readback->staging);
+    readback->done = true;
+    return true;
+}
+
+bool SmolReadbackIsComplete(SmolReadback* readback)
+{
+    SMOL_ASSERT(readback);
+    bool done = SmolImpl_D3D11PollReadback(readback);
+    SmolImpl_D3D11RunCompletions();
+    return done;
+}
+
+bool SmolReadbackWait(SmolReadback* readback, uint64_t timeoutNs)
+{
+    SMOL_ASSERT(readback);
+    if (!readback->done)
+        s_D3D11Context->Flush();
+    return SmolImpl_D3D11Poll([&]() { return SmolReadbackIsComplete(readback); }, timeoutNs);
+}
+
+// Call callbacks whose fence or readback is complete.
+static void SmolImpl_D3D11RunCompletions()
+{
+    if (s_D3D11Completions.empty())
+        return;
+    std::vector<SmolImpl_D3D11Completion> ready;
+    size_t dst = 0;
+    for (size_t i = 0; i < s_D3D11Completions.size(); ++i)
+    {
+        const SmolImpl_D3D11Completion& c = s_D3D11Completions[i];
+        if (c.readback != nullptr ? SmolImpl_D3D11PollReadback(c.readback) : SmolImpl_D3D11PollFence(c.fence))
+            ready.push_back(c);
+        else
+            s_D3D11Completions[dst++] = c;
+    }
+    s_D3D11Completions.resize(dst);
+    // callbacks can check fences and add completions themselves
+    for (size_t i = 0; i < ready.size(); ++i)
+        ready[i].callback(ready[i].userData);
+}
+
+void SmolFenceOnComplete(SmolFence fence, SmolCompletionCallback callback, void* userData)
+{
+    s_D3D11Completions.push_back({ fence, nullptr, callback, userData });
+    SmolImpl_D3D11RunCompletions();
+}
+
+void SmolReadbackOnComplete(SmolReadback* readback, SmolCompletionCallback callback, void* userData)
+{
+    SMOL_ASSERT(readback);
+    s_D3D11Completions.push_back({ SmolFence(), readback, callback, userData });
+    SmolImpl_D3D11RunCompletions();
+}
+
+void SmolReadbackDelete(SmolReadback* readback)
+{
+    if (readback == nullptr)
+        return;
+    SMOL_RELEASE(readback->staging);
+    delete readback;
+}
+
+void* SmolBufferMap(SmolBuffer* buffer, SmolBufferMapAccess access, size_t offset, size_t size)
+{
+    SMOL_ASSERT(buffer);
+    SMOL_ASSERT(buffer->mapStaging == nullptr);
+    if (size == 0)
+        size = buffer->size - offset;
+    SMOL_ASSERT(offset + size <= buffer->size);
+    buffer->mapOffset = offset;
+    buffer->mapSize = size;
+    buffer->mapAccess = access;
+
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    if (buffer->usage == SmolBufferUsage::Upload && buffer->type == SmolBufferType::Constant)
+    {
+        // dynamic constant buffer: can only be fully overwritten
+        SMOL_ASSERT(access == SmolBufferMapAccess::Write && offset == 0 && size == buffer->size);
+        HRESULT hr = s_D3D11Context->Map(buffer->buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped);
+        if (FAILED(hr))
+            return nullptr;
+        buffer->mapStaging = buffer->buffer;
+        buffer->mapStaging->AddRef();
+        return mapped.pData;
+    }
+
+    // map a staging copy of the data range
+    const bool fullStaging = buffer->staging != nullptr;
+    ID3D11Buffer* staging = buffer->staging;
+    if (staging != nullptr)
+        staging->AddRef();
+    else
+    {
+        D3D11_BUFFER_DESC desc = {};
+        desc.ByteWidth = (UINT)size;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ | D3D11_CPU_ACCESS_WRITE;
+        desc.Usage = D3D11_USAGE_STAGING;
+        HRESULT hr = s_D3D11Device->CreateBuffer(&desc, NULL, &staging);
+        if (FAILED(hr))
+            return nullptr;
+    }
+    const UINT stagingOffset = fullStaging ? (UINT)offset : 0;
+    if (HasFlag(access, SmolBufferMapAccess::Read))
+    {
+        D3D11_BOX box = {};
+        box.left = (UINT)offset;
+        box.right = (UINT)(offset + size);
+        box.bottom = box.back = 1;
+        s_D3D11Context->CopySubresourceRegion(staging, 0, stagingOffset, 0, 0, buffer->buffer, 0, &box);
+    }
+    D3D11_MAP mapType = access == SmolBufferMapAccess::ReadWrite ? D3D11_MAP_READ_WRITE : (access == SmolBufferMapAccess::Read ? D3D11_MAP_READ : D3D11_MAP_WRITE);
+    HRESULT hr = s_D3D11Context->Map(staging, 0, mapType, 0, &mapped);
+    if (FAILED(hr))
+    {
+        SMOL_RELEASE(staging);
+        return nullptr;
+    }
+    buffer->mapStaging = staging;
+    return (uint8_t*)mapped.pData + stagingOffset;
+}
+
+void SmolBufferUnmap(SmolBuffer* buffer)
+{
+    SMOL_ASSERT(buffer);
+    SMOL_ASSERT(buffer->mapStaging != nullptr);
+    s_D3D11Context->Unmap(buffer->mapStaging, 0);
+    if (buffer->mapStaging != buffer->buffer && HasFlag(buffer->mapAccess, SmolBufferMapAccess::Write))
+    {
+        const UINT stagingOffset = buffer->mapStaging == buffer->staging ? (UINT)buffer->mapOffset : 0;
+        D3D11_BOX box = {};
+        box.left = stagingOffset;
+        box.right = (UINT)(stagingOffset + buffer->mapSize);
+        box.bottom = box.back = 1;
+        s_D3D11Context->CopySubresourceRegion(buffer->buffer, 0, (UINT)buffer->mapOffset, 0, 0, buffer->mapStaging, 0, &box);
+    }
+    SMOL_RELEASE(buffer->mapStaging);
+}
+
+void SmolBufferDelete(SmolBuffer* buffer)
+{
+    if (buffer == nullptr)
+        return;
+    SMOL_RELEASE(buffer->mapStaging);
+    for (size_t i = 0; i < buffer->rangeViews.size(); ++i)
+    {
+        SMOL_RELEASE(buffer->rangeViews[i].uav);
+        SMOL_RELEASE(buffer->rangeViews[i].srv);
+    }
+    SMOL_RELEASE(buffer->uav);
+    SMOL_RELEASE(buffer->srv);
+    SMOL_RELEASE(buffer->staging);
+    SMOL_RELEASE(buffer->buffer);
+    delete buffer;
+}
+
 struct SmolKernel
 {
     ID3D11ComputeShader* kernel;
@@ -356,6 +1384,35 @@ struct SmolKernel
 
 SmolKernel* SmolKernelCreate(const void* shaderCode, size_t shaderCodeSize, const char* entryPoint, SmolKernelCreateFlags flags)
 {
+    return SmolKernelCreate(shaderCode, shaderCodeSize, entryPoint, nullptr, 0, flags);
+}
+
+SmolKernel* SmolKernelCreate(const void* shaderCode, size_t shaderCodeSize, const char* entryPoint, const SmolKernelSpecialization* specializations, int specializationCount, SmolKernelCreateFlags flags)
+{
+    // specialization constants turn into SMOL_SPEC_<id> macros
+    struct SpecMacro { char name[32]; char value[32]; };
+    auto specMacros = std::unique_ptr<SpecMacro[]>(new SpecMacro[specializationCount + 1]);
+    auto macros = std::unique_ptr<D3D_SHADER_MACRO[]>(new D3D_SHADER_MACRO[specializationCount + 1]);
+    for (int i = 0; i < specializationCount; ++i)
+    {
+        const SmolKernelSpecialization& spec = specializations[i];
+        snprintf(specMacros[i].name, sizeof(specMacros[i].name), "SMOL_SPEC_%i", spec.constantId);
+        if (spec.type == SmolKernelSpecialization::Type::Float)
+        {
+            UINT bits;
+            memcpy(&bits, &spec.floatValue, sizeof(bits));
+            snprintf(specMacros[i].value, sizeof(specMacros[i].value), "asfloat(0x%08xu)", bits);
+        }
+        else if (spec.type == SmolKernelSpecialization::Type::Bool)
+            snprintf(specMacros[i].value, sizeof(specMacros[i].value), "%s", spec.boolValue ? "true" : "false");
+        else
+            snprintf(specMacros[i].value, sizeof(specMacros[i].value), "%i", spec.intValue);
+        macros[i].Name = specMacros[i].name;
+        macros[i].Definition = specMacros[i].value;
+    }
+    macros[specializationCount].Name = NULL;
+    macros[specializationCount].Definition = NULL;
+
     ID3DBlob* bytecode = nullptr;
     ID3DBlob* errors = nullptr;
     UINT d3dflags = 0;
@@ -365,7 +1422,7 @@ SmolKernel* SmolKernelCreate(const void* shaderCode, size_t shaderCodeSize, cons
         d3dflags |= D3DCOMPILE_SKIP_OPTIMIZATION;
     if (HasFlag(flags, SmolKernelCreateFlags::GenerateDebugInfo))
         d3dflags |= D3DCOMPILE_DEBUG;
-    HRESULT hr = D3DCompile(shaderCode, shaderCodeSize, "", NULL, NULL, entryPoint, "cs_5_0", d3dflags, 0, &bytecode, &errors);
+    HRESULT hr = D3DCompile(shaderCode, shaderCodeSize, "", macros.get(), NULL, entryPoint, "cs_5_0", d3dflags, 0, &bytecode, &errors);
     if (FAILED(hr))
     {
         const char* errMsg = (const char*)errors->GetBufferPointer();
@@ -416,57 +1473,198 @@ void SmolKernelSet(SmolKernel* kernel)
     s_D3D11Context->CSSetUnorderedAccessViews(0, 8, nullUavs, nullptr);
 }
 
+static ID3D11ShaderResourceView* SmolImpl_D3D11CreateSRV(SmolBuffer* buffer, UINT first, UINT count)
+{
+    D3D11_SHADER_RESOURCE_VIEW_DESC desc = {};
+    if (buffer->type == SmolBufferType::Indirect)
+    {
+        desc.Format = DXGI_FORMAT_R32_TYPELESS;
+        desc.ViewDimension = D3D11_SRV_DIMENSION_BUFFEREX;
+        desc.BufferEx.FirstElement = first;
+        desc.BufferEx.NumElements = count;
+        desc.BufferEx.Flags = D3D11_BUFFEREX_SRV_FLAG_RAW;
+    }
+    else
+    {
+        desc.Format = DXGI_FORMAT_UNKNOWN;
+        desc.ViewDimension = D3D11_SRV_DIMENSION_BUFFER;
+        desc.Buffer.FirstElement = first;
+        desc.Buffer.NumElements = count;
+    }
+    ID3D11ShaderResourceView* srv = nullptr;
+    HRESULT hr = s_D3D11Device->CreateShaderResourceView(buffer->buffer, &desc, &srv);
+    SMOL_ASSERT(SUCCEEDED(hr));
+    return srv;
+}
+
+static ID3D11UnorderedAccessView* SmolImpl_D3D11CreateUAV(SmolBuffer* buffer, UINT first, UINT count)
+{
+    D3D11_UNORDERED_ACCESS_VIEW_DESC desc = {};
+    desc.ViewDimension = D3D11_UAV_DIMENSION_BUFFER;
+    desc.Buffer.FirstElement = first;
+    desc.Buffer.NumElements = count;
+    if (buffer->type == SmolBufferType::Indirect)
+    {
+        desc.Format = DXGI_FORMAT_R32_TYPELESS;
+        desc.Buffer.Flags = D3D11_BUFFER_UAV_FLAG_RAW;
+    }
+    else
+    {
+        desc.Format = DXGI_FORMAT_UNKNOWN;
+    }
+    ID3D11UnorderedAccessView* uav = nullptr;
+    HRESULT hr = s_D3D11Device->CreateUnorderedAccessView(buffer->buffer, &desc, &uav);
+    SMOL_ASSERT(SUCCEEDED(hr));
+    return uav;
+}
+
+size_t SmolBufferGetOffsetAlignment(SmolBufferType type)
+{
+    // constant buffer ranges are in 16 constants (256 bytes) units; structured buffer
+    // ranges additionally have to be a multiple of the element size
+    return type == SmolBufferType::Constant ? 256 : 4;
+}
+
 void SmolKernelSetBuffer(SmolBuffer* buffer, int index, SmolBufferBinding binding)
+{
+    SmolKernelSetBufferRange(buffer, index, 0, 0, binding);
+}
+
+void SmolKernelSetBufferRange(SmolBuffer* buffer, int index, size_t offset, size_t size, SmolBufferBinding binding)
 {
     SMOL_ASSERT(buffer);
     SMOL_ASSERT(buffer->buffer);
-    switch (binding)
+    if (size == 0)
+        size = buffer->size - offset;
+    SMOL_ASSERT(offset + size <= buffer->size);
+    SMOL_ASSERT(offset % SmolBufferGetOffsetAlignment(buffer->type) == 0);
+    const bool wholeBuffer = offset == 0 && size == buffer->size;
+    if (binding == SmolBufferBinding::Constant)
     {
-    case SmolBufferBinding::Constant:
         SMOL_ASSERT(buffer->type == SmolBufferType::Constant);
-        s_D3D11Context->CSSetConstantBuffers(index, 1, &buffer->buffer);
-        break;
+        if (wholeBuffer)
+        {
+            s_D3D11Context->CSSetConstantBuffers(index, 1, &buffer->buffer);
+        }
+        else
+        {
+            SMOL_ASSERT(s_D3D11Context1 != nullptr);
+            UINT firstConstant = (UINT)(offset / 16);
+            UINT numConstants = (UINT)((size + 255) / 256 * 16);
+            s_D3D11Context1->CSSetConstantBuffers1(index, 1, &buffer->buffer, &firstConstant, &numConstants);
+        }
+        return;
+    }
+
+    SMOL_ASSERT(buffer->type == SmolBufferType::Structured || buffer->type == SmolBufferType::Indirect);
+    const size_t elementSize = buffer->type == SmolBufferType::Indirect ? 4 : buffer->structElementSize;
+    SMOL_ASSERT(elementSize != 0);
+    SMOL_ASSERT(offset % elementSize == 0 && size % elementSize == 0);
+    const UINT first = (UINT)(offset / elementSize);
+    const UINT count = (UINT)(size / elementSize);
+
+    // whole buffer views live in the buffer itself, sub-range views are created as needed and kept around
+    SmolImpl_D3D11RangeViews* views = nullptr;
+    if (!wholeBuffer)
+    {
+        for (size_t i = 0; i < buffer->rangeViews.size(); ++i)
+        {
+            if (buffer->rangeViews[i].first == first && buffer->rangeViews[i].count == count)
+            {
+                views = &buffer->rangeViews[i];
+                break;
+            }
+        }
+        if (views == nullptr)
+        {
+            SmolImpl_D3D11RangeViews rv;
+            rv.first = first;
+            rv.count = count;
+            buffer->rangeViews.push_back(rv);
+            views = &buffer->rangeViews.back();
+        }
+    }
+    ID3D11ShaderResourceView*& srv = views ? views->srv : buffer->srv;
+    ID3D11UnorderedAccessView*& uav = views ? views->uav : buffer->uav;
+    switch (binding)
+    {
     case SmolBufferBinding::Input:
-        SMOL_ASSERT(buffer->type == SmolBufferType::Structured);
-        if (buffer->srv == nullptr)
-        {
-            SMOL_ASSERT(buffer->structElementSize != 0);
-            D3D11_SHADER_RESOURCE_VIEW_DESC desc = {};
-            desc.Format = DXGI_FORMAT_UNKNOWN;
-            desc.ViewDimension = D3D11_SRV_DIMENSION_BUFFER;
-            desc.Buffer.FirstElement = 0;
-            desc.Buffer.NumElements = (UINT)(buffer->size / buffer->structElementSize);
-            HRESULT hr = s_D3D11Device->CreateShaderResourceView(buffer->buffer, &desc, &buffer->srv);
-            SMOL_ASSERT(SUCCEEDED(hr));
-        }
-        s_D3D11Context->CSSetShaderResources(index, 1, &buffer->srv);
+        if (srv == nullptr)
+            srv = SmolImpl_D3D11CreateSRV(buffer, first, count);
+        s_D3D11Context->CSSetShaderResources(index, 1, &srv);
         break;
     case SmolBufferBinding::Output:
-        SMOL_ASSERT(buffer->type == SmolBufferType::Structured);
-        if (buffer->uav == nullptr)
-        {
-            SMOL_ASSERT(buffer->structElementSize != 0);
-            D3D11_UNORDERED_ACCESS_VIEW_DESC desc = {};
-            desc.Format = DXGI_FORMAT_UNKNOWN;
-            desc.ViewDimension = D3D11_UAV_DIMENSION_BUFFER;
-            desc.Buffer.FirstElement = 0;
-            desc.Buffer.NumElements = (UINT)(buffer->size / buffer->structElementSize);
-            HRESULT hr = s_D3D11Device->CreateUnorderedAccessView(buffer->buffer, &desc, &buffer->uav);
-            SMOL_ASSERT(SUCCEEDED(hr));
-        }
-        s_D3D11Context->CSSetUnorderedAccessViews(index, 1, &buffer->uav, NULL);
+        if (uav == nullptr)
+            uav = SmolImpl_D3D11CreateUAV(buffer, first, count);
+        s_D3D11Context->CSSetUnorderedAccessViews(index, 1, &uav, NULL);
         break;
     default:
         SMOL_ASSERT(false);
     }
 }
 
-void SmolKernelDispatch(int threadsX, int threadsY, int threadsZ, int groupSizeX, int groupSizeY, int groupSizeZ)
+void SmolKernelSetConstants(const void* data, size_t size, int index)
+{
+    SMOL_ASSERT(data != nullptr && size > 0);
+    SMOL_ASSERT(index >= 0 && index < D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT);
+    // one dynamic constant buffer per slot; mapping with discard lets the driver rename it for each dispatch
+    UINT byteSize = (UINT)((size + 15) & ~15);
+    if (s_D3D11ConstantBufferSizes[index] < byteSize)
+    {
+        SMOL_RELEASE(s_D3D11ConstantBuffers[index]);
+        s_D3D11ConstantBufferSizes[index] = 0;
+        D3D11_BUFFER_DESC desc = {};
+        desc.ByteWidth = byteSize;
+        desc.Usage = D3D11_USAGE_DYNAMIC;
+        desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+        HRESULT hr = s_D3D11Device->CreateBuffer(&desc, NULL, &s_D3D11ConstantBuffers[index]);
+        if (FAILED(hr))
+            return;
+        s_D3D11ConstantBufferSizes[index] = byteSize;
+    }
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    HRESULT hr = s_D3D11Context->Map(s_D3D11ConstantBuffers[index], 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped);
+    if (FAILED(hr))
+        return;
+    memcpy(mapped.pData, data, size);
+    s_D3D11Context->Unmap(s_D3D11ConstantBuffers[index], 0);
+    s_D3D11Context->CSSetConstantBuffers(index, 1, &s_D3D11ConstantBuffers[index]);
+}
+
+SmolResult SmolKernelDispatch(int threadsX, int threadsY, int threadsZ, int groupSizeX, int groupSizeY, int groupSizeZ)
 {
     int groupsX = (threadsX + groupSizeX - 1) / groupSizeX;
     int groupsY = (threadsY + groupSizeY - 1) / groupSizeY;
     int groupsZ = (threadsZ + groupSizeZ - 1) / groupSizeZ;
     s_D3D11Context->Dispatch(groupsX, groupsY, groupsZ);
+    return SmolResult::Success;
+}
+
+SmolResult SmolKernelDispatchIndirect(SmolBuffer* argsBuffer, size_t argsOffset, int groupSizeX, int groupSizeY, int groupSizeZ)
+{
+    SMOL_ASSERT(argsBuffer != nullptr && argsBuffer->type == SmolBufferType::Indirect);
+    SMOL_ASSERT(argsOffset % 4 == 0 && argsOffset + 12 <= argsBuffer->size);
+    s_D3D11Context->DispatchIndirect(argsBuffer->buffer, (UINT)argsOffset);
+    return SmolResult::Success;
+}
+
+SmolKernelStats SmolKernelGetStats(SmolKernel* kernel)
+{
+    return SmolKernelStats();
+}
+
+void SmolProfileBegin(const char* name)
+{
+}
+
+void SmolProfileEnd()
+{
+}
+
+int SmolProfileGetResults(SmolProfileResult* results, int maxResults)
+{
+    return 0;
 }
 
 void SmolCaptureStart()
@@ -544,12 +1742,19 @@ VK_DEFINE_NON_DISPATCHABLE_HANDLE(VkSampler)
 VK_DEFINE_NON_DISPATCHABLE_HANDLE(VkBufferView)
 VK_DEFINE_NON_DISPATCHABLE_HANDLE(VkPipelineCache)
 VK_DEFINE_NON_DISPATCHABLE_HANDLE(VkFence)
+VK_DEFINE_NON_DISPATCHABLE_HANDLE(VkQueryPool)
+VK_DEFINE_NON_DISPATCHABLE_HANDLE(VkRenderPass)
+VK_DEFINE_NON_DISPATCHABLE_HANDLE(VkFramebuffer)
 
 #define VK_FALSE                          0
 #define VK_TRUE                           1
 #define VK_WHOLE_SIZE                     (~0ULL)
+#define VK_QUEUE_FAMILY_IGNORED           (~0U)
 #define VK_MAX_MEMORY_TYPES               32
 #define VK_MAX_MEMORY_HEAPS               16
+#define VK_MAX_PHYSICAL_DEVICE_NAME_SIZE  256
+#define VK_UUID_SIZE                      16
+#define VK_MAX_EXTENSION_NAME_SIZE        256
 
 typedef enum VkResult {
     VK_SUCCESS = 0,
@@ -582,6 +1787,9 @@ typedef enum VkStructureType {
     VK_STRUCTURE_TYPE_SUBMIT_INFO = 4,
     VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO = 5,
     VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE = 6,
+    VK_STRUCTURE_TYPE_FENCE_CREATE_INFO = 8,
+    VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO = 9,
+    VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO = 11,
     VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO = 12,
     VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO = 16,
     VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO = 17,
@@ -594,9 +1802,18 @@ typedef enum VkStructureType {
     VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET = 35,
     VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO = 39,
     VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO = 40,
+    VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO = 41,
     VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO = 42,
+    VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER = 44,
+    VK_STRUCTURE_TYPE_MEMORY_BARRIER = 46,
 
     VK_STRUCTURE_TYPE_DEBUG_REPORT_CALLBACK_CREATE_INFO_EXT = 1000011000,
+    VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 = 1000059000,
+    VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT = 1000192000,
+    VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR = 1000207000,
+    VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR = 1000207002,
+    VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR = 1000207003,
+    VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR = 1000207004,
     VK_STRUCTURE_TYPE_DEBUG_REPORT_CREATE_INFO_EXT = VK_STRUCTURE_TYPE_DEBUG_REPORT_CALLBACK_CREATE_INFO_EXT,
 
     VK_STRUCTURE_TYPE_MAX_ENUM = 0x7FFFFFFF
@@ -627,6 +1844,17 @@ typedef enum VkCommandBufferLevel {
 
 typedef VkFlags VkInstanceCreateFlags;
 
+typedef enum VkPhysicalDeviceType {
+    VK_PHYSICAL_DEVICE_TYPE_OTHER = 0,
+    VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU = 1,
+    VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU = 2,
+    VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU = 3,
+    VK_PHYSICAL_DEVICE_TYPE_CPU = 4,
+    VK_PHYSICAL_DEVICE_TYPE_MAX_ENUM = 0x7FFFFFFF
+} VkPhysicalDeviceType;
+
+typedef VkFlags VkSampleCountFlags;
+
 typedef enum VkMemoryHeapFlagBits {
     VK_MEMORY_HEAP_DEVICE_LOCAL_BIT = 0x00000001,
     VK_MEMORY_HEAP_MULTI_INSTANCE_BIT = 0x00000002,
@@ -667,6 +1895,7 @@ typedef VkFlags VkDeviceQueueCreateFlags;
 
 typedef enum VkPipelineStageFlagBits {
     VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT = 0x00000001,
+    VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT = 0x00000002,
     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT = 0x00000800,
     VK_PIPELINE_STAGE_TRANSFER_BIT = 0x00001000,
     VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT = 0x00002000,
@@ -692,6 +1921,7 @@ typedef enum VkBufferUsageFlagBits {
     VK_BUFFER_USAGE_TRANSFER_DST_BIT = 0x00000002,
     VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT = 0x00000010,
     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT = 0x00000020,
+    VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT = 0x00000100,
     VK_BUFFER_USAGE_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
 } VkBufferUsageFlagBits;
 typedef VkFlags VkBufferUsageFlags;
@@ -711,6 +1941,7 @@ typedef enum VkPipelineCreateFlagBits {
     VK_PIPELINE_CREATE_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
 } VkPipelineCreateFlagBits;
 typedef VkFlags VkPipelineCreateFlags;
+typedef VkFlags VkPipelineCacheCreateFlags;
 
 typedef enum VkPipelineShaderStageCreateFlagBits {
     VK_PIPELINE_SHADER_STAGE_CREATE_ALLOW_VARYING_SUBGROUP_SIZE_BIT_EXT = 0x00000001,
@@ -776,6 +2007,37 @@ typedef VkFlags VkCommandBufferResetFlags;
 
 typedef VkFlags VkDependencyFlags;
 
+typedef enum VkFenceCreateFlagBits {
+    VK_FENCE_CREATE_SIGNALED_BIT = 0x00000001,
+    VK_FENCE_CREATE_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
+} VkFenceCreateFlagBits;
+typedef VkFlags VkFenceCreateFlags;
+typedef VkFlags VkSemaphoreCreateFlags;
+
+typedef enum VkQueryType {
+    VK_QUERY_TYPE_OCCLUSION = 0,
+    VK_QUERY_TYPE_PIPELINE_STATISTICS = 1,
+    VK_QUERY_TYPE_TIMESTAMP = 2,
+    VK_QUERY_TYPE_MAX_ENUM = 0x7FFFFFFF
+} VkQueryType;
+typedef VkFlags VkQueryPoolCreateFlags;
+typedef VkFlags VkQueryControlFlags;
+
+typedef enum VkQueryPipelineStatisticFlagBits {
+    VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT = 0x00000400,
+    VK_QUERY_PIPELINE_STATISTIC_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
+} VkQueryPipelineStatisticFlagBits;
+typedef VkFlags VkQueryPipelineStatisticFlags;
+
+typedef enum VkQueryResultFlagBits {
+    VK_QUERY_RESULT_64_BIT = 0x00000001,
+    VK_QUERY_RESULT_WAIT_BIT = 0x00000002,
+    VK_QUERY_RESULT_WITH_AVAILABILITY_BIT = 0x00000004,
+    VK_QUERY_RESULT_PARTIAL_BIT = 0x00000008,
+    VK_QUERY_RESULT_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
+} VkQueryResultFlagBits;
+typedef VkFlags VkQueryResultFlags;
+
 typedef enum VkAccessFlagBits {
     VK_ACCESS_INDIRECT_COMMAND_READ_BIT = 0x00000001,
     VK_ACCESS_INDEX_READ_BIT = 0x00000002,
@@ -838,7 +2100,197 @@ typedef struct VkMemoryType {
     uint32_t                 heapIndex;
 } VkMemoryType;
 
-struct VkPhysicalDeviceFeatures;
+typedef struct VkPhysicalDeviceFeatures {
+    VkBool32    robustBufferAccess;
+    VkBool32    fullDrawIndexUint32;
+    VkBool32    imageCubeArray;
+    VkBool32    independentBlend;
+    VkBool32    geometryShader;
+    VkBool32    tessellationShader;
+    VkBool32    sampleRateShading;
+    VkBool32    dualSrcBlend;
+    VkBool32    logicOp;
+    VkBool32    multiDrawIndirect;
+    VkBool32    drawIndirectFirstInstance;
+    VkBool32    depthClamp;
+    VkBool32    depthBiasClamp;
+    VkBool32    fillModeNonSolid;
+    VkBool32    depthBounds;
+    VkBool32    wideLines;
+    VkBool32    largePoints;
+    VkBool32    alphaToOne;
+    VkBool32    multiViewport;
+    VkBool32    samplerAnisotropy;
+    VkBool32    textureCompressionETC2;
+    VkBool32    textureCompressionASTC_LDR;
+    VkBool32    textureCompressionBC;
+    VkBool32    occlusionQueryPrecise;
+    VkBool32    pipelineStatisticsQuery;
+    VkBool32    vertexPipelineStoresAndAtomics;
+    VkBool32    fragmentStoresAndAtomics;
+    VkBool32    shaderTessellationAndGeometryPointSize;
+    VkBool32    shaderImageGatherExtended;
+    VkBool32    shaderStorageImageExtendedFormats;
+    VkBool32    shaderStorageImageMultisample;
+    VkBool32    shaderStorageImageReadWithoutFormat;
+    VkBool32    shaderStorageImageWriteWithoutFormat;
+    VkBool32    shaderUniformBufferArrayDynamicIndexing;
+    VkBool32    shaderSampledImageArrayDynamicIndexing;
+    VkBool32    shaderStorageBufferArrayDynamicIndexing;
+    VkBool32    shaderStorageImageArrayDynamicIndexing;
+    VkBool32    shaderClipDistance;
+    VkBool32    shaderCullDistance;
+    VkBool32    shaderFloat64;
+    VkBool32    shaderInt64;
+    VkBool32    shaderInt16;
+    VkBool32    shaderResourceResidency;
+    VkBool32    shaderResourceMinLod;
+    VkBool32    sparseBinding;
+    VkBool32    sparseResidencyBuffer;
+    VkBool32    sparseResidencyImage2D;
+    VkBool32    sparseResidencyImage3D;
+    VkBool32    sparseResidency2Samples;
+    VkBool32    sparseResidency4Samples;
+    VkBool32    sparseResidency8Samples;
+    VkBool32    sparseResidency16Samples;
+    VkBool32    sparseResidencyAliased;
+    VkBool32    variableMultisampleRate;
+    VkBool32    inheritedQueries;
+} VkPhysicalDeviceFeatures;
+
+typedef struct VkPhysicalDeviceLimits {
+    uint32_t              maxImageDimension1D;
+    uint32_t              maxImageDimension2D;
+    uint32_t              maxImageDimension3D;
+    uint32_t              maxImageDimensionCube;
+    uint32_t              maxImageArrayLayers;
+    uint32_t              maxTexelBufferElements;
+    uint32_t              maxUniformBufferRange;
+    uint32_t              maxStorageBufferRange;
+    uint32_t              maxPushConstantsSize;
+    uint32_t              maxMemoryAllocationCount;
+    uint32_t              maxSamplerAllocationCount;
+    VkDeviceSize          bufferImageGranularity;
+    VkDeviceSize          sparseAddressSpaceSize;
+    uint32_t              maxBoundDescriptorSets;
+    uint32_t              maxPerStageDescriptorSamplers;
+    uint32_t              maxPerStageDescriptorUniformBuffers;
+    uint32_t              maxPerStageDescriptorStorageBuffers;
+    uint32_t              maxPerStageDescriptorSampledImages;
+    uint32_t              maxPerStageDescriptorStorageImages;
+    uint32_t              maxPerStageDescriptorInputAttachments;
+    uint32_t              maxPerStageResources;
+    uint32_t              maxDescriptorSetSamplers;
+    uint32_t              maxDescriptorSetUniformBuffers;
+    uint32_t              maxDescriptorSetUniformBuffersDynamic;
+    uint32_t              maxDescriptorSetStorageBuffers;
+    uint32_t              maxDescriptorSetStorageBuffersDynamic;
+    uint32_t              maxDescriptorSetSampledImages;
+    uint32_t              maxDescriptorSetStorageImages;
+    uint32_t              maxDescriptorSetInputAttachments;
+    uint32_t              maxVertexInputAttributes;
+    uint32_t              maxVertexInputBindings;
+    uint32_t              maxVertexInputAttributeOffset;
+    uint32_t              maxVertexInputBindingStride;
+    uint32_t              maxVertexOutputComponents;
+    uint32_t              maxTessellationGenerationLevel;
+    uint32_t              maxTessellationPatchSize;
+    uint32_t              maxTessellationControlPerVertexInputComponents;
+    uint32_t              maxTessellationControlPerVertexOutputComponents;
+    uint32_t              maxTessellationControlPerPatchOutputComponents;
+    uint32_t              maxTessellationControlTotalOutputComponents;
+    uint32_t              maxTessellationEvaluationInputComponents;
+    uint32_t              maxTessellationEvaluationOutputComponents;
+    uint32_t              maxGeometryShaderInvocations;
+    uint32_t              maxGeometryInputComponents;
+    uint32_t              maxGeometryOutputComponents;
+    uint32_t              maxGeometryOutputVertices;
+    uint32_t              maxGeometryTotalOutputComponents;
+    uint32_t              maxFragmentInputComponents;
+    uint32_t              maxFragmentOutputAttachments;
+    uint32_t              maxFragmentDualSrcAttachments;
+    uint32_t              maxFragmentCombinedOutputResources;
+    uint32_t              maxComputeSharedMemorySize;
+    uint32_t              maxComputeWorkGroupCount[3];
+    uint32_t              maxComputeWorkGroupInvocations;
+    uint32_t              maxComputeWorkGroupSize[3];
+    uint32_t              subPixelPrecisionBits;
+    uint32_t              subTexelPrecisionBits;
+    uint32_t              mipmapPrecisionBits;
+    uint32_t              maxDrawIndexedIndexValue;
+    uint32_t              maxDrawIndirectCount;
+    float                 maxSamplerLodBias;
+    float                 maxSamplerAnisotropy;
+    uint32_t              maxViewports;
+    uint32_t              maxViewportDimensions[2];
+    float                 viewportBoundsRange[2];
+    uint32_t              viewportSubPixelBits;
+    size_t                minMemoryMapAlignment;
+    VkDeviceSize          minTexelBufferOffsetAlignment;
+    VkDeviceSize          minUniformBufferOffsetAlignment;
+    VkDeviceSize          minStorageBufferOffsetAlignment;
+    int32_t               minTexelOffset;
+    uint32_t              maxTexelOffset;
+    int32_t               minTexelGatherOffset;
+    uint32_t              maxTexelGatherOffset;
+    float                 minInterpolationOffset;
+    float                 maxInterpolationOffset;
+    uint32_t              subPixelInterpolationOffsetBits;
+    uint32_t              maxFramebufferWidth;
+    uint32_t              maxFramebufferHeight;
+    uint32_t              maxFramebufferLayers;
+    VkSampleCountFlags    framebufferColorSampleCounts;
+    VkSampleCountFlags    framebufferDepthSampleCounts;
+    VkSampleCountFlags    framebufferStencilSampleCounts;
+    VkSampleCountFlags    framebufferNoAttachmentsSampleCounts;
+    uint32_t              maxColorAttachments;
+    VkSampleCountFlags    sampledImageColorSampleCounts;
+    VkSampleCountFlags    sampledImageIntegerSampleCounts;
+    VkSampleCountFlags    sampledImageDepthSampleCounts;
+    VkSampleCountFlags    sampledImageStencilSampleCounts;
+    VkSampleCountFlags    storageImageSampleCounts;
+    uint32_t              maxSampleMaskWords;
+    VkBool32              timestampComputeAndGraphics;
+    float                 timestampPeriod;
+    uint32_t              maxClipDistances;
+    uint32_t              maxCullDistances;
+    uint32_t              maxCombinedClipAndCullDistances;
+    uint32_t              discreteQueuePriorities;
+    float                 pointSizeRange[2];
+    float                 lineWidthRange[2];
+    float                 pointSizeGranularity;
+    float                 lineWidthGranularity;
+    VkBool32              strictLines;
+    VkBool32              standardSampleLocations;
+    VkDeviceSize          optimalBufferCopyOffsetAlignment;
+    VkDeviceSize          optimalBufferCopyRowPitchAlignment;
+    VkDeviceSize          nonCoherentAtomSize;
+} VkPhysicalDeviceLimits;
+
+typedef struct VkPhysicalDeviceSparseProperties {
+    VkBool32    residencyStandard2DBlockShape;
+    VkBool32    residencyStandard2DMultisampleBlockShape;
+    VkBool32    residencyStandard3DBlockShape;
+    VkBool32    residencyAlignedMipSize;
+    VkBool32    residencyNonResidentStrict;
+} VkPhysicalDeviceSparseProperties;
+
+typedef struct VkPhysicalDeviceProperties {
+    uint32_t                            apiVersion;
+    uint32_t                            driverVersion;
+    uint32_t                            vendorID;
+    uint32_t                            deviceID;
+    VkPhysicalDeviceType                deviceType;
+    char                                deviceName[VK_MAX_PHYSICAL_DEVICE_NAME_SIZE];
+    uint8_t                             pipelineCacheUUID[VK_UUID_SIZE];
+    VkPhysicalDeviceLimits              limits;
+    VkPhysicalDeviceSparseProperties    sparseProperties;
+} VkPhysicalDeviceProperties;
+
+typedef struct VkExtensionProperties {
+    char        extensionName[VK_MAX_EXTENSION_NAME_SIZE];
+    uint32_t    specVersion;
+} VkExtensionProperties;
 
 typedef struct VkPhysicalDeviceMemoryProperties {
     uint32_t        memoryTypeCount;
@@ -951,6 +2403,14 @@ typedef struct VkPipelineShaderStageCreateInfo {
     const VkSpecializationInfo*         pSpecializationInfo;
 } VkPipelineShaderStageCreateInfo;
 
+typedef struct VkPipelineCacheCreateInfo {
+    VkStructureType               sType;
+    const void*                   pNext;
+    VkPipelineCacheCreateFlags    flags;
+    size_t                        initialDataSize;
+    const void*                   pInitialData;
+} VkPipelineCacheCreateInfo;
+
 typedef struct VkComputePipelineCreateInfo {
     VkStructureType                    sType;
     const void*                        pNext;
@@ -961,7 +2421,11 @@ typedef struct VkComputePipelineCreateInfo {
     int32_t                            basePipelineIndex;
 } VkComputePipelineCreateInfo;
 
-struct VkPushConstantRange;
+typedef struct VkPushConstantRange {
+    VkShaderStageFlags    stageFlags;
+    uint32_t              offset;
+    uint32_t              size;
+} VkPushConstantRange;
 
 typedef struct VkPipelineLayoutCreateInfo {
     VkStructureType                 sType;
@@ -1032,6 +2496,27 @@ typedef struct VkWriteDescriptorSet {
     const VkBufferView*              pTexelBufferView;
 } VkWriteDescriptorSet;
 
+typedef struct VkFenceCreateInfo {
+    VkStructureType       sType;
+    const void*           pNext;
+    VkFenceCreateFlags    flags;
+} VkFenceCreateInfo;
+
+typedef struct VkSemaphoreCreateInfo {
+    VkStructureType           sType;
+    const void*               pNext;
+    VkSemaphoreCreateFlags    flags;
+} VkSemaphoreCreateInfo;
+
+typedef struct VkQueryPoolCreateInfo {
+    VkStructureType                  sType;
+    const void*                      pNext;
+    VkQueryPoolCreateFlags           flags;
+    VkQueryType                      queryType;
+    uint32_t                         queryCount;
+    VkQueryPipelineStatisticFlags    pipelineStatistics;
+} VkQueryPoolCreateInfo;
+
 typedef struct VkCommandPoolCreateInfo {
     VkStructureType             sType;
     const void*                 pNext;
@@ -1047,7 +2532,16 @@ typedef struct VkCommandBufferAllocateInfo {
     uint32_t                commandBufferCount;
 } VkCommandBufferAllocateInfo;
 
-struct VkCommandBufferInheritanceInfo;
+typedef struct VkCommandBufferInheritanceInfo {
+    VkStructureType                  sType;
+    const void*                      pNext;
+    VkRenderPass                     renderPass;
+    uint32_t                         subpass;
+    VkFramebuffer                    framebuffer;
+    VkBool32                         occlusionQueryEnable;
+    VkQueryControlFlags              queryFlags;
+    VkQueryPipelineStatisticFlags    pipelineStatistics;
+} VkCommandBufferInheritanceInfo;
 
 typedef struct VkCommandBufferBeginInfo {
     VkStructureType                          sType;
@@ -1079,34 +2573,57 @@ typedef struct VkBufferMemoryBarrier {
 
 struct VkImageMemoryBarrier;
 
+typedef struct VkBufferCopy {
+    VkDeviceSize    srcOffset;
+    VkDeviceSize    dstOffset;
+    VkDeviceSize    size;
+} VkBufferCopy;
+
 typedef VkResult(VKAPI_PTR* PFN_vkAllocateCommandBuffers)(VkDevice device, const VkCommandBufferAllocateInfo* pAllocateInfo, VkCommandBuffer* pCommandBuffers);
 typedef VkResult(VKAPI_PTR* PFN_vkAllocateDescriptorSets)(VkDevice device, const VkDescriptorSetAllocateInfo* pAllocateInfo, VkDescriptorSet* pDescriptorSets);
 typedef VkResult(VKAPI_PTR* PFN_vkAllocateMemory)(VkDevice device, const VkMemoryAllocateInfo* pAllocateInfo, const VkAllocationCallbacks* pAllocator, VkDeviceMemory* pMemory);
 typedef VkResult(VKAPI_PTR* PFN_vkBeginCommandBuffer)(VkCommandBuffer commandBuffer, const VkCommandBufferBeginInfo* pBeginInfo);
 typedef VkResult(VKAPI_PTR* PFN_vkBindBufferMemory)(VkDevice device, VkBuffer buffer, VkDeviceMemory memory, VkDeviceSize memoryOffset);
+typedef void (VKAPI_PTR* PFN_vkCmdBeginQuery)(VkCommandBuffer commandBuffer, VkQueryPool queryPool, uint32_t query, VkQueryControlFlags flags);
 typedef void (VKAPI_PTR* PFN_vkCmdBindDescriptorSets)(VkCommandBuffer commandBuffer, VkPipelineBindPoint pipelineBindPoint, VkPipelineLayout layout, uint32_t firstSet, uint32_t descriptorSetCount, const VkDescriptorSet* pDescriptorSets, uint32_t dynamicOffsetCount, const uint32_t* pDynamicOffsets);
 typedef void (VKAPI_PTR* PFN_vkCmdBindPipeline)(VkCommandBuffer commandBuffer, VkPipelineBindPoint pipelineBindPoint, VkPipeline pipeline);
+typedef void (VKAPI_PTR* PFN_vkCmdCopyBuffer)(VkCommandBuffer commandBuffer, VkBuffer srcBuffer, VkBuffer dstBuffer, uint32_t regionCount, const VkBufferCopy* pRegions);
 typedef void (VKAPI_PTR* PFN_vkCmdDispatch)(VkCommandBuffer commandBuffer, uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ);
+typedef void (VKAPI_PTR* PFN_vkCmdDispatchIndirect)(VkCommandBuffer commandBuffer, VkBuffer buffer, VkDeviceSize offset);
+typedef void (VKAPI_PTR* PFN_vkCmdEndQuery)(VkCommandBuffer commandBuffer, VkQueryPool queryPool, uint32_t query);
+typedef void (VKAPI_PTR* PFN_vkCmdExecuteCommands)(VkCommandBuffer commandBuffer, uint32_t commandBufferCount, const VkCommandBuffer* pCommandBuffers);
 typedef void (VKAPI_PTR* PFN_vkCmdPipelineBarrier)(VkCommandBuffer commandBuffer, VkPipelineStageFlags srcStageMask, VkPipelineStageFlags dstStageMask, VkDependencyFlags dependencyFlags, uint32_t memoryBarrierCount, const VkMemoryBarrier* pMemoryBarriers, uint32_t bufferMemoryBarrierCount, const VkBufferMemoryBarrier* pBufferMemoryBarriers, uint32_t imageMemoryBarrierCount, const VkImageMemoryBarrier* pImageMemoryBarriers);
+typedef void (VKAPI_PTR* PFN_vkCmdPushConstants)(VkCommandBuffer commandBuffer, VkPipelineLayout layout, VkShaderStageFlags stageFlags, uint32_t offset, uint32_t size, const void* pValues);
+typedef void (VKAPI_PTR* PFN_vkCmdResetQueryPool)(VkCommandBuffer commandBuffer, VkQueryPool queryPool, uint32_t firstQuery, uint32_t queryCount);
+typedef void (VKAPI_PTR* PFN_vkCmdWriteTimestamp)(VkCommandBuffer commandBuffer, VkPipelineStageFlagBits pipelineStage, VkQueryPool queryPool, uint32_t query);
 typedef VkResult(VKAPI_PTR* PFN_vkCreateBuffer)(VkDevice device, const VkBufferCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkBuffer* pBuffer);
 typedef VkResult(VKAPI_PTR* PFN_vkCreateCommandPool)(VkDevice device, const VkCommandPoolCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkCommandPool* pCommandPool);
 typedef VkResult(VKAPI_PTR* PFN_vkCreateComputePipelines)(VkDevice device, VkPipelineCache pipelineCache, uint32_t createInfoCount, const VkComputePipelineCreateInfo* pCreateInfos, const VkAllocationCallbacks* pAllocator, VkPipeline* pPipelines);
 typedef VkResult(VKAPI_PTR* PFN_vkCreateDescriptorPool)(VkDevice device, const VkDescriptorPoolCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkDescriptorPool* pDescriptorPool);
 typedef VkResult(VKAPI_PTR* PFN_vkCreateDescriptorSetLayout)(VkDevice device, const VkDescriptorSetLayoutCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkDescriptorSetLayout* pSetLayout);
 typedef VkResult(VKAPI_PTR* PFN_vkCreateDevice)(VkPhysicalDevice physicalDevice, const VkDeviceCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkDevice* pDevice);
+typedef VkResult(VKAPI_PTR* PFN_vkCreateFence)(VkDevice device, const VkFenceCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkFence* pFence);
 typedef VkResult(VKAPI_PTR* PFN_vkCreateInstance)(const VkInstanceCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkInstance* pInstance);
+typedef VkResult(VKAPI_PTR* PFN_vkCreatePipelineCache)(VkDevice device, const VkPipelineCacheCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkPipelineCache* pPipelineCache);
 typedef VkResult(VKAPI_PTR* PFN_vkCreatePipelineLayout)(VkDevice device, const VkPipelineLayoutCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkPipelineLayout* pPipelineLayout);
+typedef VkResult(VKAPI_PTR* PFN_vkCreateQueryPool)(VkDevice device, const VkQueryPoolCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkQueryPool* pQueryPool);
+typedef VkResult(VKAPI_PTR* PFN_vkCreateSemaphore)(VkDevice device, const VkSemaphoreCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkSemaphore* pSemaphore);
 typedef VkResult(VKAPI_PTR* PFN_vkCreateShaderModule)(VkDevice device, const VkShaderModuleCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkShaderModule* pShaderModule);
 typedef void (VKAPI_PTR* PFN_vkDestroyBuffer)(VkDevice device, VkBuffer buffer, const VkAllocationCallbacks* pAllocator);
 typedef void (VKAPI_PTR* PFN_vkDestroyCommandPool)(VkDevice device, VkCommandPool commandPool, const VkAllocationCallbacks* pAllocator);
 typedef void (VKAPI_PTR* PFN_vkDestroyDescriptorPool)(VkDevice device, VkDescriptorPool descriptorPool, const VkAllocationCallbacks* pAllocator);
 typedef void (VKAPI_PTR* PFN_vkDestroyDescriptorSetLayout)(VkDevice device, VkDescriptorSetLayout descriptorSetLayout, const VkAllocationCallbacks* pAllocator);
 typedef void (VKAPI_PTR* PFN_vkDestroyDevice)(VkDevice device, const VkAllocationCallbacks* pAllocator);
+typedef void (VKAPI_PTR* PFN_vkDestroyFence)(VkDevice device, VkFence fence, const VkAllocationCallbacks* pAllocator);
 typedef void (VKAPI_PTR* PFN_vkDestroyInstance)(VkInstance instance, const VkAllocationCallbacks* pAllocator);
 typedef void (VKAPI_PTR* PFN_vkDestroyPipeline)(VkDevice device, VkPipeline pipeline, const VkAllocationCallbacks* pAllocator);
+typedef void (VKAPI_PTR* PFN_vkDestroyPipelineCache)(VkDevice device, VkPipelineCache pipelineCache, const VkAllocationCallbacks* pAllocator);
 typedef void (VKAPI_PTR* PFN_vkDestroyPipelineLayout)(VkDevice device, VkPipelineLayout pipelineLayout, const VkAllocationCallbacks* pAllocator);
+typedef void (VKAPI_PTR* PFN_vkDestroyQueryPool)(VkDevice device, VkQueryPool queryPool, const VkAllocationCallbacks* pAllocator);
+typedef void (VKAPI_PTR* PFN_vkDestroySemaphore)(VkDevice device, VkSemaphore semaphore, const VkAllocationCallbacks* pAllocator);
 typedef void (VKAPI_PTR* PFN_vkDestroyShaderModule)(VkDevice device, VkShaderModule shaderModule, const VkAllocationCallbacks* pAllocator);
 typedef VkResult(VKAPI_PTR* PFN_vkEndCommandBuffer)(VkCommandBuffer commandBuffer);
+typedef VkResult(VKAPI_PTR* PFN_vkEnumerateDeviceExtensionProperties)(VkPhysicalDevice physicalDevice, const char* pLayerName, uint32_t* pPropertyCount, VkExtensionProperties* pProperties);
 typedef VkResult(VKAPI_PTR* PFN_vkEnumeratePhysicalDevices)(VkInstance instance, uint32_t* pPhysicalDeviceCount, VkPhysicalDevice* pPhysicalDevices);
 typedef VkResult(VKAPI_PTR* PFN_vkFlushMappedMemoryRanges)(VkDevice device, uint32_t memoryRangeCount, const VkMappedMemoryRange* pMemoryRanges);
 typedef void (VKAPI_PTR* PFN_vkFreeCommandBuffers)(VkDevice device, VkCommandPool commandPool, uint32_t commandBufferCount, const VkCommandBuffer* pCommandBuffers);
@@ -1114,9 +2631,14 @@ typedef VkResult(VKAPI_PTR* PFN_vkFreeDescriptorSets)(VkDevice device, VkDescrip
 typedef void (VKAPI_PTR* PFN_vkFreeMemory)(VkDevice device, VkDeviceMemory memory, const VkAllocationCallbacks* pAllocator);
 typedef void (VKAPI_PTR* PFN_vkGetBufferMemoryRequirements)(VkDevice device, VkBuffer buffer, VkMemoryRequirements* pMemoryRequirements);
 typedef void (VKAPI_PTR* PFN_vkGetDeviceQueue)(VkDevice device, uint32_t queueFamilyIndex, uint32_t queueIndex, VkQueue* pQueue);
+typedef VkResult(VKAPI_PTR* PFN_vkGetFenceStatus)(VkDevice device, VkFence fence);
 typedef PFN_vkVoidFunction(VKAPI_PTR* PFN_vkGetInstanceProcAddr)(VkInstance instance, const char* pName);
+typedef void (VKAPI_PTR* PFN_vkGetPhysicalDeviceFeatures)(VkPhysicalDevice physicalDevice, VkPhysicalDeviceFeatures* pFeatures);
+typedef void (VKAPI_PTR* PFN_vkGetPhysicalDeviceProperties)(VkPhysicalDevice physicalDevice, VkPhysicalDeviceProperties* pProperties);
 typedef void (VKAPI_PTR* PFN_vkGetPhysicalDeviceMemoryProperties)(VkPhysicalDevice physicalDevice, VkPhysicalDeviceMemoryProperties* pMemoryProperties);
 typedef void (VKAPI_PTR* PFN_vkGetPhysicalDeviceQueueFamilyProperties)(VkPhysicalDevice physicalDevice, uint32_t* pQueueFamilyPropertyCount, VkQueueFamilyProperties* pQueueFamilyProperties);
+typedef VkResult(VKAPI_PTR* PFN_vkGetPipelineCacheData)(VkDevice device, VkPipelineCache pipelineCache, size_t* pDataSize, void* pData);
+typedef VkResult(VKAPI_PTR* PFN_vkGetQueryPoolResults)(VkDevice device, VkQueryPool queryPool, uint32_t firstQuery, uint32_t queryCount, size_t dataSize, void* pData, VkDeviceSize stride, VkQueryResultFlags flags);
 typedef VkResult(VKAPI_PTR* PFN_vkInvalidateMappedMemoryRanges)(VkDevice device, uint32_t memoryRangeCount, const VkMappedMemoryRange* pMemoryRanges);
 typedef VkResult(VKAPI_PTR* PFN_vkMapMemory)(VkDevice device, VkDeviceMemory memory, VkDeviceSize offset, VkDeviceSize size, VkMemoryMapFlags flags, void** ppData);
 typedef VkResult(VKAPI_PTR* PFN_vkQueueSubmit)(VkQueue queue, uint32_t submitCount, const VkSubmitInfo* pSubmits, VkFence fence);
@@ -1124,8 +2646,10 @@ typedef VkResult(VKAPI_PTR* PFN_vkQueueWaitIdle)(VkQueue queue);
 typedef VkResult(VKAPI_PTR* PFN_vkResetCommandBuffer)(VkCommandBuffer commandBuffer, VkCommandBufferResetFlags flags);
 typedef VkResult(VKAPI_PTR* PFN_vkResetCommandPool)(VkDevice device, VkCommandPool commandPool, VkCommandPoolResetFlags flags);
 typedef VkResult(VKAPI_PTR* PFN_vkResetDescriptorPool)(VkDevice device, VkDescriptorPool descriptorPool, VkDescriptorPoolResetFlags flags);
+typedef VkResult(VKAPI_PTR* PFN_vkResetFences)(VkDevice device, uint32_t fenceCount, const VkFence* pFences);
 typedef void (VKAPI_PTR* PFN_vkUnmapMemory)(VkDevice device, VkDeviceMemory memory);
 typedef void (VKAPI_PTR* PFN_vkUpdateDescriptorSets)(VkDevice device, uint32_t descriptorWriteCount, const VkWriteDescriptorSet* pDescriptorWrites, uint32_t descriptorCopyCount, const VkCopyDescriptorSet* pDescriptorCopies);
+typedef VkResult(VKAPI_PTR* PFN_vkWaitForFences)(VkDevice device, uint32_t fenceCount, const VkFence* pFences, VkBool32 waitAll, uint64_t timeout);
 
 
 typedef enum VkDebugReportObjectTypeEXT {
@@ -1161,8 +2685,72 @@ typedef struct VkDebugReportCallbackCreateInfoEXT {
 } VkDebugReportCallbackCreateInfoEXT;
 VK_DEFINE_NON_DISPATCHABLE_HANDLE(VkDebugReportCallbackEXT)
 
+#define VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME "VK_EXT_pipeline_creation_feedback"
+typedef enum VkPipelineCreationFeedbackFlagBitsEXT {
+    VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT = 0x00000001,
+    VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT = 0x00000002,
+    VK_PIPELINE_CREATION_FEEDBACK_BASE_PIPELINE_ACCELERATION_BIT_EXT = 0x00000004,
+    VK_PIPELINE_CREATION_FEEDBACK_FLAG_BITS_MAX_ENUM_EXT = 0x7FFFFFFF
+} VkPipelineCreationFeedbackFlagBitsEXT;
+typedef VkFlags VkPipelineCreationFeedbackFlagsEXT;
+typedef struct VkPipelineCreationFeedbackEXT {
+    VkPipelineCreationFeedbackFlagsEXT    flags;
+    uint64_t                              duration;
+} VkPipelineCreationFeedbackEXT;
+typedef struct VkPipelineCreationFeedbackCreateInfoEXT {
+    VkStructureType                   sType;
+    const void*                       pNext;
+    VkPipelineCreationFeedbackEXT*    pPipelineCreationFeedback;
+    uint32_t                          pipelineStageCreationFeedbackCount;
+    VkPipelineCreationFeedbackEXT*    pPipelineStageCreationFeedbacks;
+} VkPipelineCreationFeedbackCreateInfoEXT;
+
+typedef struct VkPhysicalDeviceFeatures2 {
+    VkStructureType             sType;
+    void*                       pNext;
+    VkPhysicalDeviceFeatures    features;
+} VkPhysicalDeviceFeatures2;
+
+#define VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME "VK_KHR_timeline_semaphore"
+typedef enum VkSemaphoreTypeKHR {
+    VK_SEMAPHORE_TYPE_BINARY_KHR = 0,
+    VK_SEMAPHORE_TYPE_TIMELINE_KHR = 1,
+    VK_SEMAPHORE_TYPE_MAX_ENUM_KHR = 0x7FFFFFFF
+} VkSemaphoreTypeKHR;
+typedef VkFlags VkSemaphoreWaitFlagsKHR;
+typedef struct VkPhysicalDeviceTimelineSemaphoreFeaturesKHR {
+    VkStructureType    sType;
+    void*              pNext;
+    VkBool32           timelineSemaphore;
+} VkPhysicalDeviceTimelineSemaphoreFeaturesKHR;
+typedef struct VkSemaphoreTypeCreateInfoKHR {
+    VkStructureType       sType;
+    const void*           pNext;
+    VkSemaphoreTypeKHR    semaphoreType;
+    uint64_t              initialValue;
+} VkSemaphoreTypeCreateInfoKHR;
+typedef struct VkTimelineSemaphoreSubmitInfoKHR {
+    VkStructureType    sType;
+    const void*        pNext;
+    uint32_t           waitSemaphoreValueCount;
+    const uint64_t*    pWaitSemaphoreValues;
+    uint32_t           signalSemaphoreValueCount;
+    const uint64_t*    pSignalSemaphoreValues;
+} VkTimelineSemaphoreSubmitInfoKHR;
+typedef struct VkSemaphoreWaitInfoKHR {
+    VkStructureType            sType;
+    const void*                pNext;
+    VkSemaphoreWaitFlagsKHR    flags;
+    uint32_t                   semaphoreCount;
+    const VkSemaphore*         pSemaphores;
+    const uint64_t*            pValues;
+} VkSemaphoreWaitInfoKHR;
+
 typedef VkResult(VKAPI_PTR* PFN_vkCreateDebugReportCallbackEXT)(VkInstance instance, const VkDebugReportCallbackCreateInfoEXT* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkDebugReportCallbackEXT* pCallback);
 typedef void (VKAPI_PTR* PFN_vkDestroyDebugReportCallbackEXT)(VkInstance instance, VkDebugReportCallbackEXT callback, const VkAllocationCallbacks* pAllocator);
+typedef void (VKAPI_PTR* PFN_vkGetPhysicalDeviceFeatures2)(VkPhysicalDevice physicalDevice, VkPhysicalDeviceFeatures2* pFeatures);
+typedef VkResult(VKAPI_PTR* PFN_vkGetSemaphoreCounterValueKHR)(VkDevice device, VkSemaphore semaphore, uint64_t* pValue);
+typedef VkResult(VKAPI_PTR* PFN_vkWaitSemaphoresKHR)(VkDevice device, const VkSemaphoreWaitInfoKHR* pWaitInfo, uint64_t timeout);
 
 
 // -------- Tiny vulkan loader
@@ -1173,29 +2761,46 @@ static PFN_vkAllocateDescriptorSets vkAllocateDescriptorSets;
 static PFN_vkAllocateMemory vkAllocateMemory;
 static PFN_vkBeginCommandBuffer vkBeginCommandBuffer;
 static PFN_vkBindBufferMemory vkBindBufferMemory;
+static PFN_vkCmdBeginQuery vkCmdBeginQuery;
 static PFN_vkCmdBindDescriptorSets vkCmdBindDescriptorSets;
 static PFN_vkCmdBindPipeline vkCmdBindPipeline;
+static PFN_vkCmdCopyBuffer vkCmdCopyBuffer;
 static PFN_vkCmdDispatch vkCmdDispatch;
+static PFN_vkCmdDispatchIndirect vkCmdDispatchIndirect;
+static PFN_vkCmdEndQuery vkCmdEndQuery;
+static PFN_vkCmdExecuteCommands vkCmdExecuteCommands;
 static PFN_vkCmdPipelineBarrier vkCmdPipelineBarrier;
+static PFN_vkCmdPushConstants vkCmdPushConstants;
+static PFN_vkCmdResetQueryPool vkCmdResetQueryPool;
+static PFN_vkCmdWriteTimestamp vkCmdWriteTimestamp;
 static PFN_vkCreateBuffer vkCreateBuffer;
 static PFN_vkCreateCommandPool vkCreateCommandPool;
 static PFN_vkCreateComputePipelines vkCreateComputePipelines;
 static PFN_vkCreateDescriptorPool vkCreateDescriptorPool;
 static PFN_vkCreateDescriptorSetLayout vkCreateDescriptorSetLayout;
 static PFN_vkCreateDevice vkCreateDevice;
+static PFN_vkCreateFence vkCreateFence;
 static PFN_vkCreateInstance vkCreateInstance;
+static PFN_vkCreatePipelineCache vkCreatePipelineCache;
 static PFN_vkCreatePipelineLayout vkCreatePipelineLayout;
+static PFN_vkCreateQueryPool vkCreateQueryPool;
+static PFN_vkCreateSemaphore vkCreateSemaphore;
 static PFN_vkCreateShaderModule vkCreateShaderModule;
 static PFN_vkDestroyBuffer vkDestroyBuffer;
 static PFN_vkDestroyCommandPool vkDestroyCommandPool;
 static PFN_vkDestroyDescriptorPool vkDestroyDescriptorPool;
 static PFN_vkDestroyDescriptorSetLayout vkDestroyDescriptorSetLayout;
 static PFN_vkDestroyDevice vkDestroyDevice;
+static PFN_vkDestroyFence vkDestroyFence;
 static PFN_vkDestroyInstance vkDestroyInstance;
 static PFN_vkDestroyPipeline vkDestroyPipeline;
+static PFN_vkDestroyPipelineCache vkDestroyPipelineCache;
 static PFN_vkDestroyPipelineLayout vkDestroyPipelineLayout;
+static PFN_vkDestroyQueryPool vkDestroyQueryPool;
+static PFN_vkDestroySemaphore vkDestroySemaphore;
 static PFN_vkDestroyShaderModule vkDestroyShaderModule;
 static PFN_vkEndCommandBuffer vkEndCommandBuffer;
+static PFN_vkEnumerateDeviceExtensionProperties vkEnumerateDeviceExtensionProperties;
 static PFN_vkEnumeratePhysicalDevices vkEnumeratePhysicalDevices;
 static PFN_vkFlushMappedMemoryRanges vkFlushMappedMemoryRanges;
 static PFN_vkFreeCommandBuffers vkFreeCommandBuffers;
@@ -1203,9 +2808,14 @@ static PFN_vkFreeDescriptorSets vkFreeDescriptorSets;
 static PFN_vkFreeMemory vkFreeMemory;
 static PFN_vkGetBufferMemoryRequirements vkGetBufferMemoryRequirements;
 static PFN_vkGetDeviceQueue vkGetDeviceQueue;
+static PFN_vkGetFenceStatus vkGetFenceStatus;
 static PFN_vkGetInstanceProcAddr vkGetInstanceProcAddr;
+static PFN_vkGetPhysicalDeviceFeatures vkGetPhysicalDeviceFeatures;
+static PFN_vkGetPhysicalDeviceProperties vkGetPhysicalDeviceProperties;
 static PFN_vkGetPhysicalDeviceMemoryProperties vkGetPhysicalDeviceMemoryProperties;
 static PFN_vkGetPhysicalDeviceQueueFamilyProperties vkGetPhysicalDeviceQueueFamilyProperties;
+static PFN_vkGetPipelineCacheData vkGetPipelineCacheData;
+static PFN_vkGetQueryPoolResults vkGetQueryPoolResults;
 static PFN_vkInvalidateMappedMemoryRanges vkInvalidateMappedMemoryRanges;
 static PFN_vkMapMemory vkMapMemory;
 static PFN_vkQueueSubmit vkQueueSubmit;
@@ -1213,18 +2823,46 @@ static PFN_vkQueueWaitIdle vkQueueWaitIdle;
 static PFN_vkResetCommandBuffer vkResetCommandBuffer;
 static PFN_vkResetCommandPool vkResetCommandPool;
 static PFN_vkResetDescriptorPool vkResetDescriptorPool;
+static PFN_vkResetFences vkResetFences;
 static PFN_vkUnmapMemory vkUnmapMemory;
 static PFN_vkUpdateDescriptorSets vkUpdateDescriptorSets;
+static PFN_vkWaitForFences vkWaitForFences;
 // VK_EXT_debug_report
 static PFN_vkCreateDebugReportCallbackEXT vkCreateDebugReportCallbackEXT;
 static PFN_vkDestroyDebugReportCallbackEXT vkDestroyDebugReportCallbackEXT;
+// Vulkan 1.1
+static PFN_vkGetPhysicalDeviceFeatures2 vkGetPhysicalDeviceFeatures2;
+// VK_KHR_timeline_semaphore
+static PFN_vkGetSemaphoreCounterValueKHR vkGetSemaphoreCounterValueKHR;
+static PFN_vkWaitSemaphoresKHR vkWaitSemaphoresKHR;
+
+#if defined(_WIN32)
+#include <wtypes.h>
+#else
+#include <dlfcn.h>
+#endif
 
 static VkResult SmolImpl_VkInitialize()
 {
+#if defined(_WIN32)
     HMODULE dll = LoadLibraryA("vulkan-1.dll");
     if (!dll)
         return VK_ERROR_INITIALIZATION_FAILED;
     vkGetInstanceProcAddr = (PFN_vkGetInstanceProcAddr)GetProcAddress(dll, "vkGetInstanceProcAddr");
+#else
+    #if defined(__APPLE__)
+    void* lib = dlopen("libvulkan.1.dylib", RTLD_NOW | RTLD_LOCAL);
+    #else
+    void* lib = dlopen("libvulkan.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (!lib)
+        lib = dlopen("libvulkan.so", RTLD_NOW | RTLD_LOCAL);
+    #endif
+    if (!lib)
+        return VK_ERROR_INITIALIZATION_FAILED;
+    vkGetInstanceProcAddr = (PFN_vkGetInstanceProcAddr)dlsym(lib, "vkGetInstanceProcAddr");
+#endif
+    if (!vkGetInstanceProcAddr)
+        return VK_ERROR_INITIALIZATION_FAILED;
     vkCreateInstance = (PFN_vkCreateInstance)vkGetInstanceProcAddr(0, "vkCreateInstance");
     return VK_SUCCESS;
 }
@@ -1236,28 +2874,45 @@ static void SmolImpl_VkLoadInstanceFunctions(VkInstance instance)
     vkAllocateMemory = (PFN_vkAllocateMemory)vkGetInstanceProcAddr(instance, "vkAllocateMemory");
     vkBeginCommandBuffer = (PFN_vkBeginCommandBuffer)vkGetInstanceProcAddr(instance, "vkBeginCommandBuffer");
     vkBindBufferMemory = (PFN_vkBindBufferMemory)vkGetInstanceProcAddr(instance, "vkBindBufferMemory");
+    vkCmdBeginQuery = (PFN_vkCmdBeginQuery)vkGetInstanceProcAddr(instance, "vkCmdBeginQuery");
     vkCmdBindDescriptorSets = (PFN_vkCmdBindDescriptorSets)vkGetInstanceProcAddr(instance, "vkCmdBindDescriptorSets");
     vkCmdBindPipeline = (PFN_vkCmdBindPipeline)vkGetInstanceProcAddr(instance, "vkCmdBindPipeline");
+    vkCmdCopyBuffer = (PFN_vkCmdCopyBuffer)vkGetInstanceProcAddr(instance, "vkCmdCopyBuffer");
     vkCmdDispatch = (PFN_vkCmdDispatch)vkGetInstanceProcAddr(instance, "vkCmdDispatch");
+    vkCmdDispatchIndirect = (PFN_vkCmdDispatchIndirect)vkGetInstanceProcAddr(instance, "vkCmdDispatchIndirect");
+    vkCmdEndQuery = (PFN_vkCmdEndQuery)vkGetInstanceProcAddr(instance, "vkCmdEndQuery");
+    vkCmdExecuteCommands = (PFN_vkCmdExecuteCommands)vkGetInstanceProcAddr(instance, "vkCmdExecuteCommands");
     vkCmdPipelineBarrier = (PFN_vkCmdPipelineBarrier)vkGetInstanceProcAddr(instance, "vkCmdPipelineBarrier");
+    vkCmdPushConstants = (PFN_vkCmdPushConstants)vkGetInstanceProcAddr(instance, "vkCmdPushConstants");
+    vkCmdResetQueryPool = (PFN_vkCmdResetQueryPool)vkGetInstanceProcAddr(instance, "vkCmdResetQueryPool");
+    vkCmdWriteTimestamp = (PFN_vkCmdWriteTimestamp)vkGetInstanceProcAddr(instance, "vkCmdWriteTimestamp");
     vkCreateBuffer = (PFN_vkCreateBuffer)vkGetInstanceProcAddr(instance, "vkCreateBuffer");
     vkCreateCommandPool = (PFN_vkCreateCommandPool)vkGetInstanceProcAddr(instance, "vkCreateCommandPool");
     vkCreateComputePipelines = (PFN_vkCreateComputePipelines)vkGetInstanceProcAddr(instance, "vkCreateComputePipelines");
     vkCreateDescriptorPool = (PFN_vkCreateDescriptorPool)vkGetInstanceProcAddr(instance, "vkCreateDescriptorPool");
     vkCreateDescriptorSetLayout = (PFN_vkCreateDescriptorSetLayout)vkGetInstanceProcAddr(instance, "vkCreateDescriptorSetLayout");
     vkCreateDevice = (PFN_vkCreateDevice)vkGetInstanceProcAddr(instance, "vkCreateDevice");
+    vkCreateFence = (PFN_vkCreateFence)vkGetInstanceProcAddr(instance, "vkCreateFence");
+    vkCreatePipelineCache = (PFN_vkCreatePipelineCache)vkGetInstanceProcAddr(instance, "vkCreatePipelineCache");
     vkCreatePipelineLayout = (PFN_vkCreatePipelineLayout)vkGetInstanceProcAddr(instance, "vkCreatePipelineLayout");
+    vkCreateQueryPool = (PFN_vkCreateQueryPool)vkGetInstanceProcAddr(instance, "vkCreateQueryPool");
+    vkCreateSemaphore = (PFN_vkCreateSemaphore)vkGetInstanceProcAddr(instance, "vkCreateSemaphore");
     vkCreateShaderModule = (PFN_vkCreateShaderModule)vkGetInstanceProcAddr(instance, "vkCreateShaderModule");
     vkDestroyBuffer = (PFN_vkDestroyBuffer)vkGetInstanceProcAddr(instance, "vkDestroyBuffer");
     vkDestroyCommandPool = (PFN_vkDestroyCommandPool)vkGetInstanceProcAddr(instance, "vkDestroyCommandPool");
     vkDestroyDescriptorPool = (PFN_vkDestroyDescriptorPool)vkGetInstanceProcAddr(instance, "vkDestroyDescriptorPool");
     vkDestroyDescriptorSetLayout = (PFN_vkDestroyDescriptorSetLayout)vkGetInstanceProcAddr(instance, "vkDestroyDescriptorSetLayout");
     vkDestroyDevice = (PFN_vkDestroyDevice)vkGetInstanceProcAddr(instance, "vkDestroyDevice");
+    vkDestroyFence = (PFN_vkDestroyFence)vkGetInstanceProcAddr(instance, "vkDestroyFence");
     vkDestroyInstance = (PFN_vkDestroyInstance)vkGetInstanceProcAddr(instance, "vkDestroyInstance");
     vkDestroyPipeline = (PFN_vkDestroyPipeline)vkGetInstanceProcAddr(instance, "vkDestroyPipeline");
+    vkDestroyPipelineCache = (PFN_vkDestroyPipelineCache)vkGetInstanceProcAddr(instance, "vkDestroyPipelineCache");
     vkDestroyPipelineLayout = (PFN_vkDestroyPipelineLayout)vkGetInstanceProcAddr(instance, "vkDestroyPipelineLayout");
+    vkDestroyQueryPool = (PFN_vkDestroyQueryPool)vkGetInstanceProcAddr(instance, "vkDestroyQueryPool");
+    vkDestroySemaphore = (PFN_vkDestroySemaphore)vkGetInstanceProcAddr(instance, "vkDestroySemaphore");
     vkDestroyShaderModule = (PFN_vkDestroyShaderModule)vkGetInstanceProcAddr(instance, "vkDestroyShaderModule");
     vkEndCommandBuffer = (PFN_vkEndCommandBuffer)vkGetInstanceProcAddr(instance, "vkEndCommandBuffer");
+    vkEnumerateDeviceExtensionProperties = (PFN_vkEnumerateDeviceExtensionProperties)vkGetInstanceProcAddr(instance, "vkEnumerateDeviceExtensionProperties");
     vkEnumeratePhysicalDevices = (PFN_vkEnumeratePhysicalDevices)vkGetInstanceProcAddr(instance, "vkEnumeratePhysicalDevices");
     vkFlushMappedMemoryRanges = (PFN_vkFlushMappedMemoryRanges)vkGetInstanceProcAddr(instance, "vkFlushMappedMemoryRanges");
     vkFreeCommandBuffers = (PFN_vkFreeCommandBuffers)vkGetInstanceProcAddr(instance, "vkFreeCommandBuffers");
@@ -1265,8 +2920,13 @@ static void SmolImpl_VkLoadInstanceFunctions(VkInstance instance)
     vkFreeMemory = (PFN_vkFreeMemory)vkGetInstanceProcAddr(instance, "vkFreeMemory");
     vkGetBufferMemoryRequirements = (PFN_vkGetBufferMemoryRequirements)vkGetInstanceProcAddr(instance, "vkGetBufferMemoryRequirements");
     vkGetDeviceQueue = (PFN_vkGetDeviceQueue)vkGetInstanceProcAddr(instance, "vkGetDeviceQueue");
+    vkGetFenceStatus = (PFN_vkGetFenceStatus)vkGetInstanceProcAddr(instance, "vkGetFenceStatus");
+    vkGetPhysicalDeviceFeatures = (PFN_vkGetPhysicalDeviceFeatures)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures");
+    vkGetPhysicalDeviceProperties = (PFN_vkGetPhysicalDeviceProperties)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceProperties");
     vkGetPhysicalDeviceMemoryProperties = (PFN_vkGetPhysicalDeviceMemoryProperties)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceMemoryProperties");
     vkGetPhysicalDeviceQueueFamilyProperties = (PFN_vkGetPhysicalDeviceQueueFamilyProperties)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceQueueFamilyProperties");
+    vkGetPipelineCacheData = (PFN_vkGetPipelineCacheData)vkGetInstanceProcAddr(instance, "vkGetPipelineCacheData");
+    vkGetQueryPoolResults = (PFN_vkGetQueryPoolResults)vkGetInstanceProcAddr(instance, "vkGetQueryPoolResults");
     vkInvalidateMappedMemoryRanges = (PFN_vkInvalidateMappedMemoryRanges)vkGetInstanceProcAddr(instance, "vkInvalidateMappedMemoryRanges");
     vkMapMemory = (PFN_vkMapMemory)vkGetInstanceProcAddr(instance, "vkMapMemory");
     vkQueueSubmit = (PFN_vkQueueSubmit)vkGetInstanceProcAddr(instance, "vkQueueSubmit");
@@ -1274,55 +2934,422 @@ static void SmolImpl_VkLoadInstanceFunctions(VkInstance instance)
     vkResetCommandBuffer = (PFN_vkResetCommandBuffer)vkGetInstanceProcAddr(instance, "vkResetCommandBuffer");
     vkResetCommandPool = (PFN_vkResetCommandPool)vkGetInstanceProcAddr(instance, "vkResetCommandPool");
     vkResetDescriptorPool = (PFN_vkResetDescriptorPool)vkGetInstanceProcAddr(instance, "vkResetDescriptorPool");
+    vkResetFences = (PFN_vkResetFences)vkGetInstanceProcAddr(instance, "vkResetFences");
     vkUnmapMemory = (PFN_vkUnmapMemory)vkGetInstanceProcAddr(instance, "vkUnmapMemory");
     vkUpdateDescriptorSets = (PFN_vkUpdateDescriptorSets)vkGetInstanceProcAddr(instance, "vkUpdateDescriptorSets");
+    vkWaitForFences = (PFN_vkWaitForFences)vkGetInstanceProcAddr(instance, "vkWaitForFences");
 
     vkCreateDebugReportCallbackEXT = (PFN_vkCreateDebugReportCallbackEXT)vkGetInstanceProcAddr(instance, "vkCreateDebugReportCallbackEXT");
     vkDestroyDebugReportCallbackEXT = (PFN_vkDestroyDebugReportCallbackEXT)vkGetInstanceProcAddr(instance, "vkDestroyDebugReportCallbackEXT");
+    vkGetPhysicalDeviceFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2");
+    vkGetSemaphoreCounterValueKHR = (PFN_vkGetSemaphoreCounterValueKHR)vkGetInstanceProcAddr(instance, "vkGetSemaphoreCounterValueKHR");
+    vkWaitSemaphoresKHR = (PFN_vkWaitSemaphoresKHR)vkGetInstanceProcAddr(instance, "vkWaitSemaphoresKHR");
 }
 
 // -------- Actual Vulkan code starts here
 
-#include <malloc.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 static VkInstance s_VkInstance;
 static VkDevice s_VkDevice;
 static uint32_t s_VkComputeQueueIndex;
 static VkQueue s_VkComputeQueue;
-static uint32_t s_VkMemoryTypeHostVisibleNonCoherent;
-static uint32_t s_VkMemoryTypeHostVisibleCoherent;
-static uint32_t s_VkMemoryTypeDeviceLocal;
-static VkDescriptorPool s_VkDescriptorPool;
-static VkCommandPool s_VkCommandPool;
-static VkCommandBuffer s_VkCommandBuffer;
+static VkPhysicalDeviceProperties s_VkDeviceProperties;
+static VkPhysicalDeviceMemoryProperties s_VkMemoryProperties;
+static VkPipelineCache s_VkPipelineCache;
+static std::string s_VkPipelineCachePath;
+static bool s_VkPipelineCacheDirty;
+static bool s_VkHasCreationFeedback;
+static VkSemaphore s_VkTimeline; // timeline semaphore signaled by each submit; null if not supported (frame fences are used then)
+static uint64_t s_VkTimelineValue; // last value a submit signals s_VkTimeline with
+static SmolPipelineCacheStats s_VkPipelineCacheStats;
 static VkDebugReportCallbackEXT s_VkDebugReportCallback;
 
-static VkResult SmolImpl_GetBestComputeQueue(VkPhysicalDevice device, uint32_t* outQueueFamilyIndex)
+// Work is recorded and submitted in batches, each batch uses one "frame" worth of
+// command buffer and fence. Several batches can be in flight on the GPU,
+// and waiting for some data only waits for the batch that produced it.
+static const int kSmolImpl_VkFramesInFlight = 3;
+static const uint32_t kSmolImpl_VkStatsQueriesPerFrame = 256;
+struct SmolImpl_VkStatsQuery
 {
-    uint32_t propsCount = 0;
-    vkGetPhysicalDeviceQueueFamilyProperties(device, &propsCount, 0);
-    VkQueueFamilyProperties* props = (VkQueueFamilyProperties*)_alloca(sizeof(VkQueueFamilyProperties) * propsCount);
-    vkGetPhysicalDeviceQueueFamilyProperties(device, &propsCount, props);
+    SmolKernelStats* stats; // entry in s_VkKernelStats
+    uint64_t requestedThreads;
+    bool indirect;
+};
+struct SmolImpl_VkFrame
+{
+    VkCommandPool cmdPool = nullptr;
+    VkCommandBuffer cmdBuffer = nullptr;
+    VkFence fence = nullptr;
+    uint64_t serial = 0; // batch serial recorded into this frame; 0 if never used
+    bool inFlight = false; // submitted, and not retired yet
+    uint64_t timelineValue = 0; // s_VkTimeline value signaled when the submitted batch is finished
+    size_t uploadRingEnd = 0; // upload ring position at submit time
+    size_t stagingBytes = 0; // upload and readback staging memory used by the submitted batch
+    VkQueryPool queryPool = nullptr; // timestamp queries, only when profiling
+    std::vector<uint64_t> queries; // for each written query: profile entry id * 2, plus one for end timestamp
+    VkQueryPool statsQueryPool = nullptr; // pipeline statistics queries, only with invocation stats
+    std::vector<SmolImpl_VkStatsQuery> statsQueries;
+    std::vector<VkCommandBuffer> secondaryBuffers; // parts: secondary command buffers, one per SmolContextBeginParts
+    size_t secondaryUsed = 0;
+};
 
-    // try to find a queue that only has the compute bit
-    for (uint32_t i = 0; i < propsCount; ++i)
+// Batch serials are unique across all contexts, and handed out when a context starts recording.
+// Batches are submitted in whatever order contexts finish recording them. The completed serial only
+// covers submitted batches, so that a context that keeps a batch open does not hold up everyone
+// else; it goes down again when a batch with a lower serial gets submitted.
+static uint64_t s_VkNextSerial = 1;
+static std::atomic<uint64_t> s_VkCompletedSerial; // all submitted batches up to and including this one are finished
+static std::vector<uint64_t> s_VkOpenSerials; // batches being recorded or in flight
+static std::set<uint64_t> s_VkInFlightSerials; // submitted batches that are not retired yet
+
+// Profiling: timestamps are written into query pool of the frame being recorded, and read back
+// when the frame is retired. Entries (dispatches and scopes) get increasing ids; once both of their
+// timestamps are read back they are turned into results, in id order.
+static const uint32_t kSmolImpl_VkQueriesPerFrame = 1024;
+static const size_t kSmolImpl_VkMaxProfileResults = 4096;
+struct SmolImpl_VkProfileEntry
+{
+    char name[64];
+    int depth;
+    uint64_t start, end;
+    int pendingQueries; // timestamps written but not read back yet
+    bool ended;
+    bool dropped; // ran out of queries, or failed to get results
+};
+static bool s_VkProfiling;
+static uint32_t s_VkTimestampValidBits;
+static std::vector<SmolImpl_VkProfileEntry> s_VkProfileEntries;
+static uint64_t s_VkProfileFirstId; // id of first item in s_VkProfileEntries
+static std::vector<SmolProfileResult> s_VkProfileResults;
+static bool s_VkInvocationStats;
+
+// Buffer memory is sub-allocated out of larger blocks: each block holds slots of one size class
+// (power of two sizes), in one memory type. Buffers larger than the largest size class get a
+// dedicated allocation.
+static const uint32_t kSmolImpl_VkMinSlotSizeLog2 = 8; // 256 bytes; multiple of any nonCoherentAtomSize
+static const uint32_t kSmolImpl_VkSizeClassCount = 13; // slots up to 1MB
+static const uint32_t kSmolImpl_VkSlotsPerBlock = 64;
+static const VkDeviceSize kSmolImpl_VkMinBlockSize = 1024 * 1024;
+static const VkDeviceSize kSmolImpl_VkMaxBlockSize = 16 * 1024 * 1024;
+
+struct SmolImpl_VkMemoryBlock
+{
+    VkDeviceMemory memory = nullptr;
+    VkDeviceSize size = 0;
+    VkDeviceSize slotSize = 0;
+    uint8_t* mapped = nullptr; // persistently mapped pointer for host visible memory
+    uint32_t memType = 0;
+    uint32_t sizeClass = 0;
+    uint32_t usedCount = 0; // allocated slots, including ones pending deletion
+    std::vector<uint32_t> freeSlots;
+    std::vector<SmolBuffer*> owners; // buffer in each slot, for defragmentation
+};
+static std::vector<SmolImpl_VkMemoryBlock*> s_VkMemoryBlocks;
+static size_t s_VkDedicatedCount;
+static size_t s_VkDedicatedBytes;
+
+// Device memory of a buffer: a slot in a memory block, or a dedicated allocation
+struct SmolImpl_VkAllocation
+{
+    VkDeviceMemory memory = nullptr;
+    VkDeviceSize memorySize = 0; // size of the whole memory object
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    uint8_t* mapped = nullptr; // mapped pointer to allocation start, for host visible memory
+    VkMemoryPropertyFlags flags = 0;
+    SmolImpl_VkMemoryBlock* block = nullptr; // null for dedicated allocations
+    uint32_t slot = 0;
+};
+
+// Objects that were deleted while GPU might still be using them
+struct SmolImpl_VkPendingDelete
+{
+    uint64_t serial = 0;
+    uint64_t recordingSerial = 0; // batch the deleting context was still recording, if it can use the object
+    VkBuffer buffer = nullptr;
+    SmolImpl_VkAllocation alloc;
+    VkShaderModule shader = nullptr;
+    VkDescriptorSetLayout dsLayout = nullptr;
+    VkPipelineLayout pipeLayout = nullptr;
+    VkPipeline pipeline = nullptr;
+    VkCommandPool cmdPool = nullptr;
+    VkDescriptorPool dsPool = nullptr;
+};
+static std::vector<SmolImpl_VkPendingDelete> s_VkPendingDeletes;
+
+// Descriptor sets are allocated from a chain of pools; a new pool is added whenever all existing ones are full
+static const uint32_t kSmolImpl_VkDescriptorPoolSets = 1024;
+
+// Host visible memory used to copy data to/from device local buffers
+struct SmolImpl_VkStagingBuffer
+{
+    VkBuffer buffer = nullptr;
+    SmolImpl_VkAllocation alloc;
+    uint8_t* mapped = nullptr;
+    size_t size = 0;
+    size_t head = 0; // upload ring: next allocation position
+    size_t tail = 0; // upload ring: start of data still in use by GPU
+    bool coherent = false;
+};
+static const size_t kSmolImpl_VkUploadRingMinSize = 8 * 1024 * 1024;
+
+// Staging buffers for asynchronous readbacks are pooled; a pooled one can be reused once the GPU
+// is done with the last copy into it.
+struct SmolImpl_VkReadbackStaging
+{
+    SmolImpl_VkStagingBuffer staging;
+    uint64_t serial = 0; // batch of the last copy into it
+};
+static std::vector<SmolImpl_VkReadbackStaging> s_VkReadbackPool;
+static const size_t kSmolImpl_VkReadbackMinSize = 64 * 1024;
+static const size_t kSmolImpl_VkReadbackPoolMaxBuffers = 16;
+
+// Completion callbacks are called by a completion thread, once the batch with their serial is retired.
+// s_VkCompletionMutex is only ever locked after s_VkMutex, never the other way around.
+struct SmolImpl_VkCompletion
+{
+    uint64_t serial;
+    SmolReadback* readback; // readback to finish before calling the callback, if any
+    SmolCompletionCallback callback;
+    void* userData;
+};
+static std::thread s_VkCompletionThread;
+static std::mutex s_VkCompletionMutex;
+static std::condition_variable s_VkCompletionCond;
+static std::vector<SmolImpl_VkCompletion> s_VkCompletions;
+static bool s_VkCompletionQuit;
+
+// Submission thread (EnableSubmitThread): recorded command buffers are pushed onto a lock-free
+// multi-producer single-consumer queue, and one thread does all the vkQueueSubmit calls. Batches are
+// pushed with s_VkMutex locked, so queue order is the batch serial (and timeline value) order.
+struct SmolImpl_VkSubmission
+{
+    VkCommandBuffer cmdBuffer = nullptr;
+    VkFence fence = nullptr;
+    uint64_t timelineValue = 0;
+    std::atomic<SmolImpl_VkSubmission*> next { nullptr };
+};
+static SmolImpl_VkSubmission s_VkSubmitStub;
+static std::atomic<SmolImpl_VkSubmission*> s_VkSubmitHead { &s_VkSubmitStub }; // producers push here
+static SmolImpl_VkSubmission* s_VkSubmitTail = &s_VkSubmitStub; // only used by the submission thread
+static std::thread s_VkSubmitThread;
+static std::mutex s_VkSubmitWakeMutex;
+static std::condition_variable s_VkSubmitWake;
+static bool s_VkSubmitQuit;
+static std::atomic<int> s_VkSubmitQueueDepth { 0 };
+static std::atomic<uint64_t> s_VkSubmitPushCount { 0 }; // pushes that finished linking their batch into the queue
+static std::atomic<bool> s_VkSubmitSleeping { false };
+static int s_VkSubmitMaxQueueDepth; // guarded by s_VkMutex
+static std::atomic<uint64_t> s_VkSubmitCount { 0 };
+static void SmolImpl_VkSubmitThreadFunc();
+
+// Backpressure limits, and the submitted but not yet retired work they apply to; guarded by s_VkMutex
+static SmolBackpressureLimits s_VkBackpressure;
+static int s_VkInFlightBatches;
+static size_t s_VkInFlightStagingBytes;
+
+static const int SmolImpl_VkMaxResources = 32;
+static const uint32_t SmolImpl_VkMaxPushConstantsSize = 256;
+
+// How a buffer was accessed by GPU commands so far in the command buffer being recorded
+struct SmolImpl_VkBufferState
+{
+    VkPipelineStageFlags writeStages = 0; // last write, if any
+    VkAccessFlags writeAccess = 0;
+    VkPipelineStageFlags readStages = 0; // reads since the last write
+    VkPipelineStageFlags visibleStages = 0; // stages/accesses that last write was already made visible to
+    VkAccessFlags visibleAccess = 0;
+};
+
+// Descriptor set cache key: kernel descriptor set layout and buffers bound to it
+struct SmolImpl_VkDescriptorKey
+{
+    VkDescriptorSetLayout layout = nullptr;
+    uint32_t count = 0;
+    VkDescriptorBufferInfo infos[SmolImpl_VkMaxResources];
+
+    bool operator==(const SmolImpl_VkDescriptorKey& o) const
     {
-        auto flags = props[i].queueFlags;
-        if ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT))
+        if (layout != o.layout || count != o.count)
+            return false;
+        for (uint32_t i = 0; i < count; ++i)
         {
-            *outQueueFamilyIndex = i;
-            return VK_SUCCESS;
+            if (infos[i].buffer != o.infos[i].buffer || infos[i].offset != o.infos[i].offset || infos[i].range != o.infos[i].range)
+                return false;
         }
+        return true;
     }
-    // otherwise get any suitable queue
-    for (uint32_t i = 0; i < propsCount; ++i)
+    bool Uses(VkBuffer buffer) const
     {
-        auto flags = props[i].queueFlags;
-        if (flags & VK_QUEUE_COMPUTE_BIT)
+        for (uint32_t i = 0; i < count; ++i)
+            if (infos[i].buffer == buffer)
+                return true;
+        return false;
+    }
+};
+
+struct SmolImpl_VkDescriptorKeyHash
+{
+    size_t operator()(const SmolImpl_VkDescriptorKey& k) const
+    {
+        uint64_t h = 14695981039346656037ULL;
+        auto mix = [&](uint64_t v) { h = (h ^ v) * 1099511628211ULL; };
+        mix((uint64_t)(uintptr_t)k.layout);
+        for (uint32_t i = 0; i < k.count; ++i)
         {
-            *outQueueFamilyIndex = i;
-            return VK_SUCCESS;
+            mix((uint64_t)(uintptr_t)k.infos[i].buffer);
+            mix(k.infos[i].offset);
+            mix(k.infos[i].range);
+        }
+        return (size_t)h;
+    }
+};
+
+struct SmolImpl_VkDescriptorEntry
+{
+    VkDescriptorSet ds = nullptr;
+    VkDescriptorPool pool = nullptr;
+    uint64_t gpuUseSerial = 0;
+};
+
+struct SmolImpl_VulkanState
+{
+    SmolKernel* kernel = nullptr;
+    SmolBuffer* buffers[SmolImpl_VkMaxResources] = {};
+    VkDeviceSize offsets[SmolImpl_VkMaxResources] = {};
+    VkDeviceSize ranges[SmolImpl_VkMaxResources] = {};
+    uint32_t outputMask = 0;
+    uint8_t constants[SmolImpl_VkMaxPushConstantsSize] = {};
+};
+
+// Descriptor sets to drop from a context cache: ones that use a deleted kernel layout or buffer,
+// and access state of a deleted buffer
+struct SmolImpl_VkEviction
+{
+    VkDescriptorSetLayout layout;
+    VkBuffer buffer;
+    SmolBuffer* deleted;
+};
+
+// Recording context: everything needed to record and submit work from one thread. Contexts share the
+// device, buffers and kernels; device-wide state (batch serials, memory allocation, pending deletes,
+// kernel cache, queue submission) is guarded by s_VkMutex. Recording dispatches into a context only
+// locks it when a new batch is started.
+struct SmolContext
+{
+    SmolImpl_VkFrame frames[kSmolImpl_VkFramesInFlight];
+    int frameIndex = 0;
+    VkCommandBuffer cmdBuffer = nullptr; // command buffer currently being recorded, if any
+    uint64_t recordingSerial = 0; // serial of batch being recorded; 0 if not recording
+    SmolImpl_VulkanState state;
+    std::unordered_map<SmolBuffer*, SmolImpl_VkBufferState> bufferStates; // accesses in the command buffer being recorded
+    // Descriptor sets are never modified after they are written, so the same set can be reused by any
+    // dispatch with the same kernel layout and bindings, even while earlier uses are still in flight.
+    std::unordered_map<SmolImpl_VkDescriptorKey, SmolImpl_VkDescriptorEntry, SmolImpl_VkDescriptorKeyHash> descriptorCache;
+    std::vector<VkDescriptorPool> descriptorPools;
+    std::vector<SmolImpl_VkDescriptorEntry> descriptorFrees; // sets to free once GPU is done with them
+    std::vector<SmolImpl_VkEviction> evictions; // added by other threads with s_VkMutex locked
+    std::atomic<bool> hasEvictions { false };
+    SmolImpl_VkStagingBuffer uploadRing; // only used by the thread that owns the context
+    // upload ring end of the last retired batch, published by whichever thread retired it; the
+    // owning thread moves ring tail up to it. ~0 if nothing was retired since.
+    std::atomic<size_t> uploadRingRetiredEnd { ~(size_t)0 };
+    SmolImpl_VkStagingBuffer readbackStaging;
+    std::vector<uint64_t> profileStack; // open SmolProfileBegin scopes
+    // parallel recording: parts record secondary command buffers for a batch of their parent context
+    SmolContext* parent = nullptr;
+    std::vector<SmolContext*> parts;
+    int activePartCount = 0;
+    bool secondary = false; // part or command list: records into a secondary command buffer, can't submit
+    SmolCommandList* commandList = nullptr; // command list being recorded with this context
+    // automatic flushing: work recorded into the current command buffer so far
+    SmolFlushPolicy flushPolicy;
+    int dispatchCount = 0;
+    size_t referencedBytes = 0; // sizes of buffers in bufferStates
+    std::chrono::steady_clock::time_point recordStart;
+    size_t stagingBytes = 0; // staging memory used by work recorded since the last submit
+};
+
+struct SmolCommandList
+{
+    SmolContext* ctx = nullptr; // recording state, until SmolCommandListEnd
+    SmolContext* prevContext = nullptr; // current context of the recording thread before SmolCommandListBegin
+    VkCommandPool cmdPool = nullptr;
+    VkCommandBuffer cmdBuffer = nullptr;
+    std::vector<VkDescriptorPool> descriptorPools;
+    std::vector<SmolBuffer*> buffers; // buffers accessed by the list
+    std::vector<SmolBuffer*> writtenBuffers;
+    std::vector<SmolKernel*> kernels;
+    std::atomic<uint64_t> gpuUseSerial { 0 }; // last batch that executed the list
+};
+
+typedef std::lock_guard<std::recursive_mutex> SmolImpl_VkLock;
+static std::recursive_mutex s_VkMutex;
+static std::vector<SmolContext*> s_VkContexts;
+static SmolContext* s_VkDefaultContext;
+static thread_local SmolContext* s_VkCurrentContext;
+
+// Context that the calling thread records into.
+static SmolContext* SmolImpl_VkCtx()
+{
+    return s_VkCurrentContext != nullptr ? s_VkCurrentContext : s_VkDefaultContext;
+}
+
+// Frame that holds the query pools for work recorded into the context; parts use the one of their parent.
+static SmolImpl_VkFrame& SmolImpl_VkQueryFrame(SmolContext* ctx)
+{
+    SmolContext* root = ctx->parent != nullptr ? ctx->parent : ctx;
+    return root->frames[root->frameIndex];
+}
+
+// Raise the serial to at least "value"; several contexts can record work using the same object.
+static void SmolImpl_VkAtomicMax(std::atomic<uint64_t>& serial, uint64_t value)
+{
+    uint64_t prev = serial.load();
+    while (prev < value && !serial.compare_exchange_weak(prev, value))
+        ;
+}
+
+static VkResult SmolImpl_GetBestComputeQueue(VkPhysicalDevice device, uint32_t* outQueueFamilyIndex, uint32_t* outTimestampValidBits)
+{
+    uint32_t propsCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &propsCount, 0);
+    auto props = std::unique_ptr<VkQueueFamilyProperties[]>(new VkQueueFamilyProperties[propsCount]);
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &propsCount, props.get());
+
+    // try to find a queue that only has the compute bit
+    for (uint32_t i = 0; i < propsCount; ++i)
+    {
+        auto flags = props[i].queueFlags;
+        if ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT))
+        {
+            *outQueueFamilyIndex = i;
+            *outTimestampValidBits = props[i].timestampValidBits;
+            return VK_SUCCESS;
+        }
+    }
+    // otherwise get any suitable queue
+    for (uint32_t i = 0; i < propsCount; ++i)
+    {
+        auto flags = props[i].queueFlags;
+        if (flags & VK_QUEUE_COMPUTE_BIT)
+        {
+            *outQueueFamilyIndex = i;
+            *outTimestampValidBits = props[i].timestampValidBits;
+            return VK_SUCCESS;
         }
     }
     return VK_ERROR_INITIALIZATION_FAILED;
@@ -1348,8 +3375,210 @@ static VkBool32 VKAPI_CALL SmolImpl_VkDebugReportCallback(VkDebugReportFlagsEXT
 }
 
 
-bool SmolComputeCreate(SmolComputeCreateFlags flags)
+// Pipeline cache file starts with this header, followed by VkPipelineCache data
+struct SmolImpl_VkPipelineCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint32_t driverVersion;
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+    uint64_t dataSize;
+};
+static const uint32_t kSmolImpl_VkPipelineCacheMagic = 0x43504D53; // 'SMPC'
+static const uint32_t kSmolImpl_VkPipelineCacheVersion = 1;
+
+static void SmolImpl_VkFillPipelineCacheHeader(SmolImpl_VkPipelineCacheHeader& header, uint64_t dataSize)
+{
+    memset(&header, 0, sizeof(header));
+    header.magic = kSmolImpl_VkPipelineCacheMagic;
+    header.version = kSmolImpl_VkPipelineCacheVersion;
+    header.vendorID = s_VkDeviceProperties.vendorID;
+    header.deviceID = s_VkDeviceProperties.deviceID;
+    header.driverVersion = s_VkDeviceProperties.driverVersion;
+    memcpy(header.pipelineCacheUUID, s_VkDeviceProperties.pipelineCacheUUID, VK_UUID_SIZE);
+    header.dataSize = dataSize;
+}
+
+// Create pipeline cache, with initial data from the cache file if it exists and matches current device & driver.
+static VkResult SmolImpl_VkCreatePipelineCache(const char* path)
+{
+    std::unique_ptr<uint8_t[]> data;
+    size_t dataSize = 0;
+    if (path != nullptr)
+    {
+        s_VkPipelineCachePath = path;
+        FILE* f = fopen(path, "rb");
+        if (f != nullptr)
+        {
+            SmolImpl_VkPipelineCacheHeader header, expected;
+            if (fread(&header, sizeof(header), 1, f) == 1)
+            {
+                SmolImpl_VkFillPipelineCacheHeader(expected, header.dataSize);
+                if (memcmp(&header, &expected, sizeof(header)) == 0 && header.dataSize > 0 && header.dataSize < (1ULL << 31))
+                {
+                    data.reset(new uint8_t[(size_t)header.dataSize]);
+                    if (fread(data.get(), 1, (size_t)header.dataSize, f) == header.dataSize)
+                        dataSize = (size_t)header.dataSize;
+                }
+            }
+            fclose(f);
+        }
+    }
+    VkPipelineCacheCreateInfo createInfo = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+    createInfo.initialDataSize = dataSize;
+    createInfo.pInitialData = dataSize ? data.get() : nullptr;
+    VkResult res = vkCreatePipelineCache(s_VkDevice, &createInfo, 0, &s_VkPipelineCache);
+    if (res != VK_SUCCESS && dataSize != 0)
+    {
+        // driver did not like the data; start with an empty cache
+        createInfo.initialDataSize = 0;
+        createInfo.pInitialData = nullptr;
+        res = vkCreatePipelineCache(s_VkDevice, &createInfo, 0, &s_VkPipelineCache);
+    }
+    else
+        s_VkPipelineCacheStats.loadedBytes = dataSize;
+    return res;
+}
+
+// Write pipeline cache into the cache file, if any new pipelines were created.
+static void SmolImpl_VkSavePipelineCache()
+{
+    if (s_VkPipelineCache == nullptr || s_VkPipelineCachePath.empty() || !s_VkPipelineCacheDirty)
+        return;
+    size_t dataSize = 0;
+    if (vkGetPipelineCacheData(s_VkDevice, s_VkPipelineCache, &dataSize, nullptr) != VK_SUCCESS || dataSize == 0)
+        return;
+    std::unique_ptr<uint8_t[]> data(new uint8_t[dataSize]);
+    if (vkGetPipelineCacheData(s_VkDevice, s_VkPipelineCache, &dataSize, data.get()) != VK_SUCCESS)
+        return;
+    SmolImpl_VkPipelineCacheHeader header;
+    SmolImpl_VkFillPipelineCacheHeader(header, dataSize);
+
+    // write into a temporary file and rename it, so that other processes never see a partial file
+    std::string tmpPath = s_VkPipelineCachePath + ".tmp";
+    FILE* f = fopen(tmpPath.c_str(), "wb");
+    if (f == nullptr)
+        return;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(data.get(), 1, dataSize, f) == dataSize;
+    ok &= fclose(f) == 0;
+    if (ok)
+    {
+#ifdef _WIN32
+        remove(s_VkPipelineCachePath.c_str());
+#endif
+        ok = rename(tmpPath.c_str(), s_VkPipelineCachePath.c_str()) == 0;
+    }
+    if (!ok)
+        remove(tmpPath.c_str());
+    s_VkPipelineCacheDirty = false;
+}
+
+// Kernel variant cache key: shader code, entry point and specialization constant values
+struct SmolImpl_VkSpecValue
+{
+    uint32_t id;
+    uint32_t value; // raw 32 bit value
+    bool operator==(const SmolImpl_VkSpecValue& o) const { return id == o.id && value == o.value; }
+};
+
+struct SmolImpl_VkKernelKey
+{
+    uint64_t codeHash = 0;
+    size_t codeSize = 0;
+    std::vector<uint32_t> code; // hash alone could collide and return a different kernel
+    std::string entryPoint;
+    std::vector<SmolImpl_VkSpecValue> specs; // sorted by id
+
+    bool operator==(const SmolImpl_VkKernelKey& o) const
+    {
+        return codeHash == o.codeHash && codeSize == o.codeSize && entryPoint == o.entryPoint && specs == o.specs && code == o.code;
+    }
+};
+
+struct SmolImpl_VkKernelKeyHash
+{
+    size_t operator()(const SmolImpl_VkKernelKey& k) const
+    {
+        uint64_t h = k.codeHash;
+        auto mix = [&](uint64_t v) { h = (h ^ v) * 1099511628211ULL; };
+        mix(k.codeSize);
+        for (size_t i = 0; i < k.entryPoint.size(); ++i)
+            mix((uint8_t)k.entryPoint[i]);
+        for (size_t i = 0; i < k.specs.size(); ++i)
+        {
+            mix(k.specs[i].id);
+            mix(k.specs[i].value);
+        }
+        return (size_t)h;
+    }
+};
+
+static std::unordered_map<SmolImpl_VkKernelKey, SmolKernel*, SmolImpl_VkKernelKeyHash> s_VkKernelCache;
+// invocation stats per kernel variant; entries are kept until shutdown since in flight frames point to them
+static std::unordered_map<SmolImpl_VkKernelKey, SmolKernelStats, SmolImpl_VkKernelKeyHash> s_VkKernelStats;
+
+static bool SmolImpl_VkHasExtension(const VkExtensionProperties* exts, uint32_t count, const char* name)
+{
+    for (uint32_t i = 0; i < count; ++i)
+        if (strcmp(exts[i].extensionName, name) == 0)
+            return true;
+    return false;
+}
+
+// Create per-frame command pools, command buffers, fences and query pools of a context.
+// Parts only need command pools; their secondary command buffers are allocated as needed.
+static bool SmolImpl_VkInitContext(SmolContext* ctx)
+{
+    VkCommandPoolCreateInfo commandPoolCreateInfo = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+    commandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    commandPoolCreateInfo.queueFamilyIndex = s_VkComputeQueueIndex;
+    VkFenceCreateInfo fenceCreateInfo = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+    VkQueryPoolCreateInfo queryPoolCreateInfo = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+    queryPoolCreateInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolCreateInfo.queryCount = kSmolImpl_VkQueriesPerFrame;
+    VkQueryPoolCreateInfo statsQueryPoolCreateInfo = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+    statsQueryPoolCreateInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+    statsQueryPoolCreateInfo.queryCount = kSmolImpl_VkStatsQueriesPerFrame;
+    statsQueryPoolCreateInfo.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT;
+    for (int i = 0; i < kSmolImpl_VkFramesInFlight; ++i)
+    {
+        SmolImpl_VkFrame& frame = ctx->frames[i];
+        VkResult res = vkCreateCommandPool(s_VkDevice, &commandPoolCreateInfo, 0, &frame.cmdPool);
+        if (res != VK_SUCCESS)
+            return false;
+        if (ctx->parent != nullptr)
+            continue;
+        VkCommandBufferAllocateInfo cbAllocInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+        cbAllocInfo.commandPool = frame.cmdPool;
+        cbAllocInfo.commandBufferCount = 1;
+        cbAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        res = vkAllocateCommandBuffers(s_VkDevice, &cbAllocInfo, &frame.cmdBuffer);
+        if (res != VK_SUCCESS)
+            return false;
+        res = vkCreateFence(s_VkDevice, &fenceCreateInfo, 0, &frame.fence);
+        if (res != VK_SUCCESS)
+            return false;
+        if (s_VkProfiling)
+        {
+            res = vkCreateQueryPool(s_VkDevice, &queryPoolCreateInfo, 0, &frame.queryPool);
+            if (res != VK_SUCCESS)
+                return false;
+        }
+        if (s_VkInvocationStats)
+        {
+            res = vkCreateQueryPool(s_VkDevice, &statsQueryPoolCreateInfo, 0, &frame.statsQueryPool);
+            if (res != VK_SUCCESS)
+                return false;
+        }
+    }
+    return true;
+}
+
+bool SmolComputeCreate(SmolComputeCreateFlags flags, const char* pipelineCachePath, const SmolTaskScheduler* scheduler)
 {
+    SmolImpl_SetTaskScheduler(scheduler);
 #if SMOL_COMPUTE_ENABLE_RENDERDOC
     if (HasFlag(flags, SmolComputeCreateFlags::EnableCapture))
         SmolImpl_LoadRenderDoc();
@@ -1401,205 +3630,2130 @@ bool SmolComputeCreate(SmolComputeCreateFlags flags)
     res = vkEnumeratePhysicalDevices(s_VkInstance, &physicalDeviceCount, 0);
     if (res != VK_SUCCESS || physicalDeviceCount == 0)
         return false;
-    VkPhysicalDevice* physicalDevices = (VkPhysicalDevice*)_alloca(sizeof(VkPhysicalDevice) * physicalDeviceCount);
-    res = vkEnumeratePhysicalDevices(s_VkInstance, &physicalDeviceCount, physicalDevices);
+    auto physicalDevices = std::unique_ptr<VkPhysicalDevice[]>(new VkPhysicalDevice[physicalDeviceCount]);
+    res = vkEnumeratePhysicalDevices(s_VkInstance, &physicalDeviceCount, physicalDevices.get());
     if (res != VK_SUCCESS)
         return false;
-    uint32_t pdi = 0;
-    for (; pdi < physicalDeviceCount; ++pdi)
+    // pick the "best" device that has a compute queue: discrete GPU, then integrated, etc.;
+    // or a CPU device (e.g. lavapipe, SwiftShader) when software renderer is requested
+    const bool wantSoftware = HasFlag(flags, SmolComputeCreateFlags::UseSoftwareRenderer);
+    uint32_t pdi = physicalDeviceCount;
+    int bestScore = -1;
+    for (uint32_t i = 0; i < physicalDeviceCount; ++i)
     {
-        res = SmolImpl_GetBestComputeQueue(physicalDevices[pdi], &s_VkComputeQueueIndex);
-        if (res == VK_SUCCESS)
-            break;
+        uint32_t queueIndex = 0, timestampBits = 0;
+        if (SmolImpl_GetBestComputeQueue(physicalDevices[i], &queueIndex, &timestampBits) != VK_SUCCESS)
+            continue;
+        VkPhysicalDeviceProperties props = {};
+        vkGetPhysicalDeviceProperties(physicalDevices[i], &props);
+        int score = 0;
+        switch (props.deviceType)
+        {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: score = 4; break;
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: score = 3; break;
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: score = 2; break;
+        case VK_PHYSICAL_DEVICE_TYPE_CPU: score = wantSoftware ? 5 : 1; break;
+        default: score = 0; break;
+        }
+        if (score > bestScore)
+        {
+            bestScore = score;
+            pdi = i;
+            s_VkComputeQueueIndex = queueIndex;
+            s_VkTimestampValidBits = timestampBits;
+        }
     }
     if (pdi == physicalDeviceCount)
         return false; // no devices with compute queue found
 
+    // optional device extensions
+    uint32_t extCount = 0;
+    vkEnumerateDeviceExtensionProperties(physicalDevices[pdi], nullptr, &extCount, nullptr);
+    auto exts = std::unique_ptr<VkExtensionProperties[]>(new VkExtensionProperties[extCount + 1]);
+    if (vkEnumerateDeviceExtensionProperties(physicalDevices[pdi], nullptr, &extCount, exts.get()) != VK_SUCCESS)
+        extCount = 0;
+    // optional device features
+    VkPhysicalDeviceFeatures deviceFeatures = {};
+    s_VkInvocationStats = false;
+    if (HasFlag(flags, SmolComputeCreateFlags::EnableInvocationStats))
+    {
+        VkPhysicalDeviceFeatures supportedFeatures = {};
+        vkGetPhysicalDeviceFeatures(physicalDevices[pdi], &supportedFeatures);
+        s_VkInvocationStats = supportedFeatures.pipelineStatisticsQuery != VK_FALSE;
+        deviceFeatures.pipelineStatisticsQuery = supportedFeatures.pipelineStatisticsQuery;
+    }
+
+    const char* deviceExtensions[4];
+    uint32_t deviceExtensionCount = 0;
+    s_VkHasCreationFeedback = SmolImpl_VkHasExtension(exts.get(), extCount, VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+    if (s_VkHasCreationFeedback)
+        deviceExtensions[deviceExtensionCount++] = VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME;
+    // timeline semaphore tracks batch completion when available, instead of per-frame fences
+    VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR };
+    VkPhysicalDeviceProperties deviceProps;
+    vkGetPhysicalDeviceProperties(physicalDevices[pdi], &deviceProps);
+    if (deviceProps.apiVersion >= VK_MAKE_VERSION(1, 1, 0) && vkGetPhysicalDeviceFeatures2 && vkGetSemaphoreCounterValueKHR && vkWaitSemaphoresKHR
+        && SmolImpl_VkHasExtension(exts.get(), extCount, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME))
+    {
+        VkPhysicalDeviceFeatures2 features2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, &timelineFeatures };
+        vkGetPhysicalDeviceFeatures2(physicalDevices[pdi], &features2);
+    }
+    const bool hasTimeline = timelineFeatures.timelineSemaphore != VK_FALSE;
+    if (hasTimeline)
+        deviceExtensions[deviceExtensionCount++] = VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME;
+
     // device
     const float queuePrioritory = 1.0f;
     const VkDeviceQueueCreateInfo deviceQueueCreateInfo = { VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO, 0, 0, s_VkComputeQueueIndex, 1, &queuePrioritory};
-    const VkDeviceCreateInfo deviceCreateInfo = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO, 0, 0, 1, &deviceQueueCreateInfo, 0, 0, 0, 0, 0 };
+    const VkDeviceCreateInfo deviceCreateInfo = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO, hasTimeline ? &timelineFeatures : 0, 0, 1, &deviceQueueCreateInfo, 0, 0, deviceExtensionCount, deviceExtensions, &deviceFeatures };
     res = vkCreateDevice(physicalDevices[pdi], &deviceCreateInfo, 0, &s_VkDevice);
     if (res != VK_SUCCESS)
         return false;
     vkGetDeviceQueue(s_VkDevice, s_VkComputeQueueIndex, 0, &s_VkComputeQueue);
 
-    // memory properties
-    VkPhysicalDeviceMemoryProperties properties = {};
-    vkGetPhysicalDeviceMemoryProperties(physicalDevices[pdi], &properties);
-    s_VkMemoryTypeHostVisibleNonCoherent = VK_MAX_MEMORY_TYPES;
-    s_VkMemoryTypeHostVisibleCoherent = VK_MAX_MEMORY_TYPES;
-    s_VkMemoryTypeDeviceLocal = VK_MAX_MEMORY_TYPES;
-    for (uint32_t mt = 0; mt < properties.memoryTypeCount; ++mt)
-    {
-        const auto& mem = properties.memoryTypes[mt];
-        if ((s_VkMemoryTypeHostVisibleNonCoherent == VK_MAX_MEMORY_TYPES) && (mem.propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) && !(mem.propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
-            s_VkMemoryTypeHostVisibleNonCoherent = mt;
-        if ((s_VkMemoryTypeHostVisibleCoherent == VK_MAX_MEMORY_TYPES) && (mem.propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) && (mem.propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
-            s_VkMemoryTypeHostVisibleCoherent = mt;
-        if ((s_VkMemoryTypeDeviceLocal == VK_MAX_MEMORY_TYPES) && (mem.propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
-            s_VkMemoryTypeDeviceLocal = mt;
-    }
-
-    // descriptor pool
-    uint32_t kPoolDescriptorCount = 1024;
-    VkDescriptorPoolSize poolSizes[] =
+    s_VkTimeline = nullptr;
+    s_VkTimelineValue = 0;
+    if (hasTimeline)
     {
-        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, kPoolDescriptorCount },
-        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, kPoolDescriptorCount },
-    };
-    VkDescriptorPoolCreateInfo poolCreateInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
-    poolCreateInfo.maxSets = kPoolDescriptorCount;
-    poolCreateInfo.poolSizeCount = sizeof(poolSizes)/sizeof(poolSizes[0]);
-    poolCreateInfo.pPoolSizes = poolSizes;
-    res = vkCreateDescriptorPool(s_VkDevice, &poolCreateInfo, 0, &s_VkDescriptorPool);
+        const VkSemaphoreTypeCreateInfoKHR semaphoreTypeInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR, 0, VK_SEMAPHORE_TYPE_TIMELINE_KHR, 0 };
+        const VkSemaphoreCreateInfo semaphoreInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, &semaphoreTypeInfo, 0 };
+        if (vkCreateSemaphore(s_VkDevice, &semaphoreInfo, 0, &s_VkTimeline) != VK_SUCCESS)
+            s_VkTimeline = nullptr;
+    }
+
+    // memory properties
+    vkGetPhysicalDeviceProperties(physicalDevices[pdi], &s_VkDeviceProperties);
+    vkGetPhysicalDeviceMemoryProperties(physicalDevices[pdi], &s_VkMemoryProperties);
+
+    // pipeline cache
+    s_VkPipelineCacheStats = SmolPipelineCacheStats();
+    s_VkPipelineCacheDirty = false;
+    res = SmolImpl_VkCreatePipelineCache(pipelineCachePath);
     if (res != VK_SUCCESS)
         return false;
 
-    // command pool
-    VkCommandPoolCreateInfo commandPoolCreateInfo = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
-    commandPoolCreateInfo.queueFamilyIndex = s_VkComputeQueueIndex;
-    res = vkCreateCommandPool(s_VkDevice, &commandPoolCreateInfo, 0, &s_VkCommandPool);
-    if (res != VK_SUCCESS)
+    s_VkProfiling = HasFlag(flags, SmolComputeCreateFlags::EnableProfiling) && s_VkTimestampValidBits != 0;
+
+    // default context, used by threads that did not set any other
+    s_VkNextSerial = 1;
+    s_VkCompletedSerial = 0;
+    s_VkDefaultContext = new SmolContext();
+    s_VkContexts.push_back(s_VkDefaultContext);
+    if (!SmolImpl_VkInitContext(s_VkDefaultContext))
         return false;
 
+    if (HasFlag(flags, SmolComputeCreateFlags::EnableSubmitThread))
+        s_VkSubmitThread = std::thread(SmolImpl_VkSubmitThreadFunc);
     return true;
 }
 
-static void SmolImpl_VkFinishWork()
-{
-    if (!s_VkCommandBuffer)
-        return;
-    VkResult res = vkEndCommandBuffer(s_VkCommandBuffer);
-    SMOL_ASSERT(res == VK_SUCCESS);
+static void SmolImpl_VkDestroyStagingBuffer(SmolImpl_VkStagingBuffer& sb);
+static void SmolImpl_VkFreeMemory(const SmolImpl_VkAllocation& alloc);
 
-    VkSubmitInfo submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &s_VkCommandBuffer;
-    res = vkQueueSubmit(s_VkComputeQueue, 1, &submitInfo, 0);
-    SMOL_ASSERT(res == VK_SUCCESS);
-    vkQueueWaitIdle(s_VkComputeQueue);
+static void SmolImpl_VkDestroyPendingDelete(const SmolImpl_VkPendingDelete& del)
+{
+    if (del.buffer != nullptr) vkDestroyBuffer(s_VkDevice, del.buffer, 0);
+    SmolImpl_VkFreeMemory(del.alloc);
+    if (del.shader != nullptr) vkDestroyShaderModule(s_VkDevice, del.shader, 0);
+    if (del.dsLayout != nullptr) vkDestroyDescriptorSetLayout(s_VkDevice, del.dsLayout, 0);
+    if (del.pipeLayout != nullptr) vkDestroyPipelineLayout(s_VkDevice, del.pipeLayout, 0);
+    if (del.pipeline != nullptr) vkDestroyPipeline(s_VkDevice, del.pipeline, 0);
+    if (del.cmdPool != nullptr) vkDestroyCommandPool(s_VkDevice, del.cmdPool, 0);
+    if (del.dsPool != nullptr) vkDestroyDescriptorPool(s_VkDevice, del.dsPool, 0);
+}
 
-    vkFreeCommandBuffers(s_VkDevice, s_VkCommandPool, 1, &s_VkCommandBuffer);
-    s_VkCommandBuffer = 0;
+// Whether batch with the given serial is retired, i.e. finished on the GPU. Called with s_VkMutex locked.
+static bool SmolImpl_VkSerialRetired(uint64_t serial)
+{
+    return std::find(s_VkOpenSerials.begin(), s_VkOpenSerials.end(), serial) == s_VkOpenSerials.end();
+}
 
-    vkResetDescriptorPool(s_VkDevice, s_VkDescriptorPool, 0);
+// Whether batch with the given serial, and all submitted batches before it, are finished on the GPU.
+// Called with s_VkMutex locked.
+static bool SmolImpl_VkSerialComplete(uint64_t serial)
+{
+    return serial <= s_VkCompletedSerial && SmolImpl_VkSerialRetired(serial);
 }
 
-void SmolComputeDelete()
+static bool SmolImpl_VkPendingDeleteDone(const SmolImpl_VkPendingDelete& del)
 {
-    SmolImpl_VkFinishWork();
-    if (s_VkCommandPool) vkDestroyCommandPool(s_VkDevice, s_VkCommandPool, 0); s_VkCommandPool = 0;
-    if (s_VkDescriptorPool) vkDestroyDescriptorPool(s_VkDevice, s_VkDescriptorPool, 0); s_VkDescriptorPool = 0;
-    if (s_VkDevice) vkDestroyDevice(s_VkDevice, 0); s_VkDevice = 0;
-    if (s_VkDebugReportCallback) vkDestroyDebugReportCallbackEXT(s_VkInstance, s_VkDebugReportCallback, 0); s_VkDebugReportCallback = 0;
-    if (s_VkInstance) vkDestroyInstance(s_VkInstance, 0); s_VkInstance = 0;
+    return SmolImpl_VkSerialComplete(del.serial) && SmolImpl_VkSerialRetired(del.recordingSerial);
 }
 
-SmolBackend SmolComputeGetBackend()
+// Destroy the object now if GPU is done with it, or once batch "serial" is complete otherwise.
+// Batches other contexts are still recording must not use the object (they have to be flushed
+// before it is deleted), but the one the calling thread is recording can: wait for that one too.
+// Called with s_VkMutex locked.
+static void SmolImpl_VkDeleteWhenUnused(SmolImpl_VkPendingDelete del)
 {
-    return SmolBackend::Vulkan;
+    const SmolContext* ctx = SmolImpl_VkCtx();
+    if (ctx != nullptr && ctx->recordingSerial != 0 && del.serial >= ctx->recordingSerial)
+        del.recordingSerial = ctx->recordingSerial;
+    if (SmolImpl_VkPendingDeleteDone(del))
+        SmolImpl_VkDestroyPendingDelete(del);
+    else
+        s_VkPendingDeletes.push_back(del);
 }
 
-struct SmolBuffer
+// Move profile entries that have both timestamps read back into the results list.
+static void SmolImpl_VkCollectProfileResults()
 {
-    VkBuffer buffer = nullptr;
-    VkDeviceMemory memory = nullptr;
-    size_t size = 0;
-    SmolBufferType type = SmolBufferType::Structured;
-    size_t structElementSize = 0;
-    bool writtenByGpuSinceLastRead = false;
-};
+    const double period = s_VkDeviceProperties.limits.timestampPeriod;
+    const uint64_t mask = s_VkTimestampValidBits >= 64 ? ~0ULL : (1ULL << s_VkTimestampValidBits) - 1;
+    size_t count = 0;
+    for (; count < s_VkProfileEntries.size(); ++count)
+    {
+        const SmolImpl_VkProfileEntry& entry = s_VkProfileEntries[count];
+        if (!entry.ended || entry.pendingQueries > 0)
+            break;
+        if (entry.dropped)
+            continue;
+        SmolProfileResult res;
+        memcpy(res.name, entry.name, sizeof(res.name));
+        res.depth = entry.depth;
+        res.startNs = (uint64_t)(entry.start * period);
+        res.durationNs = (uint64_t)(((entry.end - entry.start) & mask) * period);
+        if (s_VkProfileResults.size() >= kSmolImpl_VkMaxProfileResults)
+            s_VkProfileResults.erase(s_VkProfileResults.begin());
+        s_VkProfileResults.push_back(res);
+    }
+    s_VkProfileEntries.erase(s_VkProfileEntries.begin(), s_VkProfileEntries.begin() + count);
+    s_VkProfileFirstId += count;
+}
 
-SmolBuffer* SmolBufferCreate(size_t byteSize, SmolBufferType type, size_t structElementSize)
+// Read back timestamps written by a finished frame.
+static void SmolImpl_VkReadFrameQueries(SmolImpl_VkFrame& frame)
 {
-    VkBufferUsageFlags usage = type == SmolBufferType::Constant ? VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT : VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-    const VkBufferCreateInfo bufferCreateInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO, 0, 0, byteSize, usage, VK_SHARING_MODE_EXCLUSIVE, 1, &s_VkComputeQueueIndex };
-    VkBuffer buffer = 0;
-    VkResult res = vkCreateBuffer(s_VkDevice, &bufferCreateInfo, 0, &buffer);
-    if (res != VK_SUCCESS)
-        return nullptr;
-    VkMemoryRequirements requirements = {};
-    vkGetBufferMemoryRequirements(s_VkDevice, buffer, &requirements);
+    if (frame.queries.empty())
+        return;
+    const uint32_t count = (uint32_t)frame.queries.size();
+    auto times = std::unique_ptr<uint64_t[]>(new uint64_t[count]);
+    VkResult res = vkGetQueryPoolResults(s_VkDevice, frame.queryPool, 0, count, count * sizeof(uint64_t), times.get(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        SmolImpl_VkProfileEntry& entry = s_VkProfileEntries[(frame.queries[i] >> 1) - s_VkProfileFirstId];
+        if (frame.queries[i] & 1)
+            entry.end = times[i];
+        else
+            entry.start = times[i];
+        if (res != VK_SUCCESS)
+            entry.dropped = true;
+        --entry.pendingQueries;
+    }
+    frame.queries.clear();
+    SmolImpl_VkCollectProfileResults();
+}
 
-    uint32_t memType = s_VkMemoryTypeHostVisibleNonCoherent != VK_MAX_MEMORY_TYPES ? s_VkMemoryTypeHostVisibleNonCoherent : s_VkMemoryTypeHostVisibleCoherent;
-    const VkMemoryAllocateInfo memoryAllocateInfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, 0, requirements.size, memType };
+// Read back invocation counts of dispatches done by a finished frame.
+static void SmolImpl_VkReadFrameStatsQueries(SmolImpl_VkFrame& frame)
+{
+    if (frame.statsQueries.empty())
+        return;
+    const uint32_t count = (uint32_t)frame.statsQueries.size();
+    auto counts = std::unique_ptr<uint64_t[]>(new uint64_t[count]);
+    VkResult res = vkGetQueryPoolResults(s_VkDevice, frame.statsQueryPool, 0, count, count * sizeof(uint64_t), counts.get(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    if (res == VK_SUCCESS)
+    {
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            const SmolImpl_VkStatsQuery& query = frame.statsQueries[i];
+            query.stats->dispatchCount++;
+            if (query.indirect)
+                query.stats->indirectDispatchCount++;
+            query.stats->requestedThreads += query.requestedThreads;
+            query.stats->invocations += counts[i];
+        }
+    }
+    frame.statsQueries.clear();
+}
 
-    VkDeviceMemory memory = 0;
-    res = vkAllocateMemory(s_VkDevice, &memoryAllocateInfo, 0, &memory);
-    if (res != VK_SUCCESS)
+// Batch in the given context frame is known to be complete: release resources it was using.
+// Called with s_VkMutex locked.
+static void SmolImpl_VkRetireFrame(SmolContext* ctx, SmolImpl_VkFrame& frame)
+{
+    SMOL_ASSERT(frame.inFlight);
+    frame.inFlight = false;
+    --s_VkInFlightBatches;
+    s_VkInFlightStagingBytes -= frame.stagingBytes;
+    s_VkOpenSerials.erase(std::find(s_VkOpenSerials.begin(), s_VkOpenSerials.end(), frame.serial));
+    s_VkInFlightSerials.erase(frame.serial);
+    // batches still being recorded don't hold it back; objects they use are protected by not being
+    // deleted until the batch is flushed (see SmolImpl_VkDeleteWhenUnused)
+    s_VkCompletedSerial = (s_VkInFlightSerials.empty() ? s_VkNextSerial : *s_VkInFlightSerials.begin()) - 1;
+    ctx->uploadRingRetiredEnd.store(frame.uploadRingEnd, std::memory_order_release);
+    SmolImpl_VkReadFrameQueries(frame);
+    SmolImpl_VkReadFrameStatsQueries(frame);
+
+    size_t dst = 0;
+    for (size_t i = 0; i < s_VkPendingDeletes.size(); ++i)
     {
-        vkDestroyBuffer(s_VkDevice, buffer, 0);
-        return nullptr;
+        if (SmolImpl_VkPendingDeleteDone(s_VkPendingDeletes[i]))
+            SmolImpl_VkDestroyPendingDelete(s_VkPendingDeletes[i]);
+        else
+            s_VkPendingDeletes[dst++] = s_VkPendingDeletes[i];
     }
-    res = vkBindBufferMemory(s_VkDevice, buffer, memory, 0);
-    if (res != VK_SUCCESS)
+    s_VkPendingDeletes.resize(dst);
+}
+
+// Frame (out of all contexts) that holds the oldest submitted but not yet retired batch, if any.
+// Called with s_VkMutex locked.
+static SmolImpl_VkFrame* SmolImpl_VkOldestInFlightFrame(SmolContext** outCtx)
+{
+    SmolImpl_VkFrame* oldest = nullptr;
+    for (size_t i = 0; i < s_VkContexts.size(); ++i)
     {
-        vkFreeMemory(s_VkDevice, memory, 0);
-        vkDestroyBuffer(s_VkDevice, buffer, 0);
-        return nullptr;
+        for (int j = 0; j < kSmolImpl_VkFramesInFlight; ++j)
+        {
+            SmolImpl_VkFrame& frame = s_VkContexts[i]->frames[j];
+            if (frame.inFlight && (oldest == nullptr || frame.serial < oldest->serial))
+            {
+                oldest = &frame;
+                *outCtx = s_VkContexts[i];
+            }
+        }
     }
+    return oldest;
+}
 
-    SmolBuffer* buf = new SmolBuffer();
-    buf->buffer = buffer;
-    buf->memory = memory;
-    buf->size = byteSize;
-    buf->type = type;
-    buf->structElementSize = structElementSize;
-    return buf;
+// Whether the batch submitted with the frame is finished on the GPU.
+static bool SmolImpl_VkFrameDone(const SmolImpl_VkFrame& frame)
+{
+    if (s_VkTimeline == nullptr)
+        return vkGetFenceStatus(s_VkDevice, frame.fence) == VK_SUCCESS;
+    uint64_t value = 0;
+    VkResult res = vkGetSemaphoreCounterValueKHR(s_VkDevice, s_VkTimeline, &value);
+    return res == VK_SUCCESS && value >= frame.timelineValue;
 }
 
-void SmolBufferSetData(SmolBuffer* buffer, const void* src, size_t size, size_t dstOffset)
+// Oldest submitted, not yet retired batch of the context, if any.
+static SmolImpl_VkFrame* SmolImpl_VkOldestContextFrame(SmolContext* ctx)
 {
-    SMOL_ASSERT(buffer);
-    SMOL_ASSERT(dstOffset + size <= buffer->size);
+    SmolImpl_VkFrame* oldest = nullptr;
+    for (int i = 0; i < kSmolImpl_VkFramesInFlight; ++i)
+    {
+        SmolImpl_VkFrame& frame = ctx->frames[i];
+        if (frame.inFlight && (oldest == nullptr || frame.serial < oldest->serial))
+            oldest = &frame;
+    }
+    return oldest;
+}
 
-    void* dst = 0;
-    VkResult res = vkMapMemory(s_VkDevice, buffer->memory, dstOffset, size, 0, &dst);
-    if (res != VK_SUCCESS)
+// Retire submitted batches that are already finished on the GPU, without waiting. Contexts submit
+// in any serial order, so each context retires its own frames in order, independent of others.
+static void SmolImpl_VkRetireCompletedFrames()
+{
+    SmolImpl_VkLock lock(s_VkMutex);
+    for (size_t i = 0; i < s_VkContexts.size(); ++i)
     {
-        SMOL_ASSERT(!"failed to map Vulkan buffer memory for writing");
-        return;
+        SmolContext* ctx = s_VkContexts[i];
+        while (SmolImpl_VkFrame* frame = SmolImpl_VkOldestContextFrame(ctx))
+        {
+            if (!SmolImpl_VkFrameDone(*frame))
+                break;
+            SmolImpl_VkRetireFrame(ctx, *frame);
+        }
     }
-    memcpy(dst, src, size);
-    vkUnmapMemory(s_VkDevice, buffer->memory);
 }
 
-void SmolBufferGetData(SmolBuffer* buffer, void* dst, size_t size, size_t srcOffset)
+static void SmolImpl_VkSubmit(SmolContext* ctx);
+
+// Newest submitted, not yet retired batch of the context (nullptr: of all contexts), or zero if there is none.
+// Called with s_VkMutex locked.
+static uint64_t SmolImpl_VkLastInFlightSerial(const SmolContext* ctx)
 {
-    SMOL_ASSERT(buffer);
-    SMOL_ASSERT(srcOffset + size <= buffer->size);
+    uint64_t last = 0;
+    for (size_t i = 0; i < s_VkContexts.size(); ++i)
+    {
+        if (ctx != nullptr && s_VkContexts[i] != ctx)
+            continue;
+        for (int j = 0; j < kSmolImpl_VkFramesInFlight; ++j)
+        {
+            const SmolImpl_VkFrame& frame = s_VkContexts[i]->frames[j];
+            if (frame.inFlight)
+                last = std::max(last, frame.serial);
+        }
+    }
+    return last;
+}
 
-    if (buffer->writtenByGpuSinceLastRead)
+// Wait until batch with the given serial, and all batches submitted before it, are finished on the GPU.
+// The batch is submitted first if the current context is still recording it; batches that other
+// contexts are still recording have to be submitted from their own threads, and false is returned
+// for them. The GPU wait itself happens without holding s_VkMutex, so other threads can go on
+// recording and submitting meanwhile.
+// Returns false if the batches did not finish within timeoutNs nanoseconds.
+static bool SmolImpl_VkWaitForSerial(uint64_t serial, uint64_t timeoutNs = ~0ULL)
+{
+    std::unique_lock<std::recursive_mutex> lock(s_VkMutex);
+    SmolContext* current = SmolImpl_VkCtx();
+    if (serial == current->recordingSerial)
+        SmolImpl_VkSubmit(current);
+
+    const auto startTime = std::chrono::steady_clock::now();
+    while (true)
     {
-        SmolImpl_VkFinishWork();
-        buffer->writtenByGpuSinceLastRead = false;
+        SmolImpl_VkRetireCompletedFrames();
+        // wait for all the batches at once, up to the largest timeline value
+        bool pending = false;
+        uint64_t timelineValue = 0;
+        for (size_t i = 0; i < s_VkContexts.size(); ++i)
+        {
+            for (int fi = 0; fi < kSmolImpl_VkFramesInFlight; ++fi)
+            {
+                const SmolImpl_VkFrame& frame = s_VkContexts[i]->frames[fi];
+                if (!frame.inFlight || frame.serial > serial)
+                    continue;
+                pending = true;
+                timelineValue = std::max(timelineValue, frame.timelineValue);
+            }
+        }
+        if (!pending)
+            return SmolImpl_VkSerialRetired(serial); // if not, another context is still recording it
+
+        uint64_t elapsedNs = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+        if (elapsedNs >= timeoutNs)
+            return false;
+        lock.unlock();
+        if (s_VkTimeline != nullptr)
+        {
+            VkSemaphoreWaitInfoKHR waitInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR };
+            waitInfo.semaphoreCount = 1;
+            waitInfo.pSemaphores = &s_VkTimeline;
+            waitInfo.pValues = &timelineValue;
+            VkResult res = vkWaitSemaphoresKHR(s_VkDevice, &waitInfo, timeoutNs - elapsedNs);
+            SMOL_ASSERT(res == VK_SUCCESS || res == VK_TIMEOUT);
+            (void)res;
+        }
+        else
+        {
+            // fences can get reset or destroyed by other threads once unlocked; poll them instead
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        lock.lock();
     }
+}
 
-    void* src = 0;
-    VkResult res = vkMapMemory(s_VkDevice, buffer->memory, srcOffset, size, 0, &src);
-    if (res != VK_SUCCESS)
+// Wait until submitting the batch recorded in the context would stay within backpressure limits, by
+// waiting for the oldest submitted batches. Returns false instead of waiting in non-blocking mode.
+static bool SmolImpl_VkWaitForBackpressure(SmolContext* ctx)
+{
+    if (ctx->secondary)
+        return true;
+    std::unique_lock<std::recursive_mutex> lock(s_VkMutex);
+    const SmolBackpressureLimits& limits = s_VkBackpressure;
+    if (limits.maxInFlightBatches <= 0 && limits.maxInFlightStagingBytes == 0)
+        return true;
+    SmolImpl_VkRetireCompletedFrames();
+    while (s_VkInFlightBatches > 0)
     {
-        SMOL_ASSERT(!"failed to map Vulkan buffer memory for reading");
-        return;
+        const bool over = (limits.maxInFlightBatches > 0 && s_VkInFlightBatches >= limits.maxInFlightBatches) ||
+            (limits.maxInFlightStagingBytes > 0 && s_VkInFlightStagingBytes + ctx->stagingBytes > limits.maxInFlightStagingBytes);
+        if (!over)
+            break;
+        if (limits.nonBlocking)
+            return false;
+        SmolContext* oldestCtx = nullptr;
+        uint64_t oldestSerial = SmolImpl_VkOldestInFlightFrame(&oldestCtx)->serial;
+        lock.unlock();
+        SmolImpl_VkWaitForSerial(oldestSerial);
+        lock.lock();
+    }
+    return true;
+}
+
+// Submit work recorded in the current context, and wait until everything submitted to the GPU is finished.
+static void SmolImpl_VkFinishWork()
+{
+    uint64_t lastSerial = 0;
+    {
+        SmolImpl_VkLock lock(s_VkMutex);
+        SmolImpl_VkSubmit(SmolImpl_VkCtx());
+        lastSerial = SmolImpl_VkLastInFlightSerial(nullptr);
+    }
+    if (lastSerial != 0)
+        SmolImpl_VkWaitForSerial(lastSerial);
+}
+
+static void SmolImpl_VkFreeUnusedDescriptorSets(SmolContext* ctx);
+
+// Make all earlier GPU work complete and its writes visible before any later commands.
+static void SmolImpl_VkCmdFullBarrier(VkCommandBuffer cmdBuffer)
+{
+    VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+static void SmolImpl_VkStartCmdBufferIfNeeded(SmolContext* ctx)
+{
+    if (ctx->cmdBuffer != nullptr)
+        return;
+    SMOL_ASSERT(!ctx->secondary); // parts only record between SmolContextBeginParts and SmolContextEndParts
+
+    SmolImpl_VkFrame& frame = ctx->frames[ctx->frameIndex];
+    {
+        std::unique_lock<std::recursive_mutex> lock(s_VkMutex);
+        // wait until previous batch that used this frame is done
+        if (frame.inFlight)
+        {
+            const uint64_t prevSerial = frame.serial;
+            lock.unlock();
+            SmolImpl_VkWaitForSerial(prevSerial);
+            lock.lock();
+        }
+        SmolImpl_VkRetireCompletedFrames();
+        frame.serial = s_VkNextSerial++;
+        s_VkOpenSerials.push_back(frame.serial);
+        ctx->recordingSerial = frame.serial;
+    }
+    SmolImpl_VkFreeUnusedDescriptorSets(ctx);
+    ctx->bufferStates.clear();
+    ctx->recordStart = std::chrono::steady_clock::now();
+
+    vkResetCommandPool(s_VkDevice, frame.cmdPool, 0);
+
+    VkCommandBufferBeginInfo cbBeginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+    cbBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VkResult res = vkBeginCommandBuffer(frame.cmdBuffer, &cbBeginInfo);
+    SMOL_ASSERT(res == VK_SUCCESS);
+    ctx->cmdBuffer = frame.cmdBuffer;
+    if (frame.queryPool != nullptr)
+        vkCmdResetQueryPool(ctx->cmdBuffer, frame.queryPool, 0, kSmolImpl_VkQueriesPerFrame);
+    if (frame.statsQueryPool != nullptr)
+        vkCmdResetQueryPool(ctx->cmdBuffer, frame.statsQueryPool, 0, kSmolImpl_VkStatsQueriesPerFrame);
+
+    // order against everything submitted earlier; buffer hazards within this command buffer are tracked precisely
+    SmolImpl_VkCmdFullBarrier(ctx->cmdBuffer);
+}
+
+// Submit command buffer to the compute queue; it signals the fence, or the timeline semaphore with the
+// given value. Called either with s_VkMutex locked, or (with EnableSubmitThread) only from the submission thread.
+static void SmolImpl_VkQueueSubmit(VkCommandBuffer cmdBuffer, VkFence fence, uint64_t timelineValue)
+{
+    VkSubmitInfo submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &cmdBuffer;
+    VkTimelineSemaphoreSubmitInfoKHR timelineInfo = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR };
+    if (s_VkTimeline != nullptr)
+    {
+        timelineInfo.signalSemaphoreValueCount = 1;
+        timelineInfo.pSignalSemaphoreValues = &timelineValue;
+        submitInfo.pNext = &timelineInfo;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &s_VkTimeline;
+    }
+    s_VkSubmitCount.fetch_add(1);
+    VkResult res = vkQueueSubmit(s_VkComputeQueue, 1, &submitInfo, fence);
+    SMOL_ASSERT(res == VK_SUCCESS);
+}
+
+// Push a submission onto the submission thread queue. Called with s_VkMutex locked.
+static void SmolImpl_VkSubmitQueuePush(VkCommandBuffer cmdBuffer, VkFence fence, uint64_t timelineValue)
+{
+    SmolImpl_VkSubmission* sub = new SmolImpl_VkSubmission();
+    sub->cmdBuffer = cmdBuffer;
+    sub->fence = fence;
+    sub->timelineValue = timelineValue;
+    SmolImpl_VkSubmission* prev = s_VkSubmitHead.exchange(sub, std::memory_order_acq_rel);
+    prev->next.store(sub, std::memory_order_release);
+
+    const int depth = s_VkSubmitQueueDepth.fetch_add(1) + 1;
+    s_VkSubmitMaxQueueDepth = std::max(s_VkSubmitMaxQueueDepth, depth);
+    s_VkSubmitPushCount.fetch_add(1);
+    if (s_VkSubmitSleeping.load())
+    {
+        // lock so that the thread does not miss the wakeup between checking push count and sleeping
+        std::lock_guard<std::mutex> wakeLock(s_VkSubmitWakeMutex);
+        s_VkSubmitWake.notify_one();
+    }
+}
+
+// Pop the oldest submission; null if the queue is empty, or a producer is in the middle of a push.
+// Intrusive MPSC queue (D. Vyukov): tail node is consumed, stub node is re-pushed when queue runs empty.
+static SmolImpl_VkSubmission* SmolImpl_VkSubmitQueuePop()
+{
+    SmolImpl_VkSubmission* tail = s_VkSubmitTail;
+    SmolImpl_VkSubmission* next = tail->next.load(std::memory_order_acquire);
+    if (tail == &s_VkSubmitStub)
+    {
+        if (next == nullptr)
+            return nullptr;
+        s_VkSubmitTail = tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != nullptr)
+    {
+        s_VkSubmitTail = next;
+        return tail;
+    }
+    if (tail != s_VkSubmitHead.load(std::memory_order_acquire))
+        return nullptr;
+    s_VkSubmitStub.next.store(nullptr, std::memory_order_relaxed);
+    SmolImpl_VkSubmission* prev = s_VkSubmitHead.exchange(&s_VkSubmitStub, std::memory_order_acq_rel);
+    prev->next.store(&s_VkSubmitStub, std::memory_order_release);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != nullptr)
+    {
+        s_VkSubmitTail = next;
+        return tail;
+    }
+    return nullptr;
+}
+
+static void SmolImpl_VkSubmitThreadFunc()
+{
+    for (;;)
+    {
+        const uint64_t pushCount = s_VkSubmitPushCount.load();
+        SmolImpl_VkSubmission* sub = SmolImpl_VkSubmitQueuePop();
+        if (sub == nullptr)
+        {
+            // queue is empty, or a producer is in the middle of a push: sleep until a push finishes
+            std::unique_lock<std::mutex> lock(s_VkSubmitWakeMutex);
+            s_VkSubmitSleeping.store(true);
+            s_VkSubmitWake.wait(lock, [pushCount] { return s_VkSubmitQuit || s_VkSubmitPushCount.load() != pushCount; });
+            s_VkSubmitSleeping.store(false);
+            if (s_VkSubmitQuit && s_VkSubmitQueueDepth.load() == 0)
+                return; // quitting, and everything is submitted
+            continue;
+        }
+        s_VkSubmitQueueDepth.fetch_sub(1);
+        SmolImpl_VkQueueSubmit(sub->cmdBuffer, sub->fence, sub->timelineValue);
+        delete sub;
+    }
+}
+
+// Submit work recorded in the context to the GPU without waiting for it; next recorded work goes into the next frame.
+static void SmolImpl_VkSubmit(SmolContext* ctx)
+{
+    if (!ctx->cmdBuffer)
+        return;
+    SMOL_ASSERT(!ctx->secondary && ctx->activePartCount == 0);
+
+    // make GPU writes visible to host reads
+    VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(ctx->cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    VkResult res = vkEndCommandBuffer(ctx->cmdBuffer);
+    SMOL_ASSERT(res == VK_SUCCESS);
+
+    SmolImpl_VkLock lock(s_VkMutex);
+    SmolImpl_VkFrame& frame = ctx->frames[ctx->frameIndex];
+    // fence is reset (or timeline value picked) right away, even if the submission thread submits the
+    // batch later: waiting for it then just waits until it is submitted and finished
+    VkFence fence = nullptr;
+    if (s_VkTimeline != nullptr)
+    {
+        frame.timelineValue = ++s_VkTimelineValue;
+    }
+    else
+    {
+        vkResetFences(s_VkDevice, 1, &frame.fence);
+        fence = frame.fence;
+    }
+    if (s_VkSubmitThread.joinable())
+        SmolImpl_VkSubmitQueuePush(ctx->cmdBuffer, fence, frame.timelineValue);
+    else
+        SmolImpl_VkQueueSubmit(ctx->cmdBuffer, fence, frame.timelineValue);
+
+    frame.inFlight = true;
+    s_VkInFlightSerials.insert(frame.serial);
+    if (frame.serial <= s_VkCompletedSerial)
+        s_VkCompletedSerial = frame.serial - 1; // batch was recorded while later ones got submitted and finished
+    frame.uploadRingEnd = ctx->uploadRing.head;
+    frame.stagingBytes = ctx->stagingBytes;
+    ++s_VkInFlightBatches;
+    s_VkInFlightStagingBytes += frame.stagingBytes;
+    ctx->stagingBytes = 0;
+    ctx->dispatchCount = 0;
+    ctx->referencedBytes = 0;
+    ctx->cmdBuffer = nullptr;
+    ctx->recordingSerial = 0;
+    ctx->frameIndex = (ctx->frameIndex + 1) % kSmolImpl_VkFramesInFlight;
+}
+
+// Destroy context objects; all of its submitted work has to be finished. Called with s_VkMutex locked.
+static void SmolImpl_VkDestroyContext(SmolContext* ctx)
+{
+    while (!ctx->parts.empty())
+        SmolImpl_VkDestroyContext(ctx->parts.back());
+    if (ctx->parent != nullptr)
+        ctx->parent->parts.erase(std::find(ctx->parent->parts.begin(), ctx->parent->parts.end(), ctx));
+    else if (ctx->recordingSerial != 0)
+        s_VkOpenSerials.erase(std::find(s_VkOpenSerials.begin(), s_VkOpenSerials.end(), ctx->recordingSerial));
+    for (size_t i = 0; i < ctx->descriptorPools.size(); ++i)
+        vkDestroyDescriptorPool(s_VkDevice, ctx->descriptorPools[i], 0);
+    SmolImpl_VkDestroyStagingBuffer(ctx->uploadRing);
+    SmolImpl_VkDestroyStagingBuffer(ctx->readbackStaging);
+    for (int i = 0; i < kSmolImpl_VkFramesInFlight; ++i)
+    {
+        SmolImpl_VkFrame& frame = ctx->frames[i];
+        SMOL_ASSERT(!frame.inFlight);
+        if (frame.fence) vkDestroyFence(s_VkDevice, frame.fence, 0);
+        if (frame.cmdPool) vkDestroyCommandPool(s_VkDevice, frame.cmdPool, 0);
+        if (frame.queryPool) vkDestroyQueryPool(s_VkDevice, frame.queryPool, 0);
+        if (frame.statsQueryPool) vkDestroyQueryPool(s_VkDevice, frame.statsQueryPool, 0);
+    }
+    s_VkContexts.erase(std::find(s_VkContexts.begin(), s_VkContexts.end(), ctx));
+    if (s_VkCurrentContext == ctx)
+        s_VkCurrentContext = nullptr;
+    delete ctx;
+}
+
+void SmolComputeDelete()
+{
+    SmolImpl_VkFinishWork();
+    if (s_VkCompletionThread.joinable())
+    {
+        // callbacks of finished work are still called; ones waiting for work that was never submitted are not
+        {
+            std::lock_guard<std::mutex> lock(s_VkCompletionMutex);
+            s_VkCompletionQuit = true;
+        }
+        s_VkCompletionCond.notify_one();
+        s_VkCompletionThread.join();
+        s_VkCompletions.clear();
+        s_VkCompletionQuit = false;
+    }
+    if (s_VkSubmitThread.joinable())
+    {
+        // everything was submitted already, since all the work is finished
+        {
+            std::lock_guard<std::mutex> lock(s_VkSubmitWakeMutex);
+            s_VkSubmitQuit = true;
+        }
+        s_VkSubmitWake.notify_one();
+        s_VkSubmitThread.join();
+        s_VkSubmitQuit = false;
+        s_VkSubmitPushCount = 0;
+    }
+    s_VkSubmitMaxQueueDepth = 0;
+    s_VkSubmitCount = 0;
+    s_VkBackpressure = SmolBackpressureLimits();
+    s_VkInFlightBatches = 0;
+    s_VkInFlightStagingBytes = 0;
+    while (!s_VkContexts.empty())
+        SmolImpl_VkDestroyContext(s_VkContexts.back());
+    s_VkDefaultContext = nullptr;
+    s_VkOpenSerials.clear();
+    s_VkInFlightSerials.clear();
+    for (size_t i = 0; i < s_VkReadbackPool.size(); ++i)
+        SmolImpl_VkDestroyStagingBuffer(s_VkReadbackPool[i].staging);
+    s_VkReadbackPool.clear();
+    for (size_t i = 0; i < s_VkPendingDeletes.size(); ++i)
+        SmolImpl_VkDestroyPendingDelete(s_VkPendingDeletes[i]);
+    s_VkPendingDeletes.clear();
+    for (size_t i = 0; i < s_VkMemoryBlocks.size(); ++i)
+    {
+        vkFreeMemory(s_VkDevice, s_VkMemoryBlocks[i]->memory, 0);
+        delete s_VkMemoryBlocks[i];
+    }
+    s_VkMemoryBlocks.clear();
+    s_VkDedicatedCount = 0;
+    s_VkDedicatedBytes = 0;
+    s_VkProfiling = false;
+    s_VkProfileEntries.clear();
+    s_VkProfileFirstId = 0;
+    s_VkProfileResults.clear();
+    s_VkInvocationStats = false;
+    SmolImpl_VkSavePipelineCache();
+    if (s_VkPipelineCache) vkDestroyPipelineCache(s_VkDevice, s_VkPipelineCache, 0); s_VkPipelineCache = 0;
+    s_VkPipelineCachePath.clear();
+    s_VkKernelCache.clear();
+    s_VkKernelStats.clear();
+    if (s_VkTimeline) vkDestroySemaphore(s_VkDevice, s_VkTimeline, 0); s_VkTimeline = 0;
+    if (s_VkDevice) vkDestroyDevice(s_VkDevice, 0); s_VkDevice = 0;
+    if (s_VkDebugReportCallback) vkDestroyDebugReportCallbackEXT(s_VkInstance, s_VkDebugReportCallback, 0); s_VkDebugReportCallback = 0;
+    if (s_VkInstance) vkDestroyInstance(s_VkInstance, 0); s_VkInstance = 0;
+    SmolImpl_ShutdownTaskScheduler();
+}
+
+SmolContext* SmolContextCreate()
+{
+    SmolImpl_VkLock lock(s_VkMutex);
+    SmolContext* ctx = new SmolContext();
+    s_VkContexts.push_back(ctx);
+    if (!SmolImpl_VkInitContext(ctx))
+    {
+        SmolImpl_VkDestroyContext(ctx);
+        return nullptr;
+    }
+    return ctx;
+}
+
+void SmolContextDelete(SmolContext* context)
+{
+    if (context == nullptr)
+        return;
+    SMOL_ASSERT(context != s_VkDefaultContext && context->parent == nullptr);
+    std::unique_lock<std::recursive_mutex> lock(s_VkMutex);
+    SmolImpl_VkSubmit(context);
+    const uint64_t lastSerial = SmolImpl_VkLastInFlightSerial(context);
+    if (lastSerial != 0)
+    {
+        lock.unlock();
+        SmolImpl_VkWaitForSerial(lastSerial);
+        lock.lock();
+    }
+    SmolImpl_VkDestroyContext(context);
+}
+
+void SmolContextSetCurrent(SmolContext* context)
+{
+    s_VkCurrentContext = context;
+}
+
+SmolContext* SmolContextGetCurrent()
+{
+    return SmolImpl_VkCtx();
+}
+
+SmolResult SmolContextFlush(SmolContext* context)
+{
+    SmolContext* ctx = context != nullptr ? context : SmolImpl_VkCtx();
+    if (ctx->cmdBuffer != nullptr && !SmolImpl_VkWaitForBackpressure(ctx))
+        return SmolResult::WouldBlock;
+    SmolImpl_VkSubmit(ctx);
+    return SmolResult::Success;
+}
+
+void SmolContextSetFlushPolicy(SmolContext* context, const SmolFlushPolicy& policy)
+{
+    SmolContext* ctx = context != nullptr ? context : SmolImpl_VkCtx();
+    SMOL_ASSERT(ctx->parent == nullptr);
+    ctx->flushPolicy = policy;
+}
+
+SmolFence SmolComputeFlush(SmolResult* result)
+{
+    SmolImpl_VkLock lock(s_VkMutex);
+    SmolContext* ctx = SmolImpl_VkCtx();
+    SmolResult res = SmolContextFlush(ctx);
+    if (result != nullptr)
+        *result = res;
+    // fence is the last batch the context submitted; if it never did, fence value is 0 (complete)
+    SmolFence fence;
+    fence.value = ctx->frames[(ctx->frameIndex + kSmolImpl_VkFramesInFlight - 1) % kSmolImpl_VkFramesInFlight].serial;
+    return fence;
+}
+
+bool SmolFenceIsComplete(SmolFence fence)
+{
+    if (fence.value <= s_VkCompletedSerial)
+        return true;
+    SmolImpl_VkRetireCompletedFrames();
+    SmolImpl_VkLock lock(s_VkMutex);
+    return SmolImpl_VkSerialRetired(fence.value);
+}
+
+bool SmolFenceWait(SmolFence fence, uint64_t timeoutNs)
+{
+    return SmolImpl_VkWaitForSerial(fence.value, timeoutNs);
+}
+
+bool SmolContextBeginParts(SmolContext* context, int partCount)
+{
+    SmolContext* ctx = context != nullptr ? context : SmolImpl_VkCtx();
+    SMOL_ASSERT(!ctx->secondary && ctx->activePartCount == 0 && partCount > 0);
+    SmolImpl_VkStartCmdBufferIfNeeded(ctx);
+
+    // parts are created on first use, and kept around for later batches
+    while ((int)ctx->parts.size() < partCount)
+    {
+        SmolImpl_VkLock lock(s_VkMutex);
+        SmolContext* part = new SmolContext();
+        part->parent = ctx;
+        part->secondary = true;
+        ctx->parts.push_back(part);
+        s_VkContexts.push_back(part);
+        if (!SmolImpl_VkInitContext(part))
+        {
+            SmolImpl_VkDestroyContext(part);
+            return false;
+        }
+    }
+
+    // secondary command buffers of the parent frame; they are done once the parent frame is done
+    VkCommandBufferInheritanceInfo inheritInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO };
+    VkCommandBufferBeginInfo cbBeginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+    cbBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    cbBeginInfo.pInheritanceInfo = &inheritInfo;
+    for (int i = 0; i < partCount; ++i)
+    {
+        SmolContext* part = ctx->parts[i];
+        SmolImpl_VkFrame& frame = part->frames[ctx->frameIndex];
+        if (part->recordingSerial != ctx->recordingSerial)
+        {
+            // first use of the part in this batch: the frame's earlier batch is done, reuse its resources
+            part->frameIndex = ctx->frameIndex;
+            part->recordingSerial = ctx->recordingSerial;
+            vkResetCommandPool(s_VkDevice, frame.cmdPool, 0);
+            frame.secondaryUsed = 0;
+            SmolImpl_VkFreeUnusedDescriptorSets(part);
+        }
+        if (frame.secondaryUsed == frame.secondaryBuffers.size())
+        {
+            VkCommandBufferAllocateInfo cbAllocInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+            cbAllocInfo.commandPool = frame.cmdPool;
+            cbAllocInfo.commandBufferCount = 1;
+            cbAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            VkCommandBuffer cmdBuffer = nullptr;
+            VkResult res = vkAllocateCommandBuffers(s_VkDevice, &cbAllocInfo, &cmdBuffer);
+            SMOL_ASSERT(res == VK_SUCCESS);
+            frame.secondaryBuffers.push_back(cmdBuffer);
+        }
+        part->bufferStates.clear();
+        part->cmdBuffer = frame.secondaryBuffers[frame.secondaryUsed++];
+        VkResult res = vkBeginCommandBuffer(part->cmdBuffer, &cbBeginInfo);
+        SMOL_ASSERT(res == VK_SUCCESS);
+    }
+    ctx->activePartCount = partCount;
+    return true;
+}
+
+SmolContext* SmolContextGetPart(SmolContext* context, int index)
+{
+    SmolContext* ctx = context != nullptr ? context : SmolImpl_VkCtx();
+    SMOL_ASSERT(index >= 0 && index < ctx->activePartCount);
+    return ctx->parts[index];
+}
+
+void SmolContextEndParts(SmolContext* context)
+{
+    SmolContext* ctx = context != nullptr ? context : SmolImpl_VkCtx();
+    SMOL_ASSERT(ctx->activePartCount > 0);
+    for (int i = 0; i < ctx->activePartCount; ++i)
+    {
+        SmolContext* part = ctx->parts[i];
+        SMOL_ASSERT(part->profileStack.empty());
+        VkResult res = vkEndCommandBuffer(part->cmdBuffer);
+        SMOL_ASSERT(res == VK_SUCCESS);
+        // parts track buffer accesses only within themselves, so order them fully against each other
+        SmolImpl_VkCmdFullBarrier(ctx->cmdBuffer);
+        vkCmdExecuteCommands(ctx->cmdBuffer, 1, &part->cmdBuffer);
+        part->cmdBuffer = nullptr;
+    }
+    SmolImpl_VkCmdFullBarrier(ctx->cmdBuffer);
+    ctx->bufferStates.clear();
+    ctx->activePartCount = 0;
+}
+
+SmolBackend SmolComputeGetBackend()
+{
+    return SmolBackend::Vulkan;
+}
+
+SmolPipelineCacheStats SmolComputeGetPipelineCacheStats()
+{
+    return s_VkPipelineCacheStats;
+}
+
+struct SmolBuffer
+{
+    VkBuffer buffer = nullptr;
+    VkBufferUsageFlags usageFlags = 0;
+    SmolImpl_VkAllocation alloc;
+    uint8_t* mapped = nullptr; // persistently mapped pointer for host visible memory
+    size_t size = 0;
+    SmolBufferType type = SmolBufferType::Structured;
+    SmolBufferUsage usage = SmolBufferUsage::Dynamic;
+    size_t structElementSize = 0;
+    bool hostVisible = false;
+    bool coherent = false;
+    std::atomic<uint64_t> gpuUseSerial { 0 }; // last batch that accessed the buffer on the GPU
+    std::atomic<uint64_t> gpuWriteSerial { 0 }; // last batch that wrote into the buffer on the GPU
+    std::atomic<int> commandListRefs { 0 }; // command lists using the buffer; those can't be moved
+    // current SmolBufferMap state
+    uint8_t* mapPtr = nullptr;
+    size_t mapOffset = 0;
+    size_t mapSize = 0;
+    SmolBufferMapAccess mapAccess = SmolBufferMapAccess::Read;
+    SmolImpl_VkStagingBuffer mapStaging; // device local buffers: pooled readback staging buffer of this map
+};
+
+// Find memory type out of allowed typeBits that has all the required flags, preferably
+// as many of preferred flags and as few of avoided flags as possible.
+static uint32_t SmolImpl_VkFindMemoryType(uint32_t typeBits, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred, VkMemoryPropertyFlags avoided)
+{
+    uint32_t best = VK_MAX_MEMORY_TYPES;
+    int bestScore = -1000;
+    for (uint32_t mt = 0; mt < s_VkMemoryProperties.memoryTypeCount; ++mt)
+    {
+        if (!(typeBits & (1u << mt)))
+            continue;
+        VkMemoryPropertyFlags flags = s_VkMemoryProperties.memoryTypes[mt].propertyFlags;
+        if ((flags & required) != required)
+            continue;
+        int score = 0;
+        for (uint32_t bit = 0; bit < 32; ++bit)
+        {
+            if (flags & preferred & (1u << bit)) ++score;
+            if (flags & avoided & (1u << bit)) --score;
+        }
+        if (score > bestScore)
+        {
+            best = mt;
+            bestScore = score;
+        }
+    }
+    return best;
+}
+
+static uint32_t SmolImpl_VkFindBufferMemoryType(uint32_t typeBits, SmolBufferUsage usage)
+{
+    uint32_t memType = VK_MAX_MEMORY_TYPES;
+    switch (usage)
+    {
+    case SmolBufferUsage::GpuOnly:
+        memType = SmolImpl_VkFindMemoryType(typeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+        break;
+    case SmolBufferUsage::Upload:
+        memType = SmolImpl_VkFindMemoryType(typeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+        break;
+    case SmolBufferUsage::Readback:
+        memType = SmolImpl_VkFindMemoryType(typeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0);
+        break;
+    default:
+        break;
+    }
+    if (memType == VK_MAX_MEMORY_TYPES)
+        memType = SmolImpl_VkFindMemoryType(typeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, 0, 0);
+    return memType;
+}
+
+static bool SmolImpl_VkAllocDedicated(VkDeviceSize size, uint32_t memType, SmolImpl_VkAllocation& alloc)
+{
+    const VkMemoryAllocateInfo memoryAllocateInfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, 0, size, memType };
+    VkDeviceMemory memory = 0;
+    VkResult res = vkAllocateMemory(s_VkDevice, &memoryAllocateInfo, 0, &memory);
+    if (res != VK_SUCCESS)
+        return false;
+    alloc = SmolImpl_VkAllocation();
+    alloc.flags = s_VkMemoryProperties.memoryTypes[memType].propertyFlags;
+    if (alloc.flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+    {
+        // keep host visible memory mapped for the whole allocation lifetime
+        void* mapped = nullptr;
+        res = vkMapMemory(s_VkDevice, memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+        if (res != VK_SUCCESS)
+        {
+            vkFreeMemory(s_VkDevice, memory, 0);
+            return false;
+        }
+        alloc.mapped = (uint8_t*)mapped;
+    }
+    alloc.memory = memory;
+    alloc.memorySize = size;
+    alloc.size = size;
+    ++s_VkDedicatedCount;
+    s_VkDedicatedBytes += size;
+    return true;
+}
+
+static SmolImpl_VkMemoryBlock* SmolImpl_VkCreateMemoryBlock(uint32_t memType, uint32_t sizeClass)
+{
+    VkDeviceSize slotSize = VkDeviceSize(1) << (kSmolImpl_VkMinSlotSizeLog2 + sizeClass);
+    VkDeviceSize blockSize = slotSize * kSmolImpl_VkSlotsPerBlock;
+    if (blockSize < kSmolImpl_VkMinBlockSize) blockSize = kSmolImpl_VkMinBlockSize;
+    if (blockSize > kSmolImpl_VkMaxBlockSize) blockSize = kSmolImpl_VkMaxBlockSize;
+    SmolImpl_VkAllocation mem;
+    if (!SmolImpl_VkAllocDedicated(blockSize, memType, mem))
+        return nullptr;
+    --s_VkDedicatedCount;
+    s_VkDedicatedBytes -= blockSize;
+
+    SmolImpl_VkMemoryBlock* block = new SmolImpl_VkMemoryBlock();
+    block->memory = mem.memory;
+    block->size = blockSize;
+    block->slotSize = slotSize;
+    block->mapped = mem.mapped;
+    block->memType = memType;
+    block->sizeClass = sizeClass;
+    uint32_t slotCount = (uint32_t)(blockSize / slotSize);
+    block->owners.resize(slotCount, nullptr);
+    block->freeSlots.resize(slotCount);
+    for (uint32_t i = 0; i < slotCount; ++i)
+        block->freeSlots[i] = slotCount - 1 - i; // hand out low slots first
+    s_VkMemoryBlocks.push_back(block);
+    return block;
+}
+
+static void SmolImpl_VkAllocSlot(SmolImpl_VkMemoryBlock* block, SmolImpl_VkAllocation& alloc)
+{
+    SMOL_ASSERT(!block->freeSlots.empty());
+    uint32_t slot = block->freeSlots.back();
+    block->freeSlots.pop_back();
+    ++block->usedCount;
+    alloc = SmolImpl_VkAllocation();
+    alloc.memory = block->memory;
+    alloc.memorySize = block->size;
+    alloc.offset = slot * block->slotSize;
+    alloc.size = block->slotSize;
+    alloc.mapped = block->mapped ? block->mapped + alloc.offset : nullptr;
+    alloc.flags = s_VkMemoryProperties.memoryTypes[block->memType].propertyFlags;
+    alloc.block = block;
+    alloc.slot = slot;
+}
+
+static uint32_t SmolImpl_VkSizeClass(const VkMemoryRequirements& requirements)
+{
+    VkDeviceSize size = requirements.size > requirements.alignment ? requirements.size : requirements.alignment;
+    uint32_t sizeClass = 0;
+    while (sizeClass < kSmolImpl_VkSizeClassCount && (VkDeviceSize(1) << (kSmolImpl_VkMinSlotSizeLog2 + sizeClass)) < size)
+        ++sizeClass;
+    return sizeClass;
+}
+
+// Allocate memory for a buffer: from a memory block if it fits into a size class, dedicated otherwise.
+static bool SmolImpl_VkAllocMemory(const VkMemoryRequirements& requirements, SmolBufferUsage usage, bool dedicated, SmolImpl_VkAllocation& alloc)
+{
+    uint32_t memType = SmolImpl_VkFindBufferMemoryType(requirements.memoryTypeBits, usage);
+    if (memType == VK_MAX_MEMORY_TYPES)
+        return false;
+    uint32_t sizeClass = SmolImpl_VkSizeClass(requirements);
+    if (dedicated || sizeClass >= kSmolImpl_VkSizeClassCount)
+        return SmolImpl_VkAllocDedicated(requirements.size, memType, alloc);
+
+    SmolImpl_VkMemoryBlock* block = nullptr;
+    for (size_t i = 0; i < s_VkMemoryBlocks.size(); ++i)
+    {
+        SmolImpl_VkMemoryBlock* b = s_VkMemoryBlocks[i];
+        if (b->memType == memType && b->sizeClass == sizeClass && !b->freeSlots.empty())
+        {
+            block = b;
+            break;
+        }
+    }
+    if (block == nullptr)
+        block = SmolImpl_VkCreateMemoryBlock(memType, sizeClass);
+    if (block == nullptr)
+        return SmolImpl_VkAllocDedicated(requirements.size, memType, alloc); // could not get a whole block; try just the buffer size
+    SmolImpl_VkAllocSlot(block, alloc);
+    return true;
+}
+
+static void SmolImpl_VkDestroyMemoryBlock(SmolImpl_VkMemoryBlock* block)
+{
+    vkFreeMemory(s_VkDevice, block->memory, 0);
+    s_VkMemoryBlocks.erase(std::find(s_VkMemoryBlocks.begin(), s_VkMemoryBlocks.end(), block));
+    delete block;
+}
+
+static void SmolImpl_VkFreeMemory(const SmolImpl_VkAllocation& alloc)
+{
+    if (alloc.memory == nullptr)
+        return;
+    SmolImpl_VkMemoryBlock* block = alloc.block;
+    if (block == nullptr)
+    {
+        vkFreeMemory(s_VkDevice, alloc.memory, 0);
+        --s_VkDedicatedCount;
+        s_VkDedicatedBytes -= alloc.size;
+        return;
+    }
+    block->owners[alloc.slot] = nullptr;
+    block->freeSlots.push_back(alloc.slot);
+    --block->usedCount;
+    if (block->usedCount == 0)
+    {
+        // release empty block, unless it is the only one of its kind (avoids allocate/free churn)
+        for (size_t i = 0; i < s_VkMemoryBlocks.size(); ++i)
+        {
+            SmolImpl_VkMemoryBlock* b = s_VkMemoryBlocks[i];
+            if (b != block && b->memType == block->memType && b->sizeClass == block->sizeClass)
+            {
+                SmolImpl_VkDestroyMemoryBlock(block);
+                break;
+            }
+        }
+    }
+}
+
+static bool SmolImpl_VkCreateBufferAndMemory(size_t size, VkBufferUsageFlags usage, SmolBufferUsage memUsage, bool dedicated, VkBuffer* outBuffer, SmolImpl_VkAllocation* outAlloc)
+{
+    const VkBufferCreateInfo bufferCreateInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO, 0, 0, size, usage, VK_SHARING_MODE_EXCLUSIVE, 1, &s_VkComputeQueueIndex };
+    VkBuffer buffer = 0;
+    VkResult res = vkCreateBuffer(s_VkDevice, &bufferCreateInfo, 0, &buffer);
+    if (res != VK_SUCCESS)
+        return false;
+    VkMemoryRequirements requirements = {};
+    vkGetBufferMemoryRequirements(s_VkDevice, buffer, &requirements);
+
+    SmolImpl_VkAllocation alloc;
+    if (!SmolImpl_VkAllocMemory(requirements, memUsage, dedicated, alloc))
+    {
+        vkDestroyBuffer(s_VkDevice, buffer, 0);
+        return false;
+    }
+    res = vkBindBufferMemory(s_VkDevice, buffer, alloc.memory, alloc.offset);
+    if (res != VK_SUCCESS)
+    {
+        SmolImpl_VkFreeMemory(alloc);
+        vkDestroyBuffer(s_VkDevice, buffer, 0);
+        return false;
+    }
+    *outBuffer = buffer;
+    *outAlloc = alloc;
+    return true;
+}
+
+static bool SmolImpl_VkCreateStagingBuffer(SmolImpl_VkStagingBuffer& sb, size_t size, SmolBufferUsage memUsage)
+{
+    if (!SmolImpl_VkCreateBufferAndMemory(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, memUsage, true, &sb.buffer, &sb.alloc))
+        return false;
+    if (sb.alloc.mapped == nullptr)
+    {
+        SmolImpl_VkDestroyStagingBuffer(sb);
+        return false;
+    }
+    sb.mapped = sb.alloc.mapped;
+    sb.size = size;
+    sb.head = 0;
+    sb.coherent = (sb.alloc.flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+    return true;
+}
+
+static void SmolImpl_VkDestroyStagingBuffer(SmolImpl_VkStagingBuffer& sb)
+{
+    if (sb.buffer != 0)
+        vkDestroyBuffer(s_VkDevice, sb.buffer, 0);
+    SmolImpl_VkFreeMemory(sb.alloc);
+    sb = SmolImpl_VkStagingBuffer();
+}
+
+// Flush CPU writes to, or invalidate before CPU reads from, non-coherent mapped memory range (relative to allocation start).
+static void SmolImpl_VkFlushMappedRange(const SmolImpl_VkAllocation& alloc, size_t offset, size_t size, bool flush)
+{
+    const VkDeviceSize atom = s_VkDeviceProperties.limits.nonCoherentAtomSize > 0 ? s_VkDeviceProperties.limits.nonCoherentAtomSize : 1;
+    VkDeviceSize begin = (alloc.offset + offset) / atom * atom;
+    VkDeviceSize end = (alloc.offset + offset + size + atom - 1) / atom * atom;
+    VkMappedMemoryRange range = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, 0, alloc.memory, begin, end >= alloc.memorySize ? VK_WHOLE_SIZE : end - begin };
+    if (flush)
+        vkFlushMappedMemoryRanges(s_VkDevice, 1, &range);
+    else
+        vkInvalidateMappedMemoryRanges(s_VkDevice, 1, &range);
+}
+
+// Find space for "size" bytes in the context upload ring without overwriting data still in use by the GPU.
+static bool SmolImpl_VkUploadRingFits(SmolContext* ctx, size_t size, size_t* outOffset)
+{
+    SmolImpl_VkStagingBuffer& ring = ctx->uploadRing;
+    if (ring.buffer == nullptr)
+        return false;
+    const size_t retiredEnd = ctx->uploadRingRetiredEnd.exchange(~(size_t)0, std::memory_order_acquire);
+    if (retiredEnd != ~(size_t)0)
+        ring.tail = retiredEnd;
+    if (ring.head == ring.tail)
+        ring.head = ring.tail = 0; // nothing in use, start from the beginning
+    const size_t kAlign = 16;
+    size_t offset = (ring.head + kAlign - 1) & ~(kAlign - 1);
+    if (ring.head >= ring.tail)
+    {
+        // free space is at the end, and (after wrapping around) at the start up to tail
+        if (offset + size <= ring.size)
+        {
+            *outOffset = offset;
+            return true;
+        }
+        if (size < ring.tail)
+        {
+            *outOffset = 0;
+            return true;
+        }
+        return false;
+    }
+    // wrapped around: free space is between head and tail
+    if (offset + size < ring.tail)
+    {
+        *outOffset = offset;
+        return true;
+    }
+    return false;
+}
+
+// Allocate space in context upload staging ring; if it's full then waits for GPU to finish using older data.
+static size_t SmolImpl_VkAllocUpload(SmolContext* ctx, size_t size)
+{
+    SMOL_ASSERT(!ctx->secondary); // no buffer uploads while recording into a part or command list
+    size_t offset = 0;
+    while (!SmolImpl_VkUploadRingFits(ctx, size, &offset))
+    {
+        uint64_t oldestSerial = 0;
+        {
+            // frames are retired by other threads too
+            SmolImpl_VkLock lock(s_VkMutex);
+            if (SmolImpl_VkFrame* frame = SmolImpl_VkOldestContextFrame(ctx))
+                oldestSerial = frame->serial;
+        }
+        if (oldestSerial != 0)
+        {
+            // wait for oldest submitted batch to free up its part of the ring
+            SmolImpl_VkWaitForSerial(oldestSerial);
+        }
+        else if (ctx->cmdBuffer != nullptr && ctx->uploadRing.head != ctx->uploadRing.tail)
+        {
+            // only the batch being recorded uses the ring; submit and wait for it
+            SmolImpl_VkWaitForSerial(ctx->recordingSerial);
+        }
+        else
+        {
+            // ring is not used by anything and is still too small: grow it
+            size_t newSize = ctx->uploadRing.size * 2;
+            if (newSize < kSmolImpl_VkUploadRingMinSize) newSize = kSmolImpl_VkUploadRingMinSize;
+            if (newSize < size) newSize = size;
+            SmolImpl_VkLock lock(s_VkMutex);
+            SmolImpl_VkDestroyStagingBuffer(ctx->uploadRing);
+            ctx->uploadRingRetiredEnd = ~(size_t)0; // positions in the old ring
+            if (!SmolImpl_VkCreateStagingBuffer(ctx->uploadRing, newSize, SmolBufferUsage::Upload))
+                return ~(size_t)0;
+        }
+    }
+    ctx->uploadRing.head = offset + size;
+    ctx->stagingBytes += size;
+    return offset;
+}
+
+// Buffer barriers needed before the next GPU command, gathered from all the buffers it accesses
+struct SmolImpl_VkBarrierBatch
+{
+    VkPipelineStageFlags srcStages = 0;
+    VkPipelineStageFlags dstStages = 0;
+    uint32_t count = 0;
+    VkBufferMemoryBarrier barriers[SmolImpl_VkMaxResources + 1]; // all kernel resources, plus indirect arguments
+};
+
+// Record that the next GPU command in the context accesses the buffer, and add a barrier into the batch
+// if that is a hazard against earlier accesses in this command buffer (read after write, write after read,
+// write after write). Independent accesses don't get any barriers. The first access in a command
+// buffer starts from a clean state, since command buffers start with a full barrier.
+static void SmolImpl_VkProcessEvictions(SmolContext* ctx);
+
+static void SmolImpl_VkTrackAccess(SmolContext* ctx, SmolImpl_VkBarrierBatch& batch, SmolBuffer* buffer, VkPipelineStageFlags stage, VkAccessFlags access, bool write)
+{
+    // a deleted buffer's state must be gone before a new buffer at the same address shows up
+    SmolImpl_VkProcessEvictions(ctx);
+    SmolImpl_VkAtomicMax(buffer->gpuUseSerial, ctx->recordingSerial);
+    if (write)
+        SmolImpl_VkAtomicMax(buffer->gpuWriteSerial, ctx->recordingSerial);
+
+    auto ins = ctx->bufferStates.insert(std::make_pair(buffer, SmolImpl_VkBufferState()));
+    if (ins.second)
+    {
+        ctx->referencedBytes += buffer->size;
+        if (ctx->commandList != nullptr)
+            ++buffer->commandListRefs; // released in SmolCommandListDelete
+    }
+    SmolImpl_VkBufferState& st = ins.first->second;
+
+    VkPipelineStageFlags srcStages = 0;
+    VkAccessFlags srcAccess = 0;
+    if (write)
+    {
+        // WAW needs the previous write to be made available; WAR only needs the reads to finish
+        srcStages = st.writeStages | st.readStages;
+        srcAccess = st.writeAccess;
+        st.writeStages = stage;
+        st.writeAccess = access;
+        st.readStages = 0;
+        st.visibleStages = 0;
+        st.visibleAccess = 0;
+    }
+    else
+    {
+        // RAW, unless an earlier barrier already made the write visible to this kind of read
+        if (st.writeAccess != 0 && ((st.visibleStages & stage) != stage || (st.visibleAccess & access) != access))
+        {
+            srcStages = st.writeStages;
+            srcAccess = st.writeAccess;
+            st.visibleStages |= stage;
+            st.visibleAccess |= access;
+        }
+        st.readStages |= stage;
+    }
+    if (srcStages == 0)
+        return;
+
+    batch.srcStages |= srcStages;
+    batch.dstStages |= stage;
+    for (uint32_t i = 0; i < batch.count; ++i)
+    {
+        // same buffer accessed several times by one command
+        if (batch.barriers[i].buffer == buffer->buffer)
+        {
+            batch.barriers[i].srcAccessMask |= srcAccess;
+            batch.barriers[i].dstAccessMask |= access;
+            return;
+        }
+    }
+    SMOL_ASSERT(batch.count < SmolImpl_VkMaxResources + 1);
+    VkBufferMemoryBarrier& barrier = batch.barriers[batch.count++];
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.pNext = nullptr;
+    barrier.srcAccessMask = srcAccess;
+    barrier.dstAccessMask = access;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = buffer->buffer;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+}
+
+static void SmolImpl_VkCmdBarriers(SmolContext* ctx, const SmolImpl_VkBarrierBatch& batch)
+{
+    if (batch.srcStages == 0)
+        return;
+    vkCmdPipelineBarrier(ctx->cmdBuffer, batch.srcStages, batch.dstStages, 0, 0, nullptr, batch.count, batch.barriers, 0, nullptr);
+}
+
+static const size_t kSmolImpl_VkMaxCachedDescriptorSets = 16 * 1024;
+
+// Free a descriptor set of the context now if GPU is done with it, or when the context starts a later batch otherwise.
+static void SmolImpl_VkFreeDescriptorSet(SmolContext* ctx, const SmolImpl_VkDescriptorEntry& entry)
+{
+    SmolImpl_VkLock lock(s_VkMutex);
+    if (SmolImpl_VkSerialComplete(entry.gpuUseSerial))
+        vkFreeDescriptorSets(s_VkDevice, entry.pool, 1, &entry.ds);
+    else
+        ctx->descriptorFrees.push_back(entry);
+}
+
+static void SmolImpl_VkFreeUnusedDescriptorSets(SmolContext* ctx)
+{
+    SmolImpl_VkLock lock(s_VkMutex);
+    size_t dst = 0;
+    for (size_t i = 0; i < ctx->descriptorFrees.size(); ++i)
+    {
+        const SmolImpl_VkDescriptorEntry& entry = ctx->descriptorFrees[i];
+        if (SmolImpl_VkSerialComplete(entry.gpuUseSerial))
+            vkFreeDescriptorSets(s_VkDevice, entry.pool, 1, &entry.ds);
+        else
+            ctx->descriptorFrees[dst++] = entry;
+    }
+    ctx->descriptorFrees.resize(dst);
+}
+
+// Remove cached descriptor sets that use the given layout or buffer, and access state of a deleted
+// buffer, from all contexts. Each context drops them before its next dispatch or buffer access, on its
+// own thread.
+static void SmolImpl_VkEvictDescriptorSets(VkDescriptorSetLayout layout, VkBuffer buffer, SmolBuffer* deleted = nullptr)
+{
+    SmolImpl_VkLock lock(s_VkMutex);
+    for (size_t i = 0; i < s_VkContexts.size(); ++i)
+    {
+        SmolImpl_VkEviction ev;
+        ev.layout = layout;
+        ev.buffer = buffer;
+        ev.deleted = deleted;
+        s_VkContexts[i]->evictions.push_back(ev);
+        s_VkContexts[i]->hasEvictions = true;
+    }
+}
+
+static void SmolImpl_VkProcessEvictions(SmolContext* ctx)
+{
+    if (!ctx->hasEvictions)
+        return;
+    std::vector<SmolImpl_VkEviction> evictions;
+    {
+        SmolImpl_VkLock lock(s_VkMutex);
+        evictions.swap(ctx->evictions);
+        ctx->hasEvictions = false;
+    }
+    for (size_t i = 0; i < evictions.size(); ++i)
+    {
+        if (evictions[i].deleted != nullptr)
+            ctx->bufferStates.erase(evictions[i].deleted);
+    }
+    for (auto it = ctx->descriptorCache.begin(); it != ctx->descriptorCache.end(); )
+    {
+        bool evict = false;
+        for (size_t i = 0; i < evictions.size() && !evict; ++i)
+        {
+            const SmolImpl_VkEviction& ev = evictions[i];
+            evict = (ev.layout != nullptr && it->first.layout == ev.layout) || (ev.buffer != nullptr && it->first.Uses(ev.buffer));
+        }
+        if (evict)
+        {
+            SmolImpl_VkFreeDescriptorSet(ctx, it->second);
+            it = ctx->descriptorCache.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+// Remove cached descriptor sets of the context that no GPU work is using anymore.
+static void SmolImpl_VkTrimDescriptorCache(SmolContext* ctx)
+{
+    SmolImpl_VkLock lock(s_VkMutex);
+    for (auto it = ctx->descriptorCache.begin(); it != ctx->descriptorCache.end(); )
+    {
+        if (SmolImpl_VkSerialComplete(it->second.gpuUseSerial))
+        {
+            SmolImpl_VkFreeDescriptorSet(ctx, it->second);
+            it = ctx->descriptorCache.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+static VkDescriptorSet SmolImpl_VkAllocDescriptorSet(SmolContext* ctx, VkDescriptorSetLayout layout, VkDescriptorPool* outPool)
+{
+    VkDescriptorSetAllocateInfo dsAllocInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+    dsAllocInfo.descriptorSetCount = 1;
+    dsAllocInfo.pSetLayouts = &layout;
+    VkDescriptorSet ds = nullptr;
+
+    // try existing pools, newest first
+    for (size_t i = ctx->descriptorPools.size(); i-- > 0; )
+    {
+        dsAllocInfo.descriptorPool = ctx->descriptorPools[i];
+        if (vkAllocateDescriptorSets(s_VkDevice, &dsAllocInfo, &ds) == VK_SUCCESS)
+        {
+            *outPool = ctx->descriptorPools[i];
+            return ds;
+        }
+    }
+
+    // all full: chain in a new pool
+    VkDescriptorPoolSize poolSizes[] =
+    {
+        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, kSmolImpl_VkDescriptorPoolSets * 4 },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, kSmolImpl_VkDescriptorPoolSets * 4 },
+    };
+    VkDescriptorPoolCreateInfo poolCreateInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+    poolCreateInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+    poolCreateInfo.maxSets = kSmolImpl_VkDescriptorPoolSets;
+    poolCreateInfo.poolSizeCount = sizeof(poolSizes)/sizeof(poolSizes[0]);
+    poolCreateInfo.pPoolSizes = poolSizes;
+    VkDescriptorPool pool = nullptr;
+    if (vkCreateDescriptorPool(s_VkDevice, &poolCreateInfo, 0, &pool) != VK_SUCCESS)
+        return nullptr;
+    ctx->descriptorPools.push_back(pool);
+    dsAllocInfo.descriptorPool = pool;
+    if (vkAllocateDescriptorSets(s_VkDevice, &dsAllocInfo, &ds) != VK_SUCCESS)
+        return nullptr;
+    *outPool = pool;
+    return ds;
+}
+
+SmolBuffer* SmolBufferCreate(size_t byteSize, SmolBufferType type, size_t structElementSize, SmolBufferUsage usage)
+{
+    VkBufferUsageFlags bufUsage = type == SmolBufferType::Constant ? VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT : VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    if (type == SmolBufferType::Indirect)
+        bufUsage |= VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+    bufUsage |= VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    VkBuffer buffer = 0;
+    SmolImpl_VkAllocation alloc;
+    SmolImpl_VkLock lock(s_VkMutex);
+    if (!SmolImpl_VkCreateBufferAndMemory(byteSize, bufUsage, usage, false, &buffer, &alloc))
+        return nullptr;
+
+    SmolBuffer* buf = new SmolBuffer();
+    buf->buffer = buffer;
+    buf->usageFlags = bufUsage;
+    buf->alloc = alloc;
+    buf->size = byteSize;
+    buf->type = type;
+    buf->usage = usage;
+    buf->structElementSize = structElementSize;
+    // on unified memory devices, even "GPU only" memory can be host visible
+    buf->hostVisible = (alloc.flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+    buf->coherent = (alloc.flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+    buf->mapped = alloc.mapped;
+    if (alloc.block != nullptr)
+        alloc.block->owners[alloc.slot] = buf;
+    return buf;
+}
+
+// Record a GPU copy of context upload ring data into a device local buffer.
+static void SmolImpl_VkCmdCopyFromUploadRing(SmolContext* ctx, SmolBuffer* buffer, size_t srcOffset, size_t dstOffset, size_t size)
+{
+    if (!ctx->uploadRing.coherent)
+        SmolImpl_VkFlushMappedRange(ctx->uploadRing.alloc, srcOffset, size, true);
+    SmolImpl_VkStartCmdBufferIfNeeded(ctx);
+    SmolImpl_VkBarrierBatch barriers;
+    SmolImpl_VkTrackAccess(ctx, barriers, buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, true);
+    SmolImpl_VkCmdBarriers(ctx, barriers);
+    VkBufferCopy region = { srcOffset, dstOffset, size };
+    vkCmdCopyBuffer(ctx->cmdBuffer, ctx->uploadRing.buffer, buffer->buffer, 1, &region);
+}
+
+// Copy device local buffer data range into context readback staging memory, and wait for it. Returns pointer to the data.
+static const uint8_t* SmolImpl_VkReadbackToStaging(SmolContext* ctx, SmolBuffer* buffer, size_t srcOffset, size_t size)
+{
+    SMOL_ASSERT(!ctx->secondary); // no buffer readbacks while recording into a part or command list
+    if (ctx->readbackStaging.size < size)
+    {
+        // wait for this context's earlier readbacks before replacing the staging buffer
+        SmolImpl_VkSubmit(ctx);
+        const SmolImpl_VkFrame& last = ctx->frames[(ctx->frameIndex + kSmolImpl_VkFramesInFlight - 1) % kSmolImpl_VkFramesInFlight];
+        if (last.inFlight)
+            SmolImpl_VkWaitForSerial(last.serial);
+        size_t newSize = ctx->readbackStaging.size * 2;
+        if (newSize < size) newSize = size;
+        SmolImpl_VkLock lock(s_VkMutex);
+        SmolImpl_VkDestroyStagingBuffer(ctx->readbackStaging);
+        if (!SmolImpl_VkCreateStagingBuffer(ctx->readbackStaging, newSize, SmolBufferUsage::Readback))
+            return nullptr;
+    }
+    SmolImpl_VkStartCmdBufferIfNeeded(ctx);
+    SmolImpl_VkBarrierBatch barriers;
+    SmolImpl_VkTrackAccess(ctx, barriers, buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, false);
+    SmolImpl_VkCmdBarriers(ctx, barriers);
+    VkBufferCopy region = { srcOffset, 0, size };
+    vkCmdCopyBuffer(ctx->cmdBuffer, buffer->buffer, ctx->readbackStaging.buffer, 1, &region);
+    ctx->stagingBytes += size;
+    SmolImpl_VkWaitForSerial(ctx->recordingSerial);
+    if (!ctx->readbackStaging.coherent)
+        SmolImpl_VkFlushMappedRange(ctx->readbackStaging.alloc, 0, size, false);
+    return ctx->readbackStaging.mapped;
+}
+
+void SmolBufferSetData(SmolBuffer* buffer, const void* src, size_t size, size_t dstOffset)
+{
+    SMOL_ASSERT(buffer);
+    SMOL_ASSERT(dstOffset + size <= buffer->size);
+
+    if (!buffer->hostVisible)
+    {
+        // device local buffer: put data into upload ring, and copy from there on the GPU
+        SmolContext* ctx = SmolImpl_VkCtx();
+        size_t srcOffset = SmolImpl_VkAllocUpload(ctx, size);
+        if (srcOffset == ~(size_t)0)
+        {
+            SMOL_ASSERT(!"failed to allocate Vulkan upload staging memory");
+            return;
+        }
+        SmolImpl_Memcpy(ctx->uploadRing.mapped + srcOffset, src, size);
+        SmolImpl_VkCmdCopyFromUploadRing(ctx, buffer, srcOffset, dstOffset, size);
+        return;
+    }
+
+    // don't overwrite data that submitted or recorded GPU work still has to read
+    if (!SmolImpl_VkWaitForSerial(buffer->gpuUseSerial))
+    {
+        SMOL_ASSERT(!"buffer is used by work of another context that is not flushed yet");
+        return;
+    }
+    SmolImpl_Memcpy(buffer->mapped + dstOffset, src, size);
+    if (!buffer->coherent)
+        SmolImpl_VkFlushMappedRange(buffer->alloc, dstOffset, size, true);
+}
+
+void SmolBufferGetData(SmolBuffer* buffer, void* dst, size_t size, size_t srcOffset)
+{
+    SMOL_ASSERT(buffer);
+    SMOL_ASSERT(srcOffset + size <= buffer->size);
+
+    if (!buffer->hostVisible)
+    {
+        // device local buffer: copy into readback staging memory on the GPU, wait and read from there
+        const uint8_t* src = SmolImpl_VkReadbackToStaging(SmolImpl_VkCtx(), buffer, srcOffset, size);
+        if (src == nullptr)
+        {
+            SMOL_ASSERT(!"failed to allocate Vulkan readback staging memory");
+            return;
+        }
+        SmolImpl_Memcpy(dst, src, size);
+        return;
+    }
+
+    if (!SmolImpl_VkWaitForSerial(buffer->gpuWriteSerial))
+    {
+        SMOL_ASSERT(!"buffer is written by work of another context that is not flushed yet");
+        return;
+    }
+    if (!buffer->coherent)
+        SmolImpl_VkFlushMappedRange(buffer->alloc, srcOffset, size, false);
+    SmolImpl_Memcpy(dst, buffer->mapped + srcOffset, size);
+}
+
+struct SmolReadback
+{
+    SmolImpl_VkStagingBuffer staging; // from s_VkReadbackPool, returned there once data is read
+    void* dst = nullptr;
+    size_t size = 0;
+    uint64_t serial = 0; // batch that does the copy
+    bool done = false;
+};
+
+// Get a pooled readback staging buffer of at least the given size, or create a new one.
+static bool SmolImpl_VkAllocReadbackStaging(SmolImpl_VkStagingBuffer& sb, size_t size)
+{
+    SmolImpl_VkLock lock(s_VkMutex);
+    size_t best = s_VkReadbackPool.size();
+    for (size_t i = 0; i < s_VkReadbackPool.size(); ++i)
+    {
+        const SmolImpl_VkReadbackStaging& entry = s_VkReadbackPool[i];
+        if (entry.staging.size >= size && SmolImpl_VkSerialRetired(entry.serial) && (best == s_VkReadbackPool.size() || entry.staging.size < s_VkReadbackPool[best].staging.size))
+            best = i;
+    }
+    if (best != s_VkReadbackPool.size())
+    {
+        sb = s_VkReadbackPool[best].staging;
+        s_VkReadbackPool.erase(s_VkReadbackPool.begin() + best);
+        return true;
+    }
+    size_t newSize = kSmolImpl_VkReadbackMinSize;
+    while (newSize < size)
+        newSize *= 2;
+    return SmolImpl_VkCreateStagingBuffer(sb, newSize, SmolBufferUsage::Readback);
+}
+
+// Put readback staging buffer back into the pool; GPU might still be copying into it until the given serial.
+static void SmolImpl_VkReleaseReadbackStaging(SmolImpl_VkStagingBuffer& sb, uint64_t serial)
+{
+    SmolImpl_VkLock lock(s_VkMutex);
+    SmolImpl_VkReadbackStaging entry;
+    entry.staging = sb;
+    entry.serial = serial;
+    s_VkReadbackPool.push_back(entry);
+    sb = SmolImpl_VkStagingBuffer();
+    // trim the pool, oldest first; buffers the GPU still copies into stay
+    for (size_t i = 0; i < s_VkReadbackPool.size() && s_VkReadbackPool.size() > kSmolImpl_VkReadbackPoolMaxBuffers; )
+    {
+        if (SmolImpl_VkSerialRetired(s_VkReadbackPool[i].serial))
+        {
+            SmolImpl_VkDestroyStagingBuffer(s_VkReadbackPool[i].staging);
+            s_VkReadbackPool.erase(s_VkReadbackPool.begin() + i);
+        }
+        else
+            ++i;
+    }
+}
+
+// Copy finished readback data into its destination, and release its staging buffer.
+static void SmolImpl_VkFinishReadback(SmolReadback* readback)
+{
+    if (!readback->staging.coherent)
+        SmolImpl_VkFlushMappedRange(readback->staging.alloc, 0, readback->size, false);
+    SmolImpl_Memcpy(readback->dst, readback->staging.mapped, readback->size);
+    SmolImpl_VkReleaseReadbackStaging(readback->staging, readback->serial);
+    readback->done = true;
+}
+
+SmolReadback* SmolBufferGetDataAsync(SmolBuffer* buffer, void* dst, size_t size, size_t srcOffset)
+{
+    SMOL_ASSERT(buffer);
+    SMOL_ASSERT(size > 0 && srcOffset + size <= buffer->size);
+    SmolContext* ctx = SmolImpl_VkCtx();
+    SMOL_ASSERT(!ctx->secondary); // no buffer readbacks while recording into a part or command list
+
+    SmolReadback* readback = new SmolReadback();
+    if (!SmolImpl_VkAllocReadbackStaging(readback->staging, size))
+    {
+        delete readback;
+        return nullptr;
+    }
+    readback->dst = dst;
+    readback->size = size;
+
+    SmolImpl_VkStartCmdBufferIfNeeded(ctx);
+    SmolImpl_VkBarrierBatch barriers;
+    SmolImpl_VkTrackAccess(ctx, barriers, buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, false);
+    SmolImpl_VkCmdBarriers(ctx, barriers);
+    VkBufferCopy region = { srcOffset, 0, size };
+    vkCmdCopyBuffer(ctx->cmdBuffer, buffer->buffer, readback->staging.buffer, 1, &region);
+    ctx->stagingBytes += size;
+    readback->serial = ctx->recordingSerial;
+    return readback;
+}
+
+bool SmolReadbackIsComplete(SmolReadback* readback)
+{
+    SMOL_ASSERT(readback);
+    if (readback->done)
+        return true;
+    SmolImpl_VkRetireCompletedFrames();
+    {
+        SmolImpl_VkLock lock(s_VkMutex);
+        if (!SmolImpl_VkSerialRetired(readback->serial))
+            return false;
+    }
+    SmolImpl_VkFinishReadback(readback);
+    return true;
+}
+
+bool SmolReadbackWait(SmolReadback* readback, uint64_t timeoutNs)
+{
+    SMOL_ASSERT(readback);
+    if (readback->done)
+        return true;
+    if (!SmolImpl_VkWaitForSerial(readback->serial, timeoutNs))
+        return false;
+    SmolImpl_VkFinishReadback(readback);
+    return true;
+}
+
+void SmolReadbackDelete(SmolReadback* readback)
+{
+    if (readback == nullptr)
+        return;
+    if (!readback->done)
+        SmolImpl_VkReleaseReadbackStaging(readback->staging, readback->serial);
+    delete readback;
+}
+
+// Wait a short while for batch with the given serial to finish, without keeping s_VkMutex locked
+// during the wait (so that other threads can keep recording and submitting work).
+static void SmolImpl_VkCompletionWait(uint64_t serial)
+{
+    uint64_t timelineValue = 0;
+    {
+        SmolImpl_VkLock lock(s_VkMutex);
+        if (SmolImpl_VkSerialRetired(serial))
+            return;
+        for (size_t i = 0; i < s_VkContexts.size(); ++i)
+        {
+            for (int fi = 0; fi < kSmolImpl_VkFramesInFlight; ++fi)
+            {
+                const SmolImpl_VkFrame& frame = s_VkContexts[i]->frames[fi];
+                if (frame.inFlight && frame.serial <= serial)
+                    timelineValue = std::max(timelineValue, frame.timelineValue);
+            }
+        }
+    }
+    if (timelineValue != 0)
+    {
+        // timeline semaphore stays alive until SmolComputeDelete, which stops the completion thread first
+        VkSemaphoreWaitInfoKHR waitInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR };
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &s_VkTimeline;
+        waitInfo.pValues = &timelineValue;
+        vkWaitSemaphoresKHR(s_VkDevice, &waitInfo, 10000000);
+    }
+    else
+    {
+        // batch fences can be reset or destroyed by other threads once retired; poll them instead
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+}
+
+static void SmolImpl_VkCompletionThreadFunc()
+{
+    std::vector<SmolImpl_VkCompletion> ready;
+    for (;;)
+    {
+        uint64_t serial = ~0ULL;
+        bool quit;
+        {
+            std::unique_lock<std::mutex> lock(s_VkCompletionMutex);
+            s_VkCompletionCond.wait(lock, [] { return s_VkCompletionQuit || !s_VkCompletions.empty(); });
+            quit = s_VkCompletionQuit;
+            for (size_t i = 0; i < s_VkCompletions.size(); ++i)
+                serial = std::min(serial, s_VkCompletions[i].serial);
+        }
+        if (!quit)
+            SmolImpl_VkCompletionWait(serial);
+        SmolImpl_VkRetireCompletedFrames();
+
+        ready.clear();
+        {
+            SmolImpl_VkLock vkLock(s_VkMutex);
+            std::lock_guard<std::mutex> lock(s_VkCompletionMutex);
+            size_t dst = 0;
+            for (size_t i = 0; i < s_VkCompletions.size(); ++i)
+            {
+                if (SmolImpl_VkSerialRetired(s_VkCompletions[i].serial))
+                    ready.push_back(s_VkCompletions[i]);
+                else
+                    s_VkCompletions[dst++] = s_VkCompletions[i];
+            }
+            s_VkCompletions.resize(dst);
+        }
+        for (size_t i = 0; i < ready.size(); ++i)
+        {
+            if (ready[i].readback != nullptr)
+                SmolImpl_VkFinishReadback(ready[i].readback);
+            ready[i].callback(ready[i].userData);
+        }
+        if (quit)
+            return;
+    }
+}
+
+static void SmolImpl_VkAddCompletion(uint64_t serial, SmolReadback* readback, SmolCompletionCallback callback, void* userData)
+{
+    SMOL_ASSERT(callback);
+    {
+        std::lock_guard<std::mutex> lock(s_VkCompletionMutex);
+        if (!s_VkCompletionThread.joinable())
+            s_VkCompletionThread = std::thread(SmolImpl_VkCompletionThreadFunc);
+        s_VkCompletions.push_back({ serial, readback, callback, userData });
+    }
+    s_VkCompletionCond.notify_one();
+}
+
+void SmolFenceOnComplete(SmolFence fence, SmolCompletionCallback callback, void* userData)
+{
+    if (fence.value <= s_VkCompletedSerial)
+        callback(userData);
+    else
+        SmolImpl_VkAddCompletion(fence.value, nullptr, callback, userData);
+}
+
+void SmolReadbackOnComplete(SmolReadback* readback, SmolCompletionCallback callback, void* userData)
+{
+    SMOL_ASSERT(readback);
+    if (readback->done)
+        callback(userData);
+    else
+        SmolImpl_VkAddCompletion(readback->serial, readback, callback, userData);
+}
+
+void* SmolBufferMap(SmolBuffer* buffer, SmolBufferMapAccess access, size_t offset, size_t size)
+{
+    SMOL_ASSERT(buffer);
+    SMOL_ASSERT(buffer->mapPtr == nullptr);
+    if (size == 0)
+        size = buffer->size - offset;
+    SMOL_ASSERT(offset + size <= buffer->size);
+
+    uint8_t* ptr = nullptr;
+    if (buffer->hostVisible)
+    {
+        if (!SmolImpl_VkWaitForSerial(HasFlag(access, SmolBufferMapAccess::Write) ? buffer->gpuUseSerial : buffer->gpuWriteSerial))
+        {
+            SMOL_ASSERT(!"buffer is used by work of another context that is not flushed yet");
+            return nullptr;
+        }
+        if (HasFlag(access, SmolBufferMapAccess::Read) && !buffer->coherent)
+            SmolImpl_VkFlushMappedRange(buffer->alloc, offset, size, false);
+        ptr = buffer->mapped + offset;
+    }
+    else
+    {
+        // device local buffer: map goes through a staging buffer of its own (so that later uploads
+        // and readbacks can't overwrite it), which is copied from on read, and into the buffer on unmap
+        if (!SmolImpl_VkAllocReadbackStaging(buffer->mapStaging, size))
+            return nullptr;
+        if (HasFlag(access, SmolBufferMapAccess::Read))
+        {
+            SmolContext* ctx = SmolImpl_VkCtx();
+            SMOL_ASSERT(!ctx->secondary); // no buffer readbacks while recording into a part or command list
+            SmolImpl_VkStartCmdBufferIfNeeded(ctx);
+            SmolImpl_VkBarrierBatch barriers;
+            SmolImpl_VkTrackAccess(ctx, barriers, buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, false);
+            SmolImpl_VkCmdBarriers(ctx, barriers);
+            VkBufferCopy region = { offset, 0, size };
+            vkCmdCopyBuffer(ctx->cmdBuffer, buffer->buffer, buffer->mapStaging.buffer, 1, &region);
+            ctx->stagingBytes += size;
+            if (!SmolImpl_VkWaitForSerial(ctx->recordingSerial))
+            {
+                SmolImpl_VkReleaseReadbackStaging(buffer->mapStaging, ctx->recordingSerial);
+                return nullptr;
+            }
+            if (!buffer->mapStaging.coherent)
+                SmolImpl_VkFlushMappedRange(buffer->mapStaging.alloc, 0, size, false);
+        }
+        ptr = buffer->mapStaging.mapped;
+    }
+    buffer->mapPtr = ptr;
+    buffer->mapOffset = offset;
+    buffer->mapSize = size;
+    buffer->mapAccess = access;
+    return ptr;
+}
+
+void SmolBufferUnmap(SmolBuffer* buffer)
+{
+    SMOL_ASSERT(buffer);
+    SMOL_ASSERT(buffer->mapPtr != nullptr);
+    if (HasFlag(buffer->mapAccess, SmolBufferMapAccess::Write))
+    {
+        if (buffer->hostVisible)
+        {
+            if (!buffer->coherent)
+                SmolImpl_VkFlushMappedRange(buffer->alloc, buffer->mapOffset, buffer->mapSize, true);
+        }
+        else
+        {
+            // device local buffer: copy from map staging buffer in the current context, which does
+            // not have to be the one that mapped it
+            SmolContext* ctx = SmolImpl_VkCtx();
+            SMOL_ASSERT(!ctx->secondary); // no buffer uploads while recording into a part or command list
+            if (!buffer->mapStaging.coherent)
+                SmolImpl_VkFlushMappedRange(buffer->mapStaging.alloc, 0, buffer->mapSize, true);
+            SmolImpl_VkStartCmdBufferIfNeeded(ctx);
+            SmolImpl_VkBarrierBatch barriers;
+            SmolImpl_VkTrackAccess(ctx, barriers, buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, true);
+            SmolImpl_VkCmdBarriers(ctx, barriers);
+            VkBufferCopy region = { 0, buffer->mapOffset, buffer->mapSize };
+            vkCmdCopyBuffer(ctx->cmdBuffer, buffer->mapStaging.buffer, buffer->buffer, 1, &region);
+            ctx->stagingBytes += buffer->mapSize;
+            SmolImpl_VkReleaseReadbackStaging(buffer->mapStaging, ctx->recordingSerial);
+        }
+    }
+    if (buffer->mapStaging.buffer != nullptr)
+        SmolImpl_VkReleaseReadbackStaging(buffer->mapStaging, 0); // read only map: staging is not used by the GPU anymore
+    buffer->mapPtr = nullptr;
+}
+
+void SmolBufferDelete(SmolBuffer* buffer)
+{
+    if (buffer == nullptr)
+        return;
+    SmolImpl_VkLock lock(s_VkMutex);
+    // other contexts drop their state of the buffer on their own threads, since they access it without locking
+    SmolImpl_VkEvictDescriptorSets(nullptr, buffer->buffer, buffer);
+    SmolImpl_VkCtx()->bufferStates.erase(buffer);
+    if (buffer->alloc.block != nullptr)
+        buffer->alloc.block->owners[buffer->alloc.slot] = nullptr;
+    SmolImpl_VkPendingDelete del;
+    del.serial = buffer->gpuUseSerial;
+    del.buffer = buffer->buffer;
+    del.alloc = buffer->alloc;
+    SmolImpl_VkDeleteWhenUnused(del);
+    delete buffer;
+}
+
+SmolSubmitStats SmolComputeGetSubmitStats()
+{
+    SmolImpl_VkLock lock(s_VkMutex);
+    SmolSubmitStats stats;
+    stats.submitCount = s_VkSubmitCount;
+    stats.queueDepth = s_VkSubmitQueueDepth;
+    stats.maxQueueDepth = s_VkSubmitMaxQueueDepth;
+    return stats;
+}
+
+void SmolComputeSetBackpressureLimits(const SmolBackpressureLimits& limits)
+{
+    SmolImpl_VkLock lock(s_VkMutex);
+    s_VkBackpressure = limits;
+}
+
+SmolMemoryStats SmolComputeGetMemoryStats()
+{
+    SmolImpl_VkLock lock(s_VkMutex);
+    SmolMemoryStats stats;
+    for (size_t i = 0; i < s_VkMemoryBlocks.size(); ++i)
+    {
+        const SmolImpl_VkMemoryBlock* block = s_VkMemoryBlocks[i];
+        ++stats.blockCount;
+        stats.blockBytes += (size_t)block->size;
+        stats.blockUsedBytes += (size_t)(block->usedCount * block->slotSize);
+        for (size_t j = 0; j < block->owners.size(); ++j)
+        {
+            if (block->owners[j] == nullptr)
+                continue;
+            ++stats.bufferCount;
+            stats.bufferBytes += block->owners[j]->size;
+        }
+    }
+    stats.dedicatedCount = s_VkDedicatedCount;
+    stats.dedicatedBytes = s_VkDedicatedBytes;
+    // free space in blocks that can't be returned to the system since the blocks are partially used
+    size_t freeBytes = stats.blockBytes - stats.blockUsedBytes;
+    stats.fragmentation = stats.blockBytes > 0 ? (float)freeBytes / (float)stats.blockBytes : 0.0f;
+    return stats;
+}
+
+// Move buffer into a free slot of another memory block, by copying its data on the GPU in the given context.
+static bool SmolImpl_VkMoveBuffer(SmolContext* ctx, SmolBuffer* buffer, SmolImpl_VkMemoryBlock* dst)
+{
+    const VkBufferCreateInfo bufferCreateInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO, 0, 0, buffer->size, buffer->usageFlags, VK_SHARING_MODE_EXCLUSIVE, 1, &s_VkComputeQueueIndex };
+    VkBuffer newBuffer = 0;
+    if (vkCreateBuffer(s_VkDevice, &bufferCreateInfo, 0, &newBuffer) != VK_SUCCESS)
+        return false;
+    // the new buffer has to fit into any slot of the destination block
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(s_VkDevice, newBuffer, &requirements);
+    if (!(requirements.memoryTypeBits & (1u << dst->memType)) || requirements.size > dst->slotSize || dst->slotSize % requirements.alignment != 0)
+    {
+        vkDestroyBuffer(s_VkDevice, newBuffer, 0);
+        return false;
+    }
+    SmolImpl_VkAllocation alloc;
+    SmolImpl_VkAllocSlot(dst, alloc);
+    if (vkBindBufferMemory(s_VkDevice, newBuffer, alloc.memory, alloc.offset) != VK_SUCCESS)
+    {
+        SmolImpl_VkFreeMemory(alloc);
+        vkDestroyBuffer(s_VkDevice, newBuffer, 0);
+        return false;
+    }
+
+    SmolImpl_VkStartCmdBufferIfNeeded(ctx);
+    SmolImpl_VkBarrierBatch barriers;
+    SmolImpl_VkTrackAccess(ctx, barriers, buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, false);
+    SmolImpl_VkCmdBarriers(ctx, barriers);
+    VkBufferCopy region = { 0, 0, buffer->size };
+    vkCmdCopyBuffer(ctx->cmdBuffer, buffer->buffer, newBuffer, 1, &region);
+
+    // old buffer and its memory go away once the copy is done
+    SmolImpl_VkEvictDescriptorSets(nullptr, buffer->buffer);
+    buffer->alloc.block->owners[buffer->alloc.slot] = nullptr;
+    SmolImpl_VkPendingDelete del;
+    del.serial = buffer->gpuUseSerial; // batches of other contexts might still use it too
+    del.buffer = buffer->buffer;
+    del.alloc = buffer->alloc;
+    SmolImpl_VkDeleteWhenUnused(del);
+
+    buffer->buffer = newBuffer;
+    buffer->alloc = alloc;
+    buffer->mapped = alloc.mapped;
+    dst->owners[alloc.slot] = buffer;
+    // new buffer was just written by the copy
+    SmolImpl_VkBufferState& st = ctx->bufferStates[buffer];
+    st = SmolImpl_VkBufferState();
+    st.writeStages = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    st.writeAccess = VK_ACCESS_TRANSFER_WRITE_BIT;
+    buffer->gpuUseSerial = ctx->recordingSerial;
+    buffer->gpuWriteSerial = ctx->recordingSerial;
+    return true;
+}
+
+void SmolComputeDefragment()
+{
+    // moved buffers are copied in the current context; other contexts must not be recording work using them
+    SmolImpl_VkLock lock(s_VkMutex);
+    SmolContext* ctx = SmolImpl_VkCtx();
+    // free up slots of already deleted buffers first
+    SmolImpl_VkRetireCompletedFrames();
+
+    // for blocks of each memory type & size class, move buffers out of the least used blocks
+    // into free slots of the most used ones
+    std::vector<SmolImpl_VkMemoryBlock*> blocks;
+    for (size_t i = 0; i < s_VkMemoryBlocks.size(); ++i)
+    {
+        const SmolImpl_VkMemoryBlock* first = s_VkMemoryBlocks[i];
+        bool seen = false;
+        for (size_t j = 0; j < i && !seen; ++j)
+            seen = s_VkMemoryBlocks[j]->memType == first->memType && s_VkMemoryBlocks[j]->sizeClass == first->sizeClass;
+        if (seen)
+            continue;
+        blocks.clear();
+        for (size_t j = i; j < s_VkMemoryBlocks.size(); ++j)
+            if (s_VkMemoryBlocks[j]->memType == first->memType && s_VkMemoryBlocks[j]->sizeClass == first->sizeClass)
+                blocks.push_back(s_VkMemoryBlocks[j]);
+        if (blocks.size() < 2)
+            continue;
+        std::sort(blocks.begin(), blocks.end(), [](const SmolImpl_VkMemoryBlock* a, const SmolImpl_VkMemoryBlock* b) { return a->usedCount > b->usedCount; });
+
+        size_t dstIdx = 0;
+        for (size_t srcIdx = blocks.size() - 1; srcIdx > dstIdx; --srcIdx)
+        {
+            SmolImpl_VkMemoryBlock* src = blocks[srcIdx];
+            for (size_t slot = 0; slot < src->owners.size(); ++slot)
+            {
+                SmolBuffer* buffer = src->owners[slot];
+                if (buffer == nullptr || buffer->mapPtr != nullptr || buffer->commandListRefs > 0)
+                    continue;
+                while (dstIdx < srcIdx && blocks[dstIdx]->freeSlots.empty())
+                    ++dstIdx;
+                if (dstIdx >= srcIdx)
+                    break;
+                SmolImpl_VkMoveBuffer(ctx, buffer, blocks[dstIdx]);
+            }
+        }
     }
-    memcpy(dst, src, size);
-    vkUnmapMemory(s_VkDevice, buffer->memory);
-}
-
-void SmolBufferDelete(SmolBuffer* buffer)
-{
-    if (buffer == nullptr)
-        return;
-    if (buffer->buffer != 0)
-        vkDestroyBuffer(s_VkDevice, buffer->buffer, 0);
-    if (buffer->memory != 0)
-        vkFreeMemory(s_VkDevice, buffer->memory, 0);
-    delete buffer;
 }
 
-static const int SmolImpl_VkMaxResources = 32;
-
 struct SmolKernel
 {
     VkShaderModule kernel = nullptr;
@@ -1609,34 +5763,166 @@ struct SmolKernel
     int localSize[3] = { 0, 0, 0 };
     VkDescriptorType resourceTypes[SmolImpl_VkMaxResources] = {};
     uint32_t resourceMask = 0;
+    uint32_t readOnlyMask = 0; // resources that the kernel never writes to (uniform, or NonWritable storage buffers)
     uint32_t resourceCount = 0;
+    uint32_t pushConstantSize = 0; // size of push constants block, if kernel has one
+    std::atomic<uint64_t> gpuUseSerial { 0 }; // last batch that dispatched the kernel
+    int refCount = 1; // identical kernel variants are shared, see s_VkKernelCache
+    SmolImpl_VkKernelKey key;
 };
 
 static const uint32_t SmolImpl_SpvMagicNumber = 0x07230203;
 static const uint32_t SmolImpl_SpvExecutionModelGLCompute = 5;
 static const uint32_t SmolImpl_SpvExecutionModeLocalSize = 17;
+static const uint32_t SmolImpl_SpvExecutionModeLocalSizeId = 38;
+static const uint32_t SmolImpl_SpvDecorationSpecId = 1;
 static const uint32_t SmolImpl_SpvDecorationBlock = 2;
 static const uint32_t SmolImpl_SpvDecorationBufferBlock = 3;
+static const uint32_t SmolImpl_SpvDecorationArrayStride = 6;
+static const uint32_t SmolImpl_SpvDecorationMatrixStride = 7;
+static const uint32_t SmolImpl_SpvDecorationBuiltIn = 11;
+static const uint32_t SmolImpl_SpvDecorationNonWritable = 24;
+static const uint32_t SmolImpl_SpvDecorationOffset = 35;
 static const uint32_t SmolImpl_SpvDecorationBinding = 33;
 static const uint32_t SmolImpl_SpvDecorationDescriptorSet = 34;
 static const uint32_t SmolImpl_SpvStorageClassUniformConstant = 0;
 static const uint32_t SmolImpl_SpvStorageClassUniform = 2;
+static const uint32_t SmolImpl_SpvStorageClassPushConstant = 9;
 static const uint32_t SmolImpl_SpvStorageClassStorageBuffer = 12;
+static const uint32_t SmolImpl_SpvBuiltInWorkgroupSize = 25;
 
 enum SmolImpl_SpvOp
 {
     kSmolImpl_SpvOpEntryPoint = 15,
     kSmolImpl_SpvOpExecutionMode = 16,
+    kSmolImpl_SpvOpTypeInt = 21,
+    kSmolImpl_SpvOpTypeFloat = 22,
+    kSmolImpl_SpvOpTypeVector = 23,
+    kSmolImpl_SpvOpTypeMatrix = 24,
     kSmolImpl_SpvOpTypeImage = 25,
     kSmolImpl_SpvOpTypeSampler = 26,
     kSmolImpl_SpvOpTypeSampledImage = 27,
+    kSmolImpl_SpvOpTypeArray = 28,
     kSmolImpl_SpvOpTypeStruct = 30,
     kSmolImpl_SpvOpTypePointer = 32,
+    kSmolImpl_SpvOpConstant = 43,
+    kSmolImpl_SpvOpConstantComposite = 44,
+    kSmolImpl_SpvOpSpecConstant = 50,
+    kSmolImpl_SpvOpSpecConstantComposite = 51,
     kSmolImpl_SpvOpVariable = 59,
     kSmolImpl_SpvOpDecorate = 71,
+    kSmolImpl_SpvOpMemberDecorate = 72,
+    kSmolImpl_SpvOpExecutionModeId = 331,
+};
+
+// Information about SPIR-V Ids that we're interested in
+struct SmolImpl_SpvId
+{
+    uint32_t op = 0;
+    uint32_t typeId = 0;
+    uint32_t storageClass = 0;
+    uint32_t binding = 0;
+    uint32_t set = 0;
+    uint32_t memberCount = 0;
+    uint32_t nonWritableMemberCount = 0;
+    uint32_t arrayStride = 0;
+    uint32_t specId = 0;
+    const uint32_t* instr = nullptr; // defining instruction, for types and constants
+    bool bufferBlock = false;
+    bool nonWritable = false;
+    bool hasSpecId = false;
+    bool workgroupSize = false; // decorated as WorkgroupSize built-in
 };
 
-static bool SmolImpl_VkParseShaderResources(const uint32_t* code, uint32_t codeSizeInWords, SmolKernel& kernel)
+// Value of an integer constant or specialization constant.
+static bool SmolImpl_SpvConstantValue(const SmolImpl_SpvId* ids, uint32_t boundIdCount, uint32_t id, const std::vector<SmolImpl_VkSpecValue>& specs, uint32_t& value)
+{
+    if (id >= boundIdCount || ids[id].instr == nullptr)
+        return false;
+    const SmolImpl_SpvId& c = ids[id];
+    if (c.op != kSmolImpl_SpvOpConstant && c.op != kSmolImpl_SpvOpSpecConstant)
+        return false;
+    value = c.instr[3];
+    if (c.op == kSmolImpl_SpvOpSpecConstant && c.hasSpecId)
+    {
+        for (size_t i = 0; i < specs.size(); ++i)
+            if (specs[i].id == c.specId)
+                value = specs[i].value;
+    }
+    return true;
+}
+
+static uint32_t SmolImpl_SpvStructSize(const uint32_t* code, uint32_t codeSizeInWords, const SmolImpl_SpvId* ids, uint32_t boundIdCount, uint32_t structId, int depth);
+
+// Size in bytes of a type as laid out in a buffer/push constant block (0 if unknown).
+static uint32_t SmolImpl_SpvTypeSize(const uint32_t* code, uint32_t codeSizeInWords, const SmolImpl_SpvId* ids, uint32_t boundIdCount, uint32_t typeId, uint32_t matrixStride, int depth)
+{
+    if (typeId >= boundIdCount || depth > 16)
+        return 0;
+    const SmolImpl_SpvId& id = ids[typeId];
+    if (id.instr == nullptr)
+        return 0;
+    switch (id.op)
+    {
+    case kSmolImpl_SpvOpTypeInt:
+    case kSmolImpl_SpvOpTypeFloat:
+        return id.instr[2] / 8;
+    case kSmolImpl_SpvOpTypeVector:
+        return id.instr[3] * SmolImpl_SpvTypeSize(code, codeSizeInWords, ids, boundIdCount, id.instr[2], 0, depth + 1);
+    case kSmolImpl_SpvOpTypeMatrix:
+        return id.instr[3] * (matrixStride != 0 ? matrixStride : SmolImpl_SpvTypeSize(code, codeSizeInWords, ids, boundIdCount, id.instr[2], 0, depth + 1));
+    case kSmolImpl_SpvOpTypeArray:
+    {
+        uint32_t lengthId = id.instr[3];
+        if (lengthId >= boundIdCount || ids[lengthId].op != kSmolImpl_SpvOpConstant)
+            return 0;
+        uint32_t length = ids[lengthId].instr[3];
+        uint32_t stride = id.arrayStride != 0 ? id.arrayStride : SmolImpl_SpvTypeSize(code, codeSizeInWords, ids, boundIdCount, id.instr[2], matrixStride, depth + 1);
+        return length * stride;
+    }
+    case kSmolImpl_SpvOpTypeStruct:
+        return SmolImpl_SpvStructSize(code, codeSizeInWords, ids, boundIdCount, typeId, depth + 1);
+    }
+    return 0;
+}
+
+// Struct size is end of its last member, based on member Offset decorations.
+static uint32_t SmolImpl_SpvStructSize(const uint32_t* code, uint32_t codeSizeInWords, const SmolImpl_SpvId* ids, uint32_t boundIdCount, uint32_t structId, int depth)
+{
+    const SmolImpl_SpvId& id = ids[structId];
+    const uint32_t memberCount = id.memberCount;
+    if (memberCount == 0)
+        return 0;
+    const auto offsets = std::unique_ptr<uint32_t[]>(new uint32_t[memberCount * 2]);
+    uint32_t* matrixStrides = offsets.get() + memberCount;
+    memset(offsets.get(), 0, memberCount * 2 * sizeof(uint32_t));
+    const uint32_t* instr = code + 5;
+    while (instr < code + codeSizeInWords)
+    {
+        uint16_t op = uint16_t(instr[0]);
+        uint16_t instrLen = uint16_t(instr[0] >> 16);
+        if (instrLen == 0)
+            break;
+        if (op == kSmolImpl_SpvOpMemberDecorate && instrLen == 5 && instr[1] == structId && instr[2] < memberCount)
+        {
+            if (instr[3] == SmolImpl_SpvDecorationOffset)
+                offsets[instr[2]] = instr[4];
+            if (instr[3] == SmolImpl_SpvDecorationMatrixStride)
+                matrixStrides[instr[2]] = instr[4];
+        }
+        instr += instrLen;
+    }
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < memberCount; ++i)
+    {
+        uint32_t end = offsets[i] + SmolImpl_SpvTypeSize(code, codeSizeInWords, ids, boundIdCount, id.instr[2 + i], matrixStrides[i], depth + 1);
+        if (end > size)
+            size = end;
+    }
+    return size;
+}
+
+static bool SmolImpl_VkParseShaderResources(const uint32_t* code, uint32_t codeSizeInWords, const std::vector<SmolImpl_VkSpecValue>& specs, SmolKernel& kernel)
 {
     if (codeSizeInWords < 5) // SPIR-V header is 5 words
         return false;
@@ -1644,17 +5930,11 @@ static bool SmolImpl_VkParseShaderResources(const uint32_t* code, uint32_t codeS
         return false;
 
     // Parse code and figure out information about Ids
-    struct Id
-    {
-        uint32_t op = 0;
-        uint32_t typeId = 0;
-        uint32_t storageClass = 0;
-        uint32_t binding = 0;
-        uint32_t set = 0;
-        bool bufferBlock = false;
-    };
+    typedef SmolImpl_SpvId Id;
     const uint32_t boundIdCount = code[3];
     const auto ids = std::unique_ptr<Id[]>(new Id[boundIdCount]);
+    uint32_t localSizeIds[3] = {};
+    bool hasLocalSizeIds = false;
 
     const uint32_t* instr = code + 5;
     while (instr < code + codeSizeInWords)
@@ -1683,6 +5963,19 @@ static bool SmolImpl_VkParseShaderResources(const uint32_t* code, uint32_t codeS
             }
         }
             break;
+        case kSmolImpl_SpvOpExecutionModeId:
+        {
+            if (instrLen < 3) return false;
+            if (instr[2] == SmolImpl_SpvExecutionModeLocalSizeId)
+            {
+                if (instrLen != 6) return false;
+                localSizeIds[0] = instr[3];
+                localSizeIds[1] = instr[4];
+                localSizeIds[2] = instr[5];
+                hasLocalSizeIds = true;
+            }
+        }
+            break;
         case kSmolImpl_SpvOpDecorate:
         {
             if (instrLen < 3) return false;
@@ -1707,6 +6000,36 @@ static bool SmolImpl_VkParseShaderResources(const uint32_t* code, uint32_t codeS
             {
                 ids[id].bufferBlock = true;
             }
+            if (instr[2] == SmolImpl_SpvDecorationNonWritable)
+            {
+                ids[id].nonWritable = true;
+            }
+            if (instr[2] == SmolImpl_SpvDecorationArrayStride)
+            {
+                if (instrLen != 4) return false;
+                ids[id].arrayStride = instr[3];
+            }
+            if (instr[2] == SmolImpl_SpvDecorationSpecId)
+            {
+                if (instrLen != 4) return false;
+                ids[id].specId = instr[3];
+                ids[id].hasSpecId = true;
+            }
+            if (instr[2] == SmolImpl_SpvDecorationBuiltIn)
+            {
+                if (instrLen != 4) return false;
+                ids[id].workgroupSize = instr[3] == SmolImpl_SpvBuiltInWorkgroupSize;
+            }
+        }
+            break;
+        case kSmolImpl_SpvOpMemberDecorate:
+        {
+            if (instrLen < 4) return false;
+            uint32_t id = instr[1];
+            if (id >= boundIdCount)
+                return false;
+            if (instr[3] == SmolImpl_SpvDecorationNonWritable)
+                ++ids[id].nonWritableMemberCount;
         }
             break;
         case kSmolImpl_SpvOpTypeStruct:
@@ -1719,6 +6042,37 @@ static bool SmolImpl_VkParseShaderResources(const uint32_t* code, uint32_t codeS
             if (id >= boundIdCount) return false;
             if (ids[id].op != 0) return false;
             ids[id].op = op;
+            ids[id].instr = instr;
+            if (op == kSmolImpl_SpvOpTypeStruct)
+                ids[id].memberCount = instrLen - 2;
+        }
+            break;
+        case kSmolImpl_SpvOpTypeInt:
+        case kSmolImpl_SpvOpTypeFloat:
+        case kSmolImpl_SpvOpTypeVector:
+        case kSmolImpl_SpvOpTypeMatrix:
+        case kSmolImpl_SpvOpTypeArray:
+        {
+            if (instrLen < 3) return false;
+            if ((op == kSmolImpl_SpvOpTypeVector || op == kSmolImpl_SpvOpTypeMatrix || op == kSmolImpl_SpvOpTypeArray) && instrLen < 4) return false;
+            uint32_t id = instr[1];
+            if (id >= boundIdCount) return false;
+            if (ids[id].op != 0) return false;
+            ids[id].op = op;
+            ids[id].instr = instr;
+        }
+            break;
+        case kSmolImpl_SpvOpConstant:
+        case kSmolImpl_SpvOpSpecConstant:
+        case kSmolImpl_SpvOpConstantComposite:
+        case kSmolImpl_SpvOpSpecConstantComposite:
+        {
+            if (instrLen < 4) return false;
+            uint32_t id = instr[2];
+            if (id >= boundIdCount) return false;
+            if (ids[id].op != 0) return false;
+            ids[id].op = op;
+            ids[id].instr = instr;
         }
             break;
         case kSmolImpl_SpvOpTypePointer:
@@ -1747,10 +6101,47 @@ static bool SmolImpl_VkParseShaderResources(const uint32_t* code, uint32_t codeS
         instr += instrLen;
     }
 
-    // Now find which ones we're interested in (basically "buffers") and record that info into kernel
+    // Work group size can come from (specialization) constants: either LocalSizeId execution mode,
+    // or a WorkgroupSize built-in, which takes precedence over any execution mode.
+    if (hasLocalSizeIds)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            uint32_t value;
+            if (!SmolImpl_SpvConstantValue(ids.get(), boundIdCount, localSizeIds[i], specs, value))
+                return false;
+            kernel.localSize[i] = value;
+        }
+    }
+    for (uint32_t i = 0; i < boundIdCount; ++i)
+    {
+        const Id& id = ids[i];
+        if (!id.workgroupSize || (id.op != kSmolImpl_SpvOpConstantComposite && id.op != kSmolImpl_SpvOpSpecConstantComposite))
+            continue;
+        if (uint16_t(id.instr[0] >> 16) != 6) return false;
+        for (int j = 0; j < 3; ++j)
+        {
+            uint32_t value;
+            if (!SmolImpl_SpvConstantValue(ids.get(), boundIdCount, id.instr[3 + j], specs, value))
+                return false;
+            kernel.localSize[j] = value;
+        }
+    }
+
+    // Now find which ones we're interested in (basically "buffers" and push constants) and record that info into kernel
     for (uint32_t i = 0; i < boundIdCount; ++i)
     {
         Id& id = ids[i];
+        if (id.op == kSmolImpl_SpvOpVariable && id.storageClass == SmolImpl_SpvStorageClassPushConstant)
+        {
+            if (id.typeId >= boundIdCount || ids[id.typeId].op != kSmolImpl_SpvOpTypePointer)
+                return false;
+            uint32_t structId = ids[id.typeId].typeId;
+            if (structId >= boundIdCount || ids[structId].op != kSmolImpl_SpvOpTypeStruct)
+                return false;
+            kernel.pushConstantSize = SmolImpl_SpvStructSize(code, codeSizeInWords, ids.get(), boundIdCount, structId, 0);
+            continue;
+        }
         if (id.op == kSmolImpl_SpvOpVariable && (id.storageClass == SmolImpl_SpvStorageClassUniform || id.storageClass == SmolImpl_SpvStorageClassUniformConstant || id.storageClass == SmolImpl_SpvStorageClassStorageBuffer))
         {
             if (id.set != 0)
@@ -1768,9 +6159,15 @@ static bool SmolImpl_VkParseShaderResources(const uint32_t* code, uint32_t codeS
             switch (typeKind)
             {
             case kSmolImpl_SpvOpTypeStruct:
-                kernel.resourceTypes[id.binding] = ptrTypeId.bufferBlock ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            {
+                bool storage = ptrTypeId.bufferBlock || id.storageClass == SmolImpl_SpvStorageClassStorageBuffer;
+                kernel.resourceTypes[id.binding] = storage ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
                 kernel.resourceMask |= 1 << id.binding;
+                // read-only if it's a uniform buffer, or the variable or all struct members are NonWritable
+                if (!storage || id.nonWritable || (ptrTypeId.memberCount > 0 && ptrTypeId.nonWritableMemberCount >= ptrTypeId.memberCount))
+                    kernel.readOnlyMask |= 1 << id.binding;
                 ++kernel.resourceCount;
+            }
                 break;
             default:
                 SMOL_ASSERT(!"Unsupported Vulkan resource type");
@@ -1783,6 +6180,43 @@ static bool SmolImpl_VkParseShaderResources(const uint32_t* code, uint32_t codeS
 
 SmolKernel* SmolKernelCreate(const void* shaderCode, size_t shaderCodeSize, const char* entryPoint, SmolKernelCreateFlags flags)
 {
+    return SmolKernelCreate(shaderCode, shaderCodeSize, entryPoint, nullptr, 0, flags);
+}
+
+SmolKernel* SmolKernelCreate(const void* shaderCode, size_t shaderCodeSize, const char* entryPoint, const SmolKernelSpecialization* specializations, int specializationCount, SmolKernelCreateFlags flags)
+{
+    SmolImpl_VkLock lock(s_VkMutex);
+    // look for an already created identical kernel variant
+    SmolImpl_VkKernelKey key;
+    const uint32_t* codeWords = (const uint32_t*)shaderCode;
+    uint64_t codeHash = 14695981039346656037ULL;
+    for (size_t i = 0; i < shaderCodeSize / 4; ++i)
+        codeHash = (codeHash ^ codeWords[i]) * 1099511628211ULL;
+    key.codeHash = codeHash;
+    key.codeSize = shaderCodeSize;
+    key.code.assign(codeWords, codeWords + shaderCodeSize / 4);
+    key.entryPoint = entryPoint;
+    key.specs.resize(specializationCount);
+    for (int i = 0; i < specializationCount; ++i)
+    {
+        const SmolKernelSpecialization& spec = specializations[i];
+        SmolImpl_VkSpecValue& v = key.specs[i];
+        v.id = (uint32_t)spec.constantId;
+        if (spec.type == SmolKernelSpecialization::Type::Float)
+            memcpy(&v.value, &spec.floatValue, sizeof(v.value));
+        else if (spec.type == SmolKernelSpecialization::Type::Bool)
+            v.value = spec.boolValue ? 1 : 0;
+        else
+            v.value = (uint32_t)spec.intValue;
+    }
+    std::sort(key.specs.begin(), key.specs.end(), [](const SmolImpl_VkSpecValue& a, const SmolImpl_VkSpecValue& b) { return a.id < b.id; });
+    auto it = s_VkKernelCache.find(key);
+    if (it != s_VkKernelCache.end())
+    {
+        ++it->second->refCount;
+        return it->second;
+    }
+
     // create shader module
     VkShaderModuleCreateInfo shaderModuleCreateInfo = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, 0, 0, shaderCodeSize, (const uint32_t*)shaderCode };
     VkShaderModule sm = 0;
@@ -1792,8 +6226,8 @@ SmolKernel* SmolKernelCreate(const void* shaderCode, size_t shaderCodeSize, cons
     SmolKernel* kernel = new SmolKernel();
     kernel->kernel = sm;
 
-    // parse SPIR-V to get resource bindings
-    if (!SmolImpl_VkParseShaderResources((const uint32_t*)shaderCode, (uint32_t)(shaderCodeSize / 4), *kernel))
+    // parse SPIR-V to get resource bindings and work group size
+    if (!SmolImpl_VkParseShaderResources((const uint32_t*)shaderCode, (uint32_t)(shaderCodeSize / 4), key.specs, *kernel))
     {
         SmolKernelDelete(kernel);
         return nullptr;
@@ -1823,147 +6257,549 @@ SmolKernel* SmolKernelCreate(const void* shaderCode, size_t shaderCodeSize, cons
         return nullptr;
     }
 
-    // create pipeline layout
+    // create pipeline layout, with push constants range if kernel uses them
+    if (kernel->pushConstantSize > s_VkDeviceProperties.limits.maxPushConstantsSize || kernel->pushConstantSize > SmolImpl_VkMaxPushConstantsSize)
+    {
+        SmolKernelDelete(kernel);
+        return nullptr;
+    }
+    VkPushConstantRange pushConstantRange = { VK_SHADER_STAGE_COMPUTE_BIT, 0, kernel->pushConstantSize };
     VkPipelineLayoutCreateInfo pipeLayoutCreateInfo = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
     pipeLayoutCreateInfo.setLayoutCount = 1;
     pipeLayoutCreateInfo.pSetLayouts = &kernel->dsLayout;
+    if (kernel->pushConstantSize > 0)
+    {
+        pipeLayoutCreateInfo.pushConstantRangeCount = 1;
+        pipeLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+    }
     res = vkCreatePipelineLayout(s_VkDevice, &pipeLayoutCreateInfo, 0, &kernel->pipeLayout);
     if (res != VK_SUCCESS)
     {
-        SmolKernelDelete(kernel);
+        SmolKernelDelete(kernel);
+        return nullptr;
+    }
+
+    // create pipeline
+    VkComputePipelineCreateInfo pipeCreateInfo = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+    VkPipelineShaderStageCreateInfo stage = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO };
+    stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    stage.module = kernel->kernel;
+    stage.pName = entryPoint;
+    const uint32_t specCount = (uint32_t)key.specs.size();
+    auto specEntries = std::unique_ptr<VkSpecializationMapEntry[]>(new VkSpecializationMapEntry[specCount + 1]);
+    auto specData = std::unique_ptr<uint32_t[]>(new uint32_t[specCount + 1]);
+    for (uint32_t i = 0; i < specCount; ++i)
+    {
+        specEntries[i].constantID = key.specs[i].id;
+        specEntries[i].offset = i * 4;
+        specEntries[i].size = 4;
+        specData[i] = key.specs[i].value;
+    }
+    VkSpecializationInfo specInfo = { specCount, specEntries.get(), specCount * 4, specData.get() };
+    if (specCount > 0)
+        stage.pSpecializationInfo = &specInfo;
+    pipeCreateInfo.stage = stage;
+    pipeCreateInfo.layout = kernel->pipeLayout;
+    VkPipelineCreationFeedbackEXT feedback = {};
+    VkPipelineCreationFeedbackCreateInfoEXT feedbackInfo = { VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT };
+    feedbackInfo.pPipelineCreationFeedback = &feedback;
+    if (s_VkHasCreationFeedback)
+        pipeCreateInfo.pNext = &feedbackInfo;
+    res = vkCreateComputePipelines(s_VkDevice, s_VkPipelineCache, 1, &pipeCreateInfo, 0, &kernel->pipeline);
+    if (res != VK_SUCCESS)
+    {
+        SmolKernelDelete(kernel);
+        return nullptr;
+    }
+    ++s_VkPipelineCacheStats.pipelinesCreated;
+    if (feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT)
+    {
+        s_VkPipelineCacheStats.creationTimeMs += feedback.duration / 1.0e6;
+        if (feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT)
+        {
+            ++s_VkPipelineCacheStats.cacheHits;
+        }
+        else
+        {
+            ++s_VkPipelineCacheStats.cacheMisses;
+            s_VkPipelineCacheDirty = true;
+        }
+    }
+    else
+    {
+        s_VkPipelineCacheDirty = true;
+    }
+
+    kernel->key = key;
+    s_VkKernelCache.insert(std::make_pair(key, kernel));
+    return kernel;
+}
+
+void SmolKernelDelete(SmolKernel* kernel)
+{
+    if (kernel == nullptr)
+        return;
+    SmolImpl_VkLock lock(s_VkMutex);
+    if (--kernel->refCount > 0)
+        return;
+    auto it = s_VkKernelCache.find(kernel->key);
+    if (it != s_VkKernelCache.end() && it->second == kernel)
+        s_VkKernelCache.erase(it);
+    SmolImpl_VkEvictDescriptorSets(kernel->dsLayout, nullptr);
+    SmolImpl_VkPendingDelete del;
+    del.serial = kernel->gpuUseSerial;
+    del.shader = kernel->kernel;
+    del.dsLayout = kernel->dsLayout;
+    del.pipeLayout = kernel->pipeLayout;
+    del.pipeline = kernel->pipeline;
+    SmolImpl_VkDeleteWhenUnused(del);
+    delete kernel;
+}
+
+void SmolKernelSet(SmolKernel* kernel)
+{
+    SmolImpl_VulkanState& state = SmolImpl_VkCtx()->state;
+    memset(state.buffers, 0, sizeof(state.buffers));
+    state.outputMask = 0;
+    state.kernel = kernel;
+}
+
+size_t SmolBufferGetOffsetAlignment(SmolBufferType type)
+{
+    const VkPhysicalDeviceLimits& limits = s_VkDeviceProperties.limits;
+    size_t align = (size_t)(type == SmolBufferType::Constant ? limits.minUniformBufferOffsetAlignment : limits.minStorageBufferOffsetAlignment);
+    return align < 4 ? 4 : align;
+}
+
+void SmolKernelSetBuffer(SmolBuffer* buffer, int index, SmolBufferBinding binding)
+{
+    SmolKernelSetBufferRange(buffer, index, 0, 0, binding);
+}
+
+void SmolKernelSetBufferRange(SmolBuffer* buffer, int index, size_t offset, size_t size, SmolBufferBinding binding)
+{
+    SMOL_ASSERT(buffer);
+    SMOL_ASSERT(buffer->buffer);
+    SMOL_ASSERT(index >= 0 && index < SmolImpl_VkMaxResources);
+    SMOL_ASSERT(offset + size <= buffer->size && offset < buffer->size);
+    SMOL_ASSERT(offset % SmolBufferGetOffsetAlignment(buffer->type) == 0);
+    const VkPhysicalDeviceLimits& limits = s_VkDeviceProperties.limits;
+    SMOL_ASSERT((size ? size : buffer->size - offset) <= (buffer->type == SmolBufferType::Constant ? limits.maxUniformBufferRange : limits.maxStorageBufferRange));
+    SmolImpl_VulkanState& state = SmolImpl_VkCtx()->state;
+    if (binding == SmolBufferBinding::Output)
+        state.outputMask |= (1 << index);
+    else
+        state.outputMask &= ~(1 << index);
+    state.buffers[index] = buffer;
+    state.offsets[index] = offset;
+    state.ranges[index] = size ? size : VK_WHOLE_SIZE;
+}
+
+void SmolKernelSetConstants(const void* data, size_t size, int index)
+{
+    SMOL_ASSERT(data != nullptr && size > 0);
+    (void)index; // kernels have at most one push constants block
+    SmolImpl_VulkanState& state = SmolImpl_VkCtx()->state;
+    SMOL_ASSERT(state.kernel != nullptr && size <= state.kernel->pushConstantSize);
+    if (state.kernel == nullptr)
+        return;
+    if (size > state.kernel->pushConstantSize)
+        size = state.kernel->pushConstantSize;
+    memcpy(state.constants, data, size);
+}
+
+
+// Gather barriers needed for the current kernel bindings of the context, and find or create their descriptor set.
+static VkDescriptorSet SmolImpl_VkPrepareDispatch(SmolContext* ctx, SmolImpl_VkBarrierBatch& barriers)
+{
+    const SmolImpl_VulkanState& state = ctx->state;
+    SmolKernel* kernel = state.kernel;
+    SmolImpl_VkStartCmdBufferIfNeeded(ctx);
+    SmolImpl_VkProcessEvictions(ctx);
+
+    // figure out bindings and which barriers are needed
+    SmolImpl_VkDescriptorKey key;
+    key.layout = kernel->dsLayout;
+    for (uint32_t i = 0; i < SmolImpl_VkMaxResources; ++i)
+    {
+        if (!(kernel->resourceMask & (1 << i)))
+            continue;
+        SmolBuffer* buffer = state.buffers[i];
+        if (buffer != nullptr)
+        {
+            // output bindings are writes, unless the kernel declares the buffer as read-only
+            bool write = (state.outputMask & (1 << i)) && !(kernel->readOnlyMask & (1 << i));
+            VkAccessFlags access = kernel->resourceTypes[i] == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER ? VK_ACCESS_UNIFORM_READ_BIT : VK_ACCESS_SHADER_READ_BIT;
+            if (write)
+                access |= VK_ACCESS_SHADER_WRITE_BIT;
+            SmolImpl_VkTrackAccess(ctx, barriers, buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, access, write);
+        }
+        VkDescriptorBufferInfo& info = key.infos[key.count++];
+        info.buffer = buffer ? buffer->buffer : nullptr;
+        info.offset = buffer ? state.offsets[i] : 0;
+        info.range = buffer ? state.ranges[i] : VK_WHOLE_SIZE;
+    }
+
+    // find or create a descriptor set for these bindings
+    auto it = ctx->descriptorCache.find(key);
+    if (it == ctx->descriptorCache.end())
+    {
+        if (ctx->descriptorCache.size() >= kSmolImpl_VkMaxCachedDescriptorSets && ctx->commandList == nullptr)
+        {
+            SmolImpl_VkRetireCompletedFrames();
+            SmolImpl_VkTrimDescriptorCache(ctx);
+        }
+        SmolImpl_VkDescriptorEntry entry;
+        entry.ds = SmolImpl_VkAllocDescriptorSet(ctx, kernel->dsLayout, &entry.pool);
+        if (entry.ds == nullptr)
+            return nullptr; // dispatch reports OutOfMemory
+        VkWriteDescriptorSet wds[SmolImpl_VkMaxResources];
+        memset(wds, 0, sizeof(wds[0]) * key.count);
+        uint32_t idx = 0;
+        for (uint32_t i = 0; i < SmolImpl_VkMaxResources; ++i)
+        {
+            if (!(kernel->resourceMask & (1 << i)))
+                continue;
+            wds[idx].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            wds[idx].dstSet = entry.ds;
+            wds[idx].dstBinding = i;
+            wds[idx].descriptorCount = 1;
+            wds[idx].descriptorType = kernel->resourceTypes[i];
+            wds[idx].pBufferInfo = &key.infos[idx];
+            ++idx;
+        }
+        vkUpdateDescriptorSets(s_VkDevice, key.count, wds, 0, 0);
+        it = ctx->descriptorCache.insert(std::make_pair(key, entry)).first;
+    }
+    it->second.gpuUseSerial = ctx->recordingSerial;
+    return it->second.ds;
+}
+
+// Record barriers, and bind compute pipeline and resources of the current kernel of the context.
+static void SmolImpl_VkCmdBindKernel(SmolContext* ctx, const SmolImpl_VkBarrierBatch& barriers, VkDescriptorSet ds)
+{
+    SmolKernel* kernel = ctx->state.kernel;
+    SMOL_ASSERT(ctx->cmdBuffer);
+    SmolImpl_VkAtomicMax(kernel->gpuUseSerial, ctx->recordingSerial);
+    if (ctx->commandList != nullptr && std::find(ctx->commandList->kernels.begin(), ctx->commandList->kernels.end(), kernel) == ctx->commandList->kernels.end())
+        ctx->commandList->kernels.push_back(kernel);
+    SmolImpl_VkCmdBarriers(ctx, barriers);
+
+    vkCmdBindPipeline(ctx->cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, kernel->pipeline);
+    vkCmdBindDescriptorSets(ctx->cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, kernel->pipeLayout, 0, 1, &ds, 0, 0);
+    if (kernel->pushConstantSize > 0)
+        vkCmdPushConstants(ctx->cmdBuffer, kernel->pipeLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, kernel->pushConstantSize, ctx->state.constants);
+}
+
+// Write start or end timestamp of a profile entry into the context command buffer. Called with s_VkMutex locked.
+static void SmolImpl_VkWriteTimestamp(SmolContext* ctx, uint64_t id, bool end)
+{
+    SmolImpl_VkProfileEntry& entry = s_VkProfileEntries[id - s_VkProfileFirstId];
+    SmolImpl_VkFrame& frame = SmolImpl_VkQueryFrame(ctx);
+    if (frame.queries.size() >= kSmolImpl_VkQueriesPerFrame)
+    {
+        entry.dropped = true;
+        return;
+    }
+    vkCmdWriteTimestamp(ctx->cmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame.queryPool, (uint32_t)frame.queries.size());
+    frame.queries.push_back(id * 2 + (end ? 1 : 0));
+    ++entry.pendingQueries;
+}
+
+// Start counting invocations of the current kernel of the context; returns query index or -1 if not counting.
+static int SmolImpl_VkBeginStatsQuery(SmolContext* ctx, uint64_t requestedThreads, bool indirect)
+{
+    if (!s_VkInvocationStats || ctx->commandList != nullptr)
+        return -1;
+    SmolImpl_VkFrame& frame = SmolImpl_VkQueryFrame(ctx);
+    int index;
+    {
+        // parts of one batch share the query pool
+        SmolImpl_VkLock lock(s_VkMutex);
+        if (frame.statsQueries.size() >= kSmolImpl_VkStatsQueriesPerFrame)
+            return -1;
+        SmolImpl_VkStatsQuery query;
+        query.stats = &s_VkKernelStats[ctx->state.kernel->key];
+        query.requestedThreads = requestedThreads;
+        query.indirect = indirect;
+        index = (int)frame.statsQueries.size();
+        frame.statsQueries.push_back(query);
+    }
+    vkCmdBeginQuery(ctx->cmdBuffer, frame.statsQueryPool, index, 0);
+    return index;
+}
+
+static void SmolImpl_VkEndStatsQuery(SmolContext* ctx, int index)
+{
+    if (index >= 0)
+        vkCmdEndQuery(ctx->cmdBuffer, SmolImpl_VkQueryFrame(ctx).statsQueryPool, index);
+}
+
+static uint64_t SmolImpl_VkProfileBeginEntry(SmolContext* ctx, const char* name)
+{
+    SmolImpl_VkStartCmdBufferIfNeeded(ctx);
+    SmolImpl_VkLock lock(s_VkMutex);
+    SmolImpl_VkProfileEntry entry = {};
+    snprintf(entry.name, sizeof(entry.name), "%s", name);
+    entry.depth = (int)ctx->profileStack.size();
+    const uint64_t id = s_VkProfileFirstId + s_VkProfileEntries.size();
+    s_VkProfileEntries.push_back(entry);
+    SmolImpl_VkWriteTimestamp(ctx, id, false);
+    return id;
+}
+
+static void SmolImpl_VkProfileEndEntry(SmolContext* ctx, uint64_t id)
+{
+    SmolImpl_VkStartCmdBufferIfNeeded(ctx);
+    SmolImpl_VkLock lock(s_VkMutex);
+    SmolImpl_VkWriteTimestamp(ctx, id, true);
+    s_VkProfileEntries[id - s_VkProfileFirstId].ended = true;
+    SmolImpl_VkCollectProfileResults();
+}
+
+// Whether the context flush policy says to submit its batch, once "extraDispatches" more dispatches are recorded.
+static bool SmolImpl_VkFlushDue(const SmolContext* ctx, int extraDispatches)
+{
+    if (ctx->secondary || ctx->activePartCount != 0)
+        return false;
+    const SmolFlushPolicy& policy = ctx->flushPolicy;
+    if (policy.maxDispatches > 0 && ctx->dispatchCount + extraDispatches >= policy.maxDispatches)
+        return true;
+    if (policy.maxBufferBytes > 0 && ctx->referencedBytes >= policy.maxBufferBytes)
+        return true;
+    return policy.maxRecordingUs > 0 && ctx->cmdBuffer != nullptr &&
+        (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - ctx->recordStart).count() >= policy.maxRecordingUs;
+}
+
+// Count a recorded dispatch, and submit the batch if the context flush policy says so. Kernel state
+// is kept in the context and bound again for each dispatch, so the next one can go into a new batch.
+// In non-blocking mode, if backpressure limits are reached, the flush is left to a later dispatch.
+static void SmolImpl_VkAutoFlush(SmolContext* ctx)
+{
+    if (ctx->secondary || ctx->activePartCount != 0 || ctx->cmdBuffer == nullptr)
+        return;
+    ++ctx->dispatchCount;
+    if (SmolImpl_VkFlushDue(ctx, 0) && SmolImpl_VkWaitForBackpressure(ctx))
+        SmolImpl_VkSubmit(ctx);
+}
+
+SmolResult SmolKernelDispatch(int threadsX, int threadsY, int threadsZ, int groupSizeX, int groupSizeY, int groupSizeZ)
+{
+    SmolContext* ctx = SmolImpl_VkCtx();
+    // a dispatch that is going to submit the batch waits for backpressure limits first
+    if (SmolImpl_VkFlushDue(ctx, 1) && !SmolImpl_VkWaitForBackpressure(ctx))
+        return SmolResult::WouldBlock;
+    SmolKernel* kernel = ctx->state.kernel;
+    SMOL_ASSERT(kernel != nullptr && kernel->pipeline != nullptr);
+    SMOL_ASSERT(kernel->localSize[0] == groupSizeX && kernel->localSize[1] == groupSizeY && kernel->localSize[2] == groupSizeZ);
+
+    SmolImpl_VkBarrierBatch barriers;
+    VkDescriptorSet ds = SmolImpl_VkPrepareDispatch(ctx, barriers);
+    if (ds == nullptr)
+    {
+        SmolImpl_VkCmdBarriers(ctx, barriers); // buffer access state already counts the dispatch
+        return SmolResult::OutOfMemory;
+    }
+
+    int groupsX = (threadsX + groupSizeX - 1) / groupSizeX;
+    int groupsY = (threadsY + groupSizeY - 1) / groupSizeY;
+    int groupsZ = (threadsZ + groupSizeZ - 1) / groupSizeZ;
+    SmolImpl_VkCmdBindKernel(ctx, barriers, ds);
+    const bool profile = s_VkProfiling && ctx->commandList == nullptr;
+    const uint64_t profileId = profile ? SmolImpl_VkProfileBeginEntry(ctx, kernel->key.entryPoint.c_str()) : 0;
+    const int statsQuery = SmolImpl_VkBeginStatsQuery(ctx, (uint64_t)threadsX * threadsY * threadsZ, false);
+    vkCmdDispatch(ctx->cmdBuffer, groupsX, groupsY, groupsZ);
+    SmolImpl_VkEndStatsQuery(ctx, statsQuery);
+    if (profile)
+        SmolImpl_VkProfileEndEntry(ctx, profileId);
+    SmolImpl_VkAutoFlush(ctx);
+    return SmolResult::Success;
+}
+
+SmolResult SmolKernelDispatchIndirect(SmolBuffer* argsBuffer, size_t argsOffset, int groupSizeX, int groupSizeY, int groupSizeZ)
+{
+    SmolContext* ctx = SmolImpl_VkCtx();
+    // a dispatch that is going to submit the batch waits for backpressure limits first
+    if (SmolImpl_VkFlushDue(ctx, 1) && !SmolImpl_VkWaitForBackpressure(ctx))
+        return SmolResult::WouldBlock;
+    SmolKernel* kernel = ctx->state.kernel;
+    SMOL_ASSERT(kernel != nullptr && kernel->pipeline != nullptr);
+    SMOL_ASSERT(kernel->localSize[0] == groupSizeX && kernel->localSize[1] == groupSizeY && kernel->localSize[2] == groupSizeZ);
+    SMOL_ASSERT(argsBuffer != nullptr && argsBuffer->type == SmolBufferType::Indirect);
+    SMOL_ASSERT(argsOffset % 4 == 0 && argsOffset + 12 <= argsBuffer->size);
+
+    SmolImpl_VkBarrierBatch barriers;
+    VkDescriptorSet ds = SmolImpl_VkPrepareDispatch(ctx, barriers);
+    if (ds == nullptr)
+    {
+        SmolImpl_VkCmdBarriers(ctx, barriers); // buffer access state already counts the dispatch
+        return SmolResult::OutOfMemory;
+    }
+    SmolImpl_VkTrackAccess(ctx, barriers, argsBuffer, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT, false);
+
+    SmolImpl_VkCmdBindKernel(ctx, barriers, ds);
+    const bool profile = s_VkProfiling && ctx->commandList == nullptr;
+    const uint64_t profileId = profile ? SmolImpl_VkProfileBeginEntry(ctx, kernel->key.entryPoint.c_str()) : 0;
+    const int statsQuery = SmolImpl_VkBeginStatsQuery(ctx, 0, true);
+    vkCmdDispatchIndirect(ctx->cmdBuffer, argsBuffer->buffer, argsOffset);
+    SmolImpl_VkEndStatsQuery(ctx, statsQuery);
+    if (profile)
+        SmolImpl_VkProfileEndEntry(ctx, profileId);
+    SmolImpl_VkAutoFlush(ctx);
+    return SmolResult::Success;
+}
+
+SmolCommandList* SmolCommandListBegin()
+{
+    SmolCommandList* list = new SmolCommandList();
+    VkCommandPoolCreateInfo commandPoolCreateInfo = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+    commandPoolCreateInfo.queueFamilyIndex = s_VkComputeQueueIndex;
+    VkCommandBufferAllocateInfo cbAllocInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+    cbAllocInfo.commandBufferCount = 1;
+    cbAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+    if (vkCreateCommandPool(s_VkDevice, &commandPoolCreateInfo, 0, &list->cmdPool) != VK_SUCCESS)
+    {
+        delete list;
         return nullptr;
     }
-
-    // create pipeline
-    VkComputePipelineCreateInfo pipeCreateInfo = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
-    VkPipelineShaderStageCreateInfo stage = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO };
-    stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-    stage.module = kernel->kernel;
-    stage.pName = entryPoint;
-    pipeCreateInfo.stage = stage;
-    pipeCreateInfo.layout = kernel->pipeLayout;
-    res = vkCreateComputePipelines(s_VkDevice, 0, 1, &pipeCreateInfo, 0, &kernel->pipeline);
-    if (res != VK_SUCCESS)
+    cbAllocInfo.commandPool = list->cmdPool;
+    if (vkAllocateCommandBuffers(s_VkDevice, &cbAllocInfo, &list->cmdBuffer) != VK_SUCCESS)
     {
-        SmolKernelDelete(kernel);
+        vkDestroyCommandPool(s_VkDevice, list->cmdPool, 0);
+        delete list;
         return nullptr;
     }
 
-    return kernel;
+    // can be in several batches in flight at once
+    VkCommandBufferInheritanceInfo inheritInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO };
+    VkCommandBufferBeginInfo cbBeginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+    cbBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+    cbBeginInfo.pInheritanceInfo = &inheritInfo;
+    VkResult res = vkBeginCommandBuffer(list->cmdBuffer, &cbBeginInfo);
+    SMOL_ASSERT(res == VK_SUCCESS);
+
+    // record with a context of its own; it is not registered with others, so it never
+    // gets descriptor set evictions and is never waited on
+    list->ctx = new SmolContext();
+    list->ctx->secondary = true;
+    list->ctx->commandList = list;
+    list->ctx->cmdBuffer = list->cmdBuffer;
+    list->prevContext = s_VkCurrentContext;
+    s_VkCurrentContext = list->ctx;
+    return list;
 }
 
-void SmolKernelDelete(SmolKernel* kernel)
+void SmolCommandListEnd(SmolCommandList* list)
 {
-    if (kernel == nullptr)
-        return;
-    if (kernel->kernel != nullptr)
-        vkDestroyShaderModule(s_VkDevice, kernel->kernel, 0);
-    if (kernel->dsLayout != nullptr)
-        vkDestroyDescriptorSetLayout(s_VkDevice, kernel->dsLayout, 0);
-    if (kernel->pipeLayout != nullptr)
-        vkDestroyPipelineLayout(s_VkDevice, kernel->pipeLayout, 0);
-    if (kernel->pipeline != nullptr)
-        vkDestroyPipeline(s_VkDevice, kernel->pipeline, 0);
-    delete kernel;
+    SMOL_ASSERT(list != nullptr && list->ctx != nullptr && s_VkCurrentContext == list->ctx);
+    VkResult res = vkEndCommandBuffer(list->cmdBuffer);
+    SMOL_ASSERT(res == VK_SUCCESS);
+    SmolContext* ctx = list->ctx;
+    for (auto it = ctx->bufferStates.begin(); it != ctx->bufferStates.end(); ++it)
+    {
+        list->buffers.push_back(it->first);
+        if (it->second.writeAccess != 0)
+            list->writtenBuffers.push_back(it->first);
+    }
+    // descriptor sets live as long as their pools
+    list->descriptorPools.swap(ctx->descriptorPools);
+    delete ctx;
+    list->ctx = nullptr;
+    s_VkCurrentContext = list->prevContext;
 }
 
-struct SmolImpl_VulkanState
+void SmolCommandListExecute(SmolCommandList* list)
 {
-    SmolKernel* kernel = nullptr;
-    SmolBuffer* buffers[SmolImpl_VkMaxResources] = {};
-};
-
-static SmolImpl_VulkanState s_VkState;
+    SMOL_ASSERT(list != nullptr && list->ctx == nullptr);
+    SmolContext* ctx = SmolImpl_VkCtx();
+    SMOL_ASSERT(!ctx->secondary);
+    SmolImpl_VkStartCmdBufferIfNeeded(ctx);
+    // list tracks buffer accesses only within itself
+    SmolImpl_VkCmdFullBarrier(ctx->cmdBuffer);
+    vkCmdExecuteCommands(ctx->cmdBuffer, 1, &list->cmdBuffer);
+    SmolImpl_VkCmdFullBarrier(ctx->cmdBuffer);
+    ctx->bufferStates.clear();
+
+    SmolImpl_VkAtomicMax(list->gpuUseSerial, ctx->recordingSerial);
+    for (size_t i = 0; i < list->buffers.size(); ++i)
+        SmolImpl_VkAtomicMax(list->buffers[i]->gpuUseSerial, ctx->recordingSerial);
+    for (size_t i = 0; i < list->writtenBuffers.size(); ++i)
+        SmolImpl_VkAtomicMax(list->writtenBuffers[i]->gpuWriteSerial, ctx->recordingSerial);
+    for (size_t i = 0; i < list->kernels.size(); ++i)
+        SmolImpl_VkAtomicMax(list->kernels[i]->gpuUseSerial, ctx->recordingSerial);
+}
 
-void SmolKernelSet(SmolKernel* kernel)
+void SmolCommandListDelete(SmolCommandList* list)
 {
-    memset(s_VkState.buffers, 0, sizeof(s_VkState.buffers));
-    s_VkState.kernel = kernel;
+    if (list == nullptr)
+        return;
+    SMOL_ASSERT(list->ctx == nullptr);
+    SmolImpl_VkLock lock(s_VkMutex);
+    SmolImpl_VkPendingDelete del;
+    del.serial = list->gpuUseSerial;
+    del.cmdPool = list->cmdPool;
+    SmolImpl_VkDeleteWhenUnused(del);
+    for (size_t i = 0; i < list->descriptorPools.size(); ++i)
+    {
+        SmolImpl_VkPendingDelete dsDel;
+        dsDel.serial = list->gpuUseSerial;
+        dsDel.dsPool = list->descriptorPools[i];
+        SmolImpl_VkDeleteWhenUnused(dsDel);
+    }
+    for (size_t i = 0; i < list->buffers.size(); ++i)
+        --list->buffers[i]->commandListRefs;
+    delete list;
 }
 
-void SmolKernelSetBuffer(SmolBuffer* buffer, int index, SmolBufferBinding binding)
+SmolKernelStats SmolKernelGetStats(SmolKernel* kernel)
 {
-    SMOL_ASSERT(buffer);
-    SMOL_ASSERT(buffer->buffer);
-    SMOL_ASSERT(index >= 0 && index < SmolImpl_VkMaxResources);
-    if (binding == SmolBufferBinding::Output)
-        buffer->writtenByGpuSinceLastRead = true;
-    s_VkState.buffers[index] = buffer;
+    SMOL_ASSERT(kernel != nullptr);
+    SmolImpl_VkLock lock(s_VkMutex);
+    SmolImpl_VkRetireCompletedFrames();
+    auto it = s_VkKernelStats.find(kernel->key);
+    return it != s_VkKernelStats.end() ? it->second : SmolKernelStats();
 }
 
-static void SmolImpl_VkStartCmdBufferIfNeeded()
+void SmolProfileBegin(const char* name)
 {
-    if (s_VkCommandBuffer != nullptr)
-        return;
-    VkCommandBufferAllocateInfo cbAllocInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
-    cbAllocInfo.commandPool = s_VkCommandPool;
-    cbAllocInfo.commandBufferCount = 1;
-    cbAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    VkResult res = vkAllocateCommandBuffers(s_VkDevice, &cbAllocInfo, &s_VkCommandBuffer);
-    if (res != VK_SUCCESS)
+    if (!s_VkProfiling)
         return;
-
-    VkCommandBufferBeginInfo cbBeginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
-    cbBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    res = vkBeginCommandBuffer(s_VkCommandBuffer, &cbBeginInfo);
-    SMOL_ASSERT(res == VK_SUCCESS);
+    SmolContext* ctx = SmolImpl_VkCtx();
+    SMOL_ASSERT(ctx->commandList == nullptr);
+    ctx->profileStack.push_back(SmolImpl_VkProfileBeginEntry(ctx, name));
 }
 
-
-void SmolKernelDispatch(int threadsX, int threadsY, int threadsZ, int groupSizeX, int groupSizeY, int groupSizeZ)
+void SmolProfileEnd()
 {
-    SmolKernel* kernel = s_VkState.kernel;
-    SMOL_ASSERT(kernel != nullptr && kernel->pipeline != nullptr);
-    SMOL_ASSERT(kernel->localSize[0] == groupSizeX && kernel->localSize[1] == groupSizeY && kernel->localSize[2] == groupSizeZ);
-
-    // allocate a descriptor set
-    VkDescriptorSetAllocateInfo dsAllocInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
-    dsAllocInfo.descriptorPool = s_VkDescriptorPool;
-    dsAllocInfo.descriptorSetCount = 1;
-    dsAllocInfo.pSetLayouts = &kernel->dsLayout;
-    VkDescriptorSet ds = 0;
-    VkResult res = vkAllocateDescriptorSets(s_VkDevice, &dsAllocInfo, &ds);
-    if (res != VK_SUCCESS)
+    if (!s_VkProfiling)
         return;
+    SmolContext* ctx = SmolImpl_VkCtx();
+    SMOL_ASSERT(!ctx->profileStack.empty());
+    if (ctx->profileStack.empty())
+        return;
+    const uint64_t id = ctx->profileStack.back();
+    ctx->profileStack.pop_back();
+    SmolImpl_VkProfileEndEntry(ctx, id);
+}
 
-    // fill descriptor set with binding data
-    VkDescriptorBufferInfo binfos[SmolImpl_VkMaxResources];
-    VkWriteDescriptorSet wds[SmolImpl_VkMaxResources];
-    memset(binfos, 0, sizeof(binfos[0]) * kernel->resourceCount);
-    memset(wds, 0, sizeof(wds[0]) * kernel->resourceCount);
-    uint32_t idx = 0;
-    for (uint32_t i = 0; i < SmolImpl_VkMaxResources; ++i)
+int SmolProfileGetResults(SmolProfileResult* results, int maxResults)
+{
+    if (!s_VkProfiling)
+        return 0;
+    // submit work that has timestamps in it, so that results show up without waiting for other submits
+    SmolContext* ctx = SmolImpl_VkCtx();
+    if (ctx->cmdBuffer != nullptr && !ctx->frames[ctx->frameIndex].queries.empty())
+        SmolImpl_VkSubmit(ctx);
+    SmolImpl_VkLock lock(s_VkMutex);
+    SmolImpl_VkRetireCompletedFrames();
+
+    int count = (int)std::min(s_VkProfileResults.size(), (size_t)std::max(maxResults, 0));
+    if (count > 0)
     {
-        if (!(kernel->resourceMask & (1 << i)))
-            continue;
-        binfos[idx].buffer = s_VkState.buffers[i] ? s_VkState.buffers[i]->buffer : nullptr;
-        binfos[idx].offset = 0;
-        binfos[idx].range = VK_WHOLE_SIZE;
-        wds[idx].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        wds[idx].dstSet = ds;
-        wds[idx].dstBinding = i;
-        wds[idx].descriptorCount = 1;
-        wds[idx].descriptorType = kernel->resourceTypes[i];
-        wds[idx].pBufferInfo = &binfos[idx];
-        ++idx;
-    }
-    vkUpdateDescriptorSets(s_VkDevice, kernel->resourceCount, wds, 0, 0);
-
-    // dispatch
-    int groupsX = (threadsX + groupSizeX - 1) / groupSizeX;
-    int groupsY = (threadsY + groupSizeY - 1) / groupSizeY;
-    int groupsZ = (threadsZ + groupSizeZ - 1) / groupSizeZ;
-    SmolImpl_VkStartCmdBufferIfNeeded();
-    SMOL_ASSERT(s_VkCommandBuffer);
-
-    //@TODO: this is suboptimal, we only need a barrier if our dispatch inputs are in flight as outputs of previous dispatches
-    //@TODO: we probably also need a memory barrier? not sure just yet :)
-    vkCmdPipelineBarrier(s_VkCommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
-
-    // bind compute pipeline, resources and dispatch
-    vkCmdBindPipeline(s_VkCommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, kernel->pipeline);
-    vkCmdBindDescriptorSets(s_VkCommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, kernel->pipeLayout, 0, 1, &ds, 0, 0);
-    vkCmdDispatch(s_VkCommandBuffer, groupsX, groupsY, groupsZ);
+        memcpy(results, s_VkProfileResults.data(), count * sizeof(SmolProfileResult));
+        s_VkProfileResults.erase(s_VkProfileResults.begin(), s_VkProfileResults.begin() + count);
+    }
+    return count;
 }
 
 void SmolCaptureStart()
@@ -1998,12 +6834,26 @@ void SmolCaptureFinish()
 #endif
 #include <TargetConditionals.h>
 #import <Metal/Metal.h>
+#include <chrono>
+#include <thread>
+#include <vector>
 
 static id<MTLDevice> s_MetalDevice;
 static id<MTLCommandQueue> s_MetalCmdQueue;
 static id<MTLCommandBuffer> s_MetalCmdBuffer;
 static id<MTLComputeCommandEncoder> s_MetalComputeEncoder;
 
+// SmolFence values are tracked with committed command buffers; pending ones are in commit order
+struct SmolImpl_MetalFence
+{
+    uint64_t value;
+    id<MTLCommandBuffer> cmdBuffer;
+};
+static std::vector<SmolImpl_MetalFence> s_MetalFences;
+static uint64_t s_MetalFenceValue; // last fence value handed out
+static uint64_t s_MetalCompletedFenceValue;
+static SmolBackpressureLimits s_MetalBackpressure;
+
 static void MetalFlushActiveEncoders()
 {
     if (s_MetalComputeEncoder != nil)
@@ -2023,8 +6873,39 @@ static void MetalFinishWork()
     s_MetalCmdBuffer = nil;
 }
 
-bool SmolComputeCreate(SmolComputeCreateFlags flags)
+// Drop fences of command buffers that are completed, in commit order.
+static void MetalRetireFences()
+{
+    size_t done = 0;
+    while (done < s_MetalFences.size() && s_MetalFences[done].cmdBuffer.status >= MTLCommandBufferStatusCompleted)
+    {
+        s_MetalCompletedFenceValue = s_MetalFences[done].value;
+        ++done;
+    }
+    s_MetalFences.erase(s_MetalFences.begin(), s_MetalFences.begin() + done);
+}
+
+// Wait until committing another command buffer stays within backpressure limits. Returns false
+// instead of waiting in non-blocking mode.
+static bool MetalWaitForBackpressure()
+{
+    const int maxBatches = s_MetalBackpressure.maxInFlightBatches;
+    if (maxBatches <= 0)
+        return true;
+    MetalRetireFences();
+    while ((int)s_MetalFences.size() >= maxBatches)
+    {
+        if (s_MetalBackpressure.nonBlocking)
+            return false;
+        [s_MetalFences.front().cmdBuffer waitUntilCompleted];
+        MetalRetireFences();
+    }
+    return true;
+}
+
+bool SmolComputeCreate(SmolComputeCreateFlags flags, const char* pipelineCachePath, const SmolTaskScheduler* scheduler)
 {
+    SmolImpl_SetTaskScheduler(scheduler);
     s_MetalDevice = MTLCreateSystemDefaultDevice();
     s_MetalCmdQueue = [s_MetalDevice newCommandQueue];
     return true;
@@ -2033,8 +6914,13 @@ bool SmolComputeCreate(SmolComputeCreateFlags flags)
 void SmolComputeDelete()
 {
     MetalFinishWork();
+    s_MetalFences.clear();
+    s_MetalFenceValue = 0;
+    s_MetalCompletedFenceValue = 0;
+    s_MetalBackpressure = SmolBackpressureLimits();
     s_MetalCmdQueue = nil;
     s_MetalDevice = nil;
+    SmolImpl_ShutdownTaskScheduler();
 }
 
 SmolBackend SmolComputeGetBackend()
@@ -2042,18 +6928,188 @@ SmolBackend SmolComputeGetBackend()
     return SmolBackend::Metal;
 }
 
+// all contexts record into the one command buffer
+struct SmolContext
+{
+    SmolFlushPolicy flushPolicy;
+};
+static SmolContext s_MetalDefaultContext;
+static thread_local SmolContext* s_MetalCurrentContext;
+// automatic flushing: work recorded into the current command buffer so far
+static int s_MetalDispatchCount;
+static size_t s_MetalBoundBytes;
+static std::chrono::steady_clock::time_point s_MetalRecordStart;
+
+SmolContext* SmolContextCreate()
+{
+    return new SmolContext();
+}
+
+void SmolContextDelete(SmolContext* context)
+{
+    SMOL_ASSERT(context != &s_MetalDefaultContext);
+    if (s_MetalCurrentContext == context)
+        s_MetalCurrentContext = nullptr;
+    delete context;
+}
+
+void SmolContextSetCurrent(SmolContext* context)
+{
+    s_MetalCurrentContext = context;
+}
+
+SmolContext* SmolContextGetCurrent()
+{
+    return s_MetalCurrentContext != nullptr ? s_MetalCurrentContext : &s_MetalDefaultContext;
+}
+
+SmolResult SmolContextFlush(SmolContext* context)
+{
+    // committed command buffer is tracked as a fence, so that it counts against backpressure limits
+    SmolResult result;
+    SmolComputeFlush(&result);
+    return result;
+}
+
+void SmolContextSetFlushPolicy(SmolContext* context, const SmolFlushPolicy& policy)
+{
+    (context != nullptr ? context : SmolContextGetCurrent())->flushPolicy = policy;
+}
+
+// Commit the current command buffer, if any, regardless of backpressure limits; explicit waits need it.
+static SmolFence MetalCommit()
+{
+    SmolFence fence;
+    fence.value = s_MetalFenceValue;
+    if (s_MetalCmdBuffer == nil)
+        return fence;
+    MetalFlushActiveEncoders();
+    [s_MetalCmdBuffer commit];
+    fence.value = ++s_MetalFenceValue;
+    s_MetalFences.push_back({ fence.value, s_MetalCmdBuffer });
+    s_MetalCmdBuffer = nil;
+    return fence;
+}
+
+SmolFence SmolComputeFlush(SmolResult* result)
+{
+    if (result != nullptr)
+        *result = SmolResult::Success;
+    if (s_MetalCmdBuffer != nil && !MetalWaitForBackpressure())
+    {
+        if (result != nullptr)
+            *result = SmolResult::WouldBlock;
+        SmolFence fence;
+        fence.value = s_MetalFenceValue;
+        return fence;
+    }
+    return MetalCommit();
+}
+
+bool SmolFenceIsComplete(SmolFence fence)
+{
+    MetalRetireFences();
+    return fence.value <= s_MetalCompletedFenceValue;
+}
+
+// Poll until done() returns true, for at most timeoutNs nanoseconds. Returns whether it did.
+template<typename F>
+static bool MetalPoll(F done, uint64_t timeoutNs)
+{
+    const auto start = std::chrono::steady_clock::now();
+    while (!done())
+    {
+        if ((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count() >= timeoutNs)
+            return false;
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+bool SmolFenceWait(SmolFence fence, uint64_t timeoutNs)
+{
+    if (timeoutNs == ~0ULL)
+    {
+        for (size_t i = 0; i < s_MetalFences.size() && s_MetalFences[i].value <= fence.value; ++i)
+            [s_MetalFences[i].cmdBuffer waitUntilCompleted];
+    }
+    return MetalPoll([&]() { return SmolFenceIsComplete(fence); }, timeoutNs);
+}
+
+bool SmolContextBeginParts(SmolContext* context, int partCount)
+{
+    return false;
+}
+
+SmolContext* SmolContextGetPart(SmolContext* context, int index)
+{
+    return nullptr;
+}
+
+void SmolContextEndParts(SmolContext* context)
+{
+}
+
+SmolCommandList* SmolCommandListBegin()
+{
+    return nullptr;
+}
+
+void SmolCommandListEnd(SmolCommandList* list)
+{
+}
+
+void SmolCommandListExecute(SmolCommandList* list)
+{
+}
+
+void SmolCommandListDelete(SmolCommandList* list)
+{
+}
+
+SmolPipelineCacheStats SmolComputeGetPipelineCacheStats()
+{
+    return SmolPipelineCacheStats();
+}
+
+SmolMemoryStats SmolComputeGetMemoryStats()
+{
+    return SmolMemoryStats();
+}
+
+SmolSubmitStats SmolComputeGetSubmitStats()
+{
+    return SmolSubmitStats();
+}
+
+void SmolComputeSetBackpressureLimits(const SmolBackpressureLimits& limits)
+{
+    s_MetalBackpressure = limits;
+}
+
+void SmolComputeDefragment()
+{
+}
+
 struct SmolBuffer
 {
     id<MTLBuffer> buffer;
     size_t size;
+    bool managed = true;
     bool writtenByGpuSinceLastRead = false;
+    size_t mapOffset = 0;
+    size_t mapSize = 0;
+    SmolBufferMapAccess mapAccess = SmolBufferMapAccess::Read;
 };
 
-SmolBuffer* SmolBufferCreate(size_t size, SmolBufferType type, size_t structElementSize)
+SmolBuffer* SmolBufferCreate(size_t size, SmolBufferType type, size_t structElementSize, SmolBufferUsage usage)
 {
+    // upload/readback buffers use shared storage: no explicit CPU<->GPU synchronization needed
+    const bool managed = usage == SmolBufferUsage::Dynamic || usage == SmolBufferUsage::GpuOnly;
     SmolBuffer* buf = new SmolBuffer();
-    buf->buffer = [s_MetalDevice newBufferWithLength:size options:MTLResourceStorageModeManaged];
+    buf->buffer = [s_MetalDevice newBufferWithLength:size options:managed ? MTLResourceStorageModeManaged : MTLResourceStorageModeShared];
     buf->size = size;
+    buf->managed = managed;
     return buf;
 }
 
@@ -2062,8 +7118,9 @@ void SmolBufferSetData(SmolBuffer* buffer, const void* src, size_t size, size_t
     SMOL_ASSERT(buffer);
     SMOL_ASSERT(dstOffset + size <= buffer->size);
     uint8_t* dst = (uint8_t*)[buffer->buffer contents];
-    memcpy(dst + dstOffset, src, size);
-    [buffer->buffer didModifyRange: NSMakeRange(dstOffset, size)];
+    SmolImpl_Memcpy(dst + dstOffset, src, size);
+    if (buffer->managed)
+        [buffer->buffer didModifyRange: NSMakeRange(dstOffset, size)];
 }
 
 static void MetalBufferMakeGpuDataVisibleToCpu(SmolBuffer* buffer)
@@ -2082,12 +7139,39 @@ void SmolBufferGetData(SmolBuffer* buffer, void* dst, size_t size, size_t srcOff
     SMOL_ASSERT(srcOffset + size <= buffer->size);
     if (buffer->writtenByGpuSinceLastRead)
     {
-        MetalBufferMakeGpuDataVisibleToCpu(buffer);
+        if (buffer->managed)
+            MetalBufferMakeGpuDataVisibleToCpu(buffer);
         MetalFinishWork();
         buffer->writtenByGpuSinceLastRead = false;
     }
     const uint8_t* src = (const uint8_t*)[buffer->buffer contents];
-    memcpy(dst, src + srcOffset, size);
+    SmolImpl_Memcpy(dst, src + srcOffset, size);
+}
+
+void* SmolBufferMap(SmolBuffer* buffer, SmolBufferMapAccess access, size_t offset, size_t size)
+{
+    SMOL_ASSERT(buffer);
+    if (size == 0)
+        size = buffer->size - offset;
+    SMOL_ASSERT(offset + size <= buffer->size);
+    if (HasFlag(access, SmolBufferMapAccess::Read) && buffer->writtenByGpuSinceLastRead)
+    {
+        if (buffer->managed)
+            MetalBufferMakeGpuDataVisibleToCpu(buffer);
+        MetalFinishWork();
+        buffer->writtenByGpuSinceLastRead = false;
+    }
+    buffer->mapOffset = offset;
+    buffer->mapSize = size;
+    buffer->mapAccess = access;
+    return (uint8_t*)[buffer->buffer contents] + offset;
+}
+
+void SmolBufferUnmap(SmolBuffer* buffer)
+{
+    SMOL_ASSERT(buffer);
+    if (buffer->managed && HasFlag(buffer->mapAccess, SmolBufferMapAccess::Write))
+        [buffer->buffer didModifyRange: NSMakeRange(buffer->mapOffset, buffer->mapSize)];
 }
 
 void SmolBufferDelete(SmolBuffer* buffer)
@@ -2101,8 +7185,119 @@ void SmolBufferDelete(SmolBuffer* buffer)
 
 static void StartCmdBufferIfNeeded()
 {
-    if (s_MetalCmdBuffer == nil)
-        s_MetalCmdBuffer = [s_MetalCmdQueue commandBufferWithUnretainedReferences];
+    if (s_MetalCmdBuffer != nil)
+        return;
+    s_MetalCmdBuffer = [s_MetalCmdQueue commandBufferWithUnretainedReferences];
+    s_MetalDispatchCount = 0;
+    s_MetalBoundBytes = 0;
+    s_MetalRecordStart = std::chrono::steady_clock::now();
+}
+
+struct SmolReadback
+{
+    id<MTLBuffer> staging; // shared storage; released once data is read
+    id<MTLCommandBuffer> cmdBuffer; // command buffer that does the copy
+    void* dst = nullptr;
+    size_t size = 0;
+    bool done = false;
+};
+
+SmolReadback* SmolBufferGetDataAsync(SmolBuffer* buffer, void* dst, size_t size, size_t srcOffset)
+{
+    SMOL_ASSERT(buffer);
+    SMOL_ASSERT(size > 0 && srcOffset + size <= buffer->size);
+    SmolReadback* readback = new SmolReadback();
+    readback->staging = [s_MetalDevice newBufferWithLength:size options:MTLResourceStorageModeShared];
+    readback->dst = dst;
+    readback->size = size;
+
+    StartCmdBufferIfNeeded();
+    MetalFlushActiveEncoders();
+    id<MTLBlitCommandEncoder> blit = [s_MetalCmdBuffer blitCommandEncoder];
+    [blit copyFromBuffer:buffer->buffer sourceOffset:srcOffset toBuffer:readback->staging destinationOffset:0 size:size];
+    [blit endEncoding];
+    // command buffer does not retain resources; keep staging alive until the copy is done
+    id<MTLBuffer> staging = readback->staging;
+    [s_MetalCmdBuffer addCompletedHandler:^(id<MTLCommandBuffer>) { (void)staging; }];
+    readback->cmdBuffer = s_MetalCmdBuffer;
+    return readback;
+}
+
+bool SmolReadbackIsComplete(SmolReadback* readback)
+{
+    SMOL_ASSERT(readback);
+    if (readback->done)
+        return true;
+    if (readback->cmdBuffer.status < MTLCommandBufferStatusCompleted)
+        return false;
+    SmolImpl_Memcpy(readback->dst, [readback->staging contents], readback->size);
+    readback->staging = nil;
+    readback->cmdBuffer = nil;
+    readback->done = true;
+    return true;
+}
+
+bool SmolReadbackWait(SmolReadback* readback, uint64_t timeoutNs)
+{
+    SMOL_ASSERT(readback);
+    if (readback->done)
+        return true;
+    if (readback->cmdBuffer == s_MetalCmdBuffer)
+        MetalCommit();
+    if (timeoutNs == ~0ULL)
+        [readback->cmdBuffer waitUntilCompleted];
+    return MetalPoll([&]() { return SmolReadbackIsComplete(readback); }, timeoutNs);
+}
+
+void SmolReadbackDelete(SmolReadback* readback)
+{
+    delete readback;
+}
+
+void SmolFenceOnComplete(SmolFence fence, SmolCompletionCallback callback, void* userData)
+{
+    SMOL_ASSERT(callback);
+    id<MTLCommandBuffer> cmdBuffer = nil;
+    for (size_t i = 0; i < s_MetalFences.size(); ++i)
+    {
+        if (s_MetalFences[i].value == fence.value)
+            cmdBuffer = s_MetalFences[i].cmdBuffer;
+    }
+    if (cmdBuffer == nil)
+    {
+        callback(userData); // fence already complete
+        return;
+    }
+    // fence command buffers are committed already, so can't add completion handlers to them
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0), ^{
+        [cmdBuffer waitUntilCompleted];
+        callback(userData);
+    });
+}
+
+void SmolReadbackOnComplete(SmolReadback* readback, SmolCompletionCallback callback, void* userData)
+{
+    SMOL_ASSERT(readback && callback);
+    if (readback->done)
+    {
+        callback(userData);
+        return;
+    }
+    id<MTLCommandBuffer> cmdBuffer = readback->cmdBuffer;
+    if (cmdBuffer == s_MetalCmdBuffer)
+    {
+        // still being encoded
+        [cmdBuffer addCompletedHandler:^(id<MTLCommandBuffer>) {
+            SmolReadbackIsComplete(readback);
+            callback(userData);
+        }];
+        return;
+    }
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0), ^{
+        [cmdBuffer waitUntilCompleted];
+        SmolReadbackIsComplete(readback);
+        callback(userData);
+    });
 }
 
 struct SmolKernel
@@ -2111,6 +7306,11 @@ struct SmolKernel
 };
 
 SmolKernel* SmolKernelCreate(const void* shaderCode, size_t shaderCodeSize, const char* entryPoint, SmolKernelCreateFlags flags)
+{
+    return SmolKernelCreate(shaderCode, shaderCodeSize, entryPoint, nullptr, 0, flags);
+}
+
+SmolKernel* SmolKernelCreate(const void* shaderCode, size_t shaderCodeSize, const char* entryPoint, const SmolKernelSpecialization* specializations, int specializationCount, SmolKernelCreateFlags flags)
 {
     MTLCompileOptions* opt = [MTLCompileOptions new];
     opt.fastMathEnabled = HasFlag(flags, SmolKernelCreateFlags::EnableFastMath);
@@ -2130,7 +7330,26 @@ SmolKernel* SmolKernelCreate(const void* shaderCode, size_t shaderCodeSize, cons
     if (lib == nil)
         return nullptr;
 
-    id<MTLFunction> func = [lib newFunctionWithName: [NSString stringWithUTF8String: entryPoint]];
+    id<MTLFunction> func = nil;
+    if (specializationCount > 0)
+    {
+        // specialization constants are function constants
+        MTLFunctionConstantValues* values = [MTLFunctionConstantValues new];
+        for (int i = 0; i < specializationCount; ++i)
+        {
+            const SmolKernelSpecialization& spec = specializations[i];
+            if (spec.type == SmolKernelSpecialization::Type::Float)
+                [values setConstantValue: &spec.floatValue type: MTLDataTypeFloat atIndex: spec.constantId];
+            else if (spec.type == SmolKernelSpecialization::Type::Bool)
+                [values setConstantValue: &spec.boolValue type: MTLDataTypeBool atIndex: spec.constantId];
+            else
+                [values setConstantValue: &spec.intValue type: MTLDataTypeInt atIndex: spec.constantId];
+        }
+        func = [lib newFunctionWithName: [NSString stringWithUTF8String: entryPoint] constantValues: values error: &error];
+        error = nil;
+    }
+    else
+        func = [lib newFunctionWithName: [NSString stringWithUTF8String: entryPoint]];
     if (func == nil)
         return nullptr;
 
@@ -2160,8 +7379,25 @@ void SmolKernelDelete(SmolKernel* kernel)
     delete kernel;
 }
 
+// Commit the command buffer if the flush policy of the current context says so. Done before a
+// kernel is set up, since bindings of the compute encoder do not carry over to a new command buffer.
+// In non-blocking mode, if backpressure limits are reached, the commit is left for a later kernel.
+static void MetalAutoFlush()
+{
+    if (s_MetalCmdBuffer == nil)
+        return;
+    const SmolFlushPolicy& policy = SmolContextGetCurrent()->flushPolicy;
+    bool flush = (policy.maxDispatches > 0 && s_MetalDispatchCount >= policy.maxDispatches) ||
+        (policy.maxBufferBytes > 0 && s_MetalBoundBytes >= policy.maxBufferBytes);
+    if (!flush && policy.maxRecordingUs > 0)
+        flush = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - s_MetalRecordStart).count() >= policy.maxRecordingUs;
+    if (flush)
+        SmolComputeFlush();
+}
+
 void SmolKernelSet(SmolKernel* kernel)
 {
+    MetalAutoFlush();
     StartCmdBufferIfNeeded();
     if (s_MetalComputeEncoder == nil)
     {
@@ -2171,21 +7407,72 @@ void SmolKernelSet(SmolKernel* kernel)
     [s_MetalComputeEncoder setComputePipelineState:kernel->kernel];
 }
 
+size_t SmolBufferGetOffsetAlignment(SmolBufferType type)
+{
+    // macOS needs 256 byte aligned offsets for buffers in constant address space
+    return type == SmolBufferType::Constant ? 256 : 4;
+}
+
 void SmolKernelSetBuffer(SmolBuffer* buffer, int index, SmolBufferBinding binding)
+{
+    SmolKernelSetBufferRange(buffer, index, 0, 0, binding);
+}
+
+void SmolKernelSetBufferRange(SmolBuffer* buffer, int index, size_t offset, size_t size, SmolBufferBinding binding)
 {
     SMOL_ASSERT(s_MetalComputeEncoder != nil);
+    SMOL_ASSERT(offset + size <= buffer->size);
+    SMOL_ASSERT(offset % SmolBufferGetOffsetAlignment(binding == SmolBufferBinding::Constant ? SmolBufferType::Constant : SmolBufferType::Structured) == 0);
     if (binding == SmolBufferBinding::Output)
         buffer->writtenByGpuSinceLastRead = true;
-    [s_MetalComputeEncoder setBuffer:buffer->buffer offset:0 atIndex:index];
+    [s_MetalComputeEncoder setBuffer:buffer->buffer offset:offset atIndex:index];
+    s_MetalBoundBytes += size != 0 ? size : buffer->size - offset;
+}
+
+void SmolKernelSetConstants(const void* data, size_t size, int index)
+{
+    SMOL_ASSERT(s_MetalComputeEncoder != nil);
+    SMOL_ASSERT(data != nullptr && size > 0 && size <= 4096);
+    [s_MetalComputeEncoder setBytes:data length:size atIndex:index];
 }
 
-void SmolKernelDispatch(int threadsX, int threadsY, int threadsZ, int groupSizeX, int groupSizeY, int groupSizeZ)
+SmolResult SmolKernelDispatch(int threadsX, int threadsY, int threadsZ, int groupSizeX, int groupSizeY, int groupSizeZ)
 {
     SMOL_ASSERT(s_MetalComputeEncoder != nil);
     int groupsX = (threadsX + groupSizeX-1) / groupSizeX;
     int groupsY = (threadsY + groupSizeY-1) / groupSizeY;
     int groupsZ = (threadsZ + groupSizeZ-1) / groupSizeZ;
     [s_MetalComputeEncoder dispatchThreadgroups:MTLSizeMake(groupsX, groupsY, groupsZ) threadsPerThreadgroup:MTLSizeMake(groupSizeX,groupSizeY,groupSizeZ)];
+    ++s_MetalDispatchCount;
+    return SmolResult::Success;
+}
+
+SmolResult SmolKernelDispatchIndirect(SmolBuffer* argsBuffer, size_t argsOffset, int groupSizeX, int groupSizeY, int groupSizeZ)
+{
+    SMOL_ASSERT(s_MetalComputeEncoder != nil);
+    SMOL_ASSERT(argsBuffer != nullptr);
+    SMOL_ASSERT(argsOffset % 4 == 0 && argsOffset + 12 <= argsBuffer->size);
+    [s_MetalComputeEncoder dispatchThreadgroupsWithIndirectBuffer:argsBuffer->buffer indirectBufferOffset:argsOffset threadsPerThreadgroup:MTLSizeMake(groupSizeX,groupSizeY,groupSizeZ)];
+    ++s_MetalDispatchCount;
+    return SmolResult::Success;
+}
+
+SmolKernelStats SmolKernelGetStats(SmolKernel* kernel)
+{
+    return SmolKernelStats();
+}
+
+void SmolProfileBegin(const char* name)
+{
+}
+
+void SmolProfileEnd()
+{
+}
+
+int SmolProfileGetResults(SmolProfileResult* results, int maxResults)
+{
+    return 0;
 }
 
 void SmolCaptureStart()
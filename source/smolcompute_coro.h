@@ -0,0 +1,120 @@
+// Copyright (c) 2020, Aras Pranckevicius
+// SPDX-License-Identifier: MIT
+
+#ifndef SMOL_COMPUTE_CORO_INCLUDED
+#define SMOL_COMPUTE_CORO_INCLUDED
+
+// smol-compute coroutine layer: C++20 awaitables for GPU work, on top of smolcompute.h.
+// This is optional; include it (instead of, or after smolcompute.h) from C++20 code that uses coroutines.
+//
+//   co_await SmolSubmitAsync();               // submit current context work, resume once GPU is done with it
+//   co_await SmolFenceAsync(fence);           // resume once the fence is complete
+//   co_await SmolReadAsync(buffer, span);     // read buffer data into span, resume once it is there
+//
+// A coroutine suspends instead of blocking its thread, so many requests can be in flight on a few
+// threads. Awaiting builds on completion callbacks (SmolFenceOnComplete, SmolReadbackOnComplete), so
+// the coroutine is resumed on the thread that calls them: on Vulkan that is the library completion
+// thread. Keep the work done there short, e.g. reschedule onto your own executor after resuming, and
+// set a context (SmolContextSetCurrent) before recording GPU work from a resumed coroutine.
+
+#include "smolcompute.h"
+#include <atomic>
+#include <coroutine>
+#include <span>
+#include <thread>
+
+
+// Shared by the awaitables: resumes the coroutine from a completion callback. The callback can also
+// be called right away from within await_suspend, in which case the coroutine does not suspend at all.
+struct SmolImpl_CoroCompletion
+{
+    std::coroutine_handle<> handle;
+    std::atomic<int> state { 0 }; // 1: completed, 2: suspended
+
+    static void OnComplete(void* userData)
+    {
+        SmolImpl_CoroCompletion* self = (SmolImpl_CoroCompletion*)userData;
+        if (self->state.exchange(1) == 2)
+            self->handle.resume();
+    }
+    // Called after the completion callback is registered; returns whether the coroutine should stay suspended.
+    bool Suspend()
+    {
+        return state.exchange(2) != 1;
+    }
+};
+
+struct SmolFenceAwaitable : SmolImpl_CoroCompletion
+{
+    SmolFence fence;
+
+    explicit SmolFenceAwaitable(SmolFence f) : fence(f) {}
+    bool await_ready() const { return SmolFenceIsComplete(fence); }
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        handle = h;
+        SmolFenceOnComplete(fence, OnComplete, this);
+        return Suspend();
+    }
+    SmolFence await_resume() const { return fence; }
+};
+
+struct SmolReadAwaitable : SmolImpl_CoroCompletion
+{
+    SmolReadback* readback;
+
+    explicit SmolReadAwaitable(SmolReadback* r) : readback(r) {}
+    SmolReadAwaitable(const SmolReadAwaitable&) = delete;
+    SmolReadAwaitable& operator=(const SmolReadAwaitable&) = delete;
+    ~SmolReadAwaitable() { SmolReadbackDelete(readback); }
+    bool await_ready() const { return readback == nullptr || SmolReadbackIsComplete(readback); }
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        handle = h;
+        SmolReadbackOnComplete(readback, OnComplete, this);
+        return Suspend();
+    }
+    // Returns false if the readback could not be started.
+    bool await_resume() const { return readback != nullptr; }
+};
+
+// Submit work of the current context; with non-blocking backpressure limits, retry until it is
+// submitted, since the awaitables need the work on the GPU to ever complete.
+inline SmolFence SmolImpl_CoroFlush()
+{
+    SmolResult result;
+    SmolFence fence = SmolComputeFlush(&result);
+    while (result == SmolResult::WouldBlock)
+    {
+        std::this_thread::yield();
+        fence = SmolComputeFlush(&result);
+    }
+    return fence;
+}
+
+// Resume once the fence is complete. Result of co_await is the fence.
+inline SmolFenceAwaitable SmolFenceAsync(SmolFence fence)
+{
+    return SmolFenceAwaitable(fence);
+}
+
+// Submit work recorded so far in the current context (SmolComputeFlush), and resume once the GPU has
+// finished it. Result of co_await is the fence of the submitted work. Under non-blocking backpressure
+// limits, this waits (without suspending) until the work can be submitted.
+inline SmolFenceAwaitable SmolSubmitAsync()
+{
+    return SmolFenceAwaitable(SmolImpl_CoroFlush());
+}
+
+// Read buffer data (starting at srcOffset bytes) into dst, and resume once the data is there. Work
+// recorded in the current context so far, including the read itself, is submitted. Result of co_await
+// is whether the read succeeded. dst has to stay valid until the coroutine is resumed.
+template<typename T>
+inline SmolReadAwaitable SmolReadAsync(SmolBuffer* buffer, std::span<T> dst, size_t srcOffset = 0)
+{
+    SmolReadback* readback = SmolBufferGetDataAsync(buffer, dst.data(), dst.size_bytes(), srcOffset);
+    SmolImpl_CoroFlush();
+    return SmolReadAwaitable(readback);
+}
+
+#endif // #ifndef SMOL_COMPUTE_CORO_INCLUDED
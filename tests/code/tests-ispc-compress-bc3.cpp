@@ -506,7 +506,7 @@ static void* ReadFile(const char* path, size_t* outSize)
     return buffer;
 }
 
-bool IspcCompressBC3Test()
+bool IspcCompressBC3Test(bool checkStats)
 {
     bool ok = false;
 
@@ -530,6 +530,7 @@ bool IspcCompressBC3Test()
     SmolBuffer *bufInput = nullptr, *bufOutput = nullptr, *bufGlobals = nullptr;
     SmolKernel *cs = nullptr;
     uint64_t tStart = 0, tDur = 0;
+    uint64_t profiledNs = 0;
 
     int inputWidth = 0, inputHeight = 0;
     stbi_set_flip_vertically_on_load(1);
@@ -590,6 +591,44 @@ bool IspcCompressBC3Test()
         SmolBufferGetData(bufOutput, outputData, outputSize, 0);
         tDur = stm_since(tStart);
         printf("  BC3 set+compress+get for %ix%i took %.1fms\n", glob.image_width, glob.image_height, stm_ms(tDur));
+
+        if (checkStats)
+        {
+            SmolProfileResult profile[4];
+            int profileCount = SmolProfileGetResults(profile, 4);
+            for (int j = 0; j < profileCount; ++j)
+            {
+                printf("    GPU %s took %.3fms\n", profile[j].name, profile[j].durationNs / 1.0e6);
+                profiledNs += profile[j].durationNs;
+            }
+        }
+    }
+    if (checkStats && backend == SmolBackend::Vulkan)
+    {
+        // results come back asynchronously; all the work is done by now
+        SmolFenceWait(SmolComputeFlush());
+        SmolProfileResult profile[4];
+        int profileCount;
+        while ((profileCount = SmolProfileGetResults(profile, 4)) > 0)
+        {
+            for (int j = 0; j < profileCount; ++j)
+                profiledNs += profile[j].durationNs;
+        }
+        if (profiledNs == 0)
+        {
+            printf("ERROR: IspcCompressBC3Test: no GPU profiling results\n");
+            goto _cleanup;
+        }
+
+        SmolKernelStats stats = SmolKernelGetStats(cs);
+        const uint64_t expectedThreads = uint64_t(inputWidth) * inputHeight * 5;
+        printf("  BC3 kernel: %i dispatches, %.0f threads requested, %.0f invoked\n", (int)stats.dispatchCount, (double)stats.requestedThreads, (double)stats.invocations);
+        // zero dispatches measured means device does not support pipeline statistics queries
+        if (stats.dispatchCount != 0 && (stats.dispatchCount != 5 || stats.requestedThreads != expectedThreads || stats.invocations < stats.requestedThreads))
+        {
+            printf("ERROR: IspcCompressBC3Test: unexpected kernel invocation stats\n");
+            goto _cleanup;
+        }
     }
     
     // CPU eval test
@@ -3,9 +3,168 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <atomic>
+#include <future>
+#include <thread>
+#include <vector>
 
 #include "external/sokol_time.h"
 
+// Kernel that adds a constant, set with SmolKernelSetConstants, to each input value.
+static SmolKernel* CreateConstantsKernel(SmolBackend backend)
+{
+    if (backend == SmolBackend::D3D11)
+    {
+        const char* code = R"(
+cbuffer Constants : register(b0) { uint add; };
+StructuredBuffer<uint> bufInput : register(t0);
+RWStructuredBuffer<uint> bufOutput : register(u1);
+[numthreads(16, 1, 1)]
+void kernelFunc(uint3 gid : SV_DispatchThreadID)
+{
+    bufOutput[gid.x] = bufInput[gid.x] + add;
+})";
+        return SmolKernelCreate(code, strlen(code), "kernelFunc");
+    }
+    if (backend == SmolBackend::Metal)
+    {
+        const char* code = R"(
+kernel void kernelFunc(
+    const device uint* bufInput [[buffer(0)]],
+    device uint* bufOutput [[buffer(1)]],
+    constant uint& add [[buffer(2)]],
+    uint2 gid [[thread_position_in_grid]])
+{
+    bufOutput[gid.x] = bufInput[gid.x] + add;
+})";
+        return SmolKernelCreate(code, strlen(code), "kernelFunc");
+    }
+    // same shader in SPIR-V, with the constant in a push constant block (hand assembled)
+    static const uint8_t arr[796] = {
+          0x03,0x02,0x23,0x07,0x00,0x00,0x01,0x00,0x00,0x00,0x00,0x00,0x1f,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+          0x11,0x00,0x02,0x00,0x01,0x00,0x00,0x00,0x0e,0x00,0x03,0x00,0x00,0x00,0x00,0x00,0x01,0x00,0x00,0x00,
+          0x0f,0x00,0x07,0x00,0x05,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x6b,0x65,0x72,0x6e,0x65,0x6c,0x46,0x75,
+          0x6e,0x63,0x00,0x00,0x02,0x00,0x00,0x00,0x10,0x00,0x06,0x00,0x01,0x00,0x00,0x00,0x11,0x00,0x00,0x00,
+          0x10,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x47,0x00,0x04,0x00,0x02,0x00,0x00,0x00,
+          0x0b,0x00,0x00,0x00,0x1c,0x00,0x00,0x00,0x47,0x00,0x04,0x00,0x09,0x00,0x00,0x00,0x06,0x00,0x00,0x00,
+          0x04,0x00,0x00,0x00,0x48,0x00,0x04,0x00,0x0a,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x18,0x00,0x00,0x00,
+          0x48,0x00,0x05,0x00,0x0a,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x23,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+          0x47,0x00,0x03,0x00,0x0a,0x00,0x00,0x00,0x03,0x00,0x00,0x00,0x48,0x00,0x05,0x00,0x0b,0x00,0x00,0x00,
+          0x00,0x00,0x00,0x00,0x23,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x47,0x00,0x03,0x00,0x0b,0x00,0x00,0x00,
+          0x03,0x00,0x00,0x00,0x47,0x00,0x04,0x00,0x0f,0x00,0x00,0x00,0x22,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+          0x47,0x00,0x04,0x00,0x0f,0x00,0x00,0x00,0x21,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x47,0x00,0x04,0x00,
+          0x10,0x00,0x00,0x00,0x22,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x47,0x00,0x04,0x00,0x10,0x00,0x00,0x00,
+          0x21,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x48,0x00,0x05,0x00,0x12,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+          0x23,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x47,0x00,0x03,0x00,0x12,0x00,0x00,0x00,0x02,0x00,0x00,0x00,
+          0x13,0x00,0x02,0x00,0x03,0x00,0x00,0x00,0x21,0x00,0x03,0x00,0x04,0x00,0x00,0x00,0x03,0x00,0x00,0x00,
+          0x15,0x00,0x04,0x00,0x05,0x00,0x00,0x00,0x20,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x15,0x00,0x04,0x00,
+          0x06,0x00,0x00,0x00,0x20,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x17,0x00,0x04,0x00,0x07,0x00,0x00,0x00,
+          0x05,0x00,0x00,0x00,0x03,0x00,0x00,0x00,0x20,0x00,0x04,0x00,0x08,0x00,0x00,0x00,0x01,0x00,0x00,0x00,
+          0x07,0x00,0x00,0x00,0x1d,0x00,0x03,0x00,0x09,0x00,0x00,0x00,0x05,0x00,0x00,0x00,0x1e,0x00,0x03,0x00,
+          0x0a,0x00,0x00,0x00,0x09,0x00,0x00,0x00,0x1e,0x00,0x03,0x00,0x0b,0x00,0x00,0x00,0x09,0x00,0x00,0x00,
+          0x20,0x00,0x04,0x00,0x0c,0x00,0x00,0x00,0x02,0x00,0x00,0x00,0x0a,0x00,0x00,0x00,0x20,0x00,0x04,0x00,
+          0x0d,0x00,0x00,0x00,0x02,0x00,0x00,0x00,0x0b,0x00,0x00,0x00,0x20,0x00,0x04,0x00,0x0e,0x00,0x00,0x00,
+          0x02,0x00,0x00,0x00,0x05,0x00,0x00,0x00,0x2b,0x00,0x04,0x00,0x06,0x00,0x00,0x00,0x11,0x00,0x00,0x00,
+          0x00,0x00,0x00,0x00,0x1e,0x00,0x03,0x00,0x12,0x00,0x00,0x00,0x05,0x00,0x00,0x00,0x20,0x00,0x04,0x00,
+          0x13,0x00,0x00,0x00,0x09,0x00,0x00,0x00,0x12,0x00,0x00,0x00,0x20,0x00,0x04,0x00,0x14,0x00,0x00,0x00,
+          0x09,0x00,0x00,0x00,0x05,0x00,0x00,0x00,0x3b,0x00,0x04,0x00,0x08,0x00,0x00,0x00,0x02,0x00,0x00,0x00,
+          0x01,0x00,0x00,0x00,0x3b,0x00,0x04,0x00,0x0c,0x00,0x00,0x00,0x0f,0x00,0x00,0x00,0x02,0x00,0x00,0x00,
+          0x3b,0x00,0x04,0x00,0x0d,0x00,0x00,0x00,0x10,0x00,0x00,0x00,0x02,0x00,0x00,0x00,0x3b,0x00,0x04,0x00,
+          0x13,0x00,0x00,0x00,0x15,0x00,0x00,0x00,0x09,0x00,0x00,0x00,0x36,0x00,0x05,0x00,0x03,0x00,0x00,0x00,
+          0x01,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x04,0x00,0x00,0x00,0xf8,0x00,0x02,0x00,0x16,0x00,0x00,0x00,
+          0x3d,0x00,0x04,0x00,0x07,0x00,0x00,0x00,0x17,0x00,0x00,0x00,0x02,0x00,0x00,0x00,0x51,0x00,0x05,0x00,
+          0x05,0x00,0x00,0x00,0x18,0x00,0x00,0x00,0x17,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x41,0x00,0x06,0x00,
+          0x0e,0x00,0x00,0x00,0x19,0x00,0x00,0x00,0x0f,0x00,0x00,0x00,0x11,0x00,0x00,0x00,0x18,0x00,0x00,0x00,
+          0x3d,0x00,0x04,0x00,0x05,0x00,0x00,0x00,0x1a,0x00,0x00,0x00,0x19,0x00,0x00,0x00,0x41,0x00,0x05,0x00,
+          0x14,0x00,0x00,0x00,0x1b,0x00,0x00,0x00,0x15,0x00,0x00,0x00,0x11,0x00,0x00,0x00,0x3d,0x00,0x04,0x00,
+          0x05,0x00,0x00,0x00,0x1c,0x00,0x00,0x00,0x1b,0x00,0x00,0x00,0x80,0x00,0x05,0x00,0x05,0x00,0x00,0x00,
+          0x1d,0x00,0x00,0x00,0x1a,0x00,0x00,0x00,0x1c,0x00,0x00,0x00,0x41,0x00,0x06,0x00,0x0e,0x00,0x00,0x00,
+          0x1e,0x00,0x00,0x00,0x10,0x00,0x00,0x00,0x11,0x00,0x00,0x00,0x18,0x00,0x00,0x00,0x3e,0x00,0x03,0x00,
+          0x1e,0x00,0x00,0x00,0x1d,0x00,0x00,0x00,0xfd,0x00,0x01,0x00,0x38,0x00,0x01,0x00 };
+    return SmolKernelCreate(arr, sizeof(arr), "kernelFunc");
+}
+
+// Kernel that multiplies each input value by specialization constant 0; work group size is
+// specialization constant 1.
+static SmolKernel* CreateSpecializedKernel(SmolBackend backend, int multiplier, int groupSize)
+{
+    const SmolKernelSpecialization specs[] = { SmolKernelSpecialization(0, multiplier), SmolKernelSpecialization(1, groupSize) };
+    if (backend == SmolBackend::D3D11)
+    {
+        const char* code = R"(
+#ifndef SMOL_SPEC_0
+#define SMOL_SPEC_0 1
+#endif
+#ifndef SMOL_SPEC_1
+#define SMOL_SPEC_1 1
+#endif
+StructuredBuffer<uint> bufInput : register(t0);
+RWStructuredBuffer<uint> bufOutput : register(u1);
+[numthreads(SMOL_SPEC_1, 1, 1)]
+void kernelFunc(uint3 gid : SV_DispatchThreadID)
+{
+    bufOutput[gid.x] = bufInput[gid.x] * SMOL_SPEC_0;
+})";
+        return SmolKernelCreate(code, strlen(code), "kernelFunc", specs, 2);
+    }
+    if (backend == SmolBackend::Metal)
+    {
+        const char* code = R"(
+constant int kMultiplier [[function_constant(0)]];
+kernel void kernelFunc(
+    const device uint* bufInput [[buffer(0)]],
+    device uint* bufOutput [[buffer(1)]],
+    uint2 gid [[thread_position_in_grid]])
+{
+    bufOutput[gid.x] = bufInput[gid.x] * kMultiplier;
+})";
+        return SmolKernelCreate(code, strlen(code), "kernelFunc", specs, 2);
+    }
+    // same shader in SPIR-V: constant_id 0, and local_size_x_id 1 as a WorkgroupSize built-in (hand assembled)
+    static const uint8_t arr[788] = {
+          0x03,0x02,0x23,0x07,0x00,0x00,0x01,0x00,0x00,0x00,0x00,0x00,0x1d,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+          0x11,0x00,0x02,0x00,0x01,0x00,0x00,0x00,0x0e,0x00,0x03,0x00,0x00,0x00,0x00,0x00,0x01,0x00,0x00,0x00,
+          0x0f,0x00,0x07,0x00,0x05,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x6b,0x65,0x72,0x6e,0x65,0x6c,0x46,0x75,
+          0x6e,0x63,0x00,0x00,0x02,0x00,0x00,0x00,0x10,0x00,0x06,0x00,0x01,0x00,0x00,0x00,0x11,0x00,0x00,0x00,
+          0x01,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x47,0x00,0x04,0x00,0x02,0x00,0x00,0x00,
+          0x0b,0x00,0x00,0x00,0x1c,0x00,0x00,0x00,0x47,0x00,0x04,0x00,0x09,0x00,0x00,0x00,0x06,0x00,0x00,0x00,
+          0x04,0x00,0x00,0x00,0x48,0x00,0x04,0x00,0x0a,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x18,0x00,0x00,0x00,
+          0x48,0x00,0x05,0x00,0x0a,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x23,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+          0x47,0x00,0x03,0x00,0x0a,0x00,0x00,0x00,0x03,0x00,0x00,0x00,0x48,0x00,0x05,0x00,0x0b,0x00,0x00,0x00,
+          0x00,0x00,0x00,0x00,0x23,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x47,0x00,0x03,0x00,0x0b,0x00,0x00,0x00,
+          0x03,0x00,0x00,0x00,0x47,0x00,0x04,0x00,0x0f,0x00,0x00,0x00,0x22,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+          0x47,0x00,0x04,0x00,0x0f,0x00,0x00,0x00,0x21,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x47,0x00,0x04,0x00,
+          0x10,0x00,0x00,0x00,0x22,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x47,0x00,0x04,0x00,0x10,0x00,0x00,0x00,
+          0x21,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x47,0x00,0x04,0x00,0x12,0x00,0x00,0x00,0x01,0x00,0x00,0x00,
+          0x00,0x00,0x00,0x00,0x47,0x00,0x04,0x00,0x13,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x01,0x00,0x00,0x00,
+          0x47,0x00,0x04,0x00,0x15,0x00,0x00,0x00,0x0b,0x00,0x00,0x00,0x19,0x00,0x00,0x00,0x13,0x00,0x02,0x00,
+          0x03,0x00,0x00,0x00,0x21,0x00,0x03,0x00,0x04,0x00,0x00,0x00,0x03,0x00,0x00,0x00,0x15,0x00,0x04,0x00,
+          0x05,0x00,0x00,0x00,0x20,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x15,0x00,0x04,0x00,0x06,0x00,0x00,0x00,
+          0x20,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x17,0x00,0x04,0x00,0x07,0x00,0x00,0x00,0x05,0x00,0x00,0x00,
+          0x03,0x00,0x00,0x00,0x20,0x00,0x04,0x00,0x08,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x07,0x00,0x00,0x00,
+          0x1d,0x00,0x03,0x00,0x09,0x00,0x00,0x00,0x05,0x00,0x00,0x00,0x1e,0x00,0x03,0x00,0x0a,0x00,0x00,0x00,
+          0x09,0x00,0x00,0x00,0x1e,0x00,0x03,0x00,0x0b,0x00,0x00,0x00,0x09,0x00,0x00,0x00,0x20,0x00,0x04,0x00,
+          0x0c,0x00,0x00,0x00,0x02,0x00,0x00,0x00,0x0a,0x00,0x00,0x00,0x20,0x00,0x04,0x00,0x0d,0x00,0x00,0x00,
+          0x02,0x00,0x00,0x00,0x0b,0x00,0x00,0x00,0x20,0x00,0x04,0x00,0x0e,0x00,0x00,0x00,0x02,0x00,0x00,0x00,
+          0x05,0x00,0x00,0x00,0x2b,0x00,0x04,0x00,0x06,0x00,0x00,0x00,0x11,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+          0x32,0x00,0x04,0x00,0x05,0x00,0x00,0x00,0x12,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x32,0x00,0x04,0x00,
+          0x05,0x00,0x00,0x00,0x13,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x2b,0x00,0x04,0x00,0x05,0x00,0x00,0x00,
+          0x14,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x33,0x00,0x06,0x00,0x07,0x00,0x00,0x00,0x15,0x00,0x00,0x00,
+          0x13,0x00,0x00,0x00,0x14,0x00,0x00,0x00,0x14,0x00,0x00,0x00,0x3b,0x00,0x04,0x00,0x08,0x00,0x00,0x00,
+          0x02,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x3b,0x00,0x04,0x00,0x0c,0x00,0x00,0x00,0x0f,0x00,0x00,0x00,
+          0x02,0x00,0x00,0x00,0x3b,0x00,0x04,0x00,0x0d,0x00,0x00,0x00,0x10,0x00,0x00,0x00,0x02,0x00,0x00,0x00,
+          0x36,0x00,0x05,0x00,0x03,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x04,0x00,0x00,0x00,
+          0xf8,0x00,0x02,0x00,0x16,0x00,0x00,0x00,0x3d,0x00,0x04,0x00,0x07,0x00,0x00,0x00,0x17,0x00,0x00,0x00,
+          0x02,0x00,0x00,0x00,0x51,0x00,0x05,0x00,0x05,0x00,0x00,0x00,0x18,0x00,0x00,0x00,0x17,0x00,0x00,0x00,
+          0x00,0x00,0x00,0x00,0x41,0x00,0x06,0x00,0x0e,0x00,0x00,0x00,0x19,0x00,0x00,0x00,0x0f,0x00,0x00,0x00,
+          0x11,0x00,0x00,0x00,0x18,0x00,0x00,0x00,0x3d,0x00,0x04,0x00,0x05,0x00,0x00,0x00,0x1a,0x00,0x00,0x00,
+          0x19,0x00,0x00,0x00,0x84,0x00,0x05,0x00,0x05,0x00,0x00,0x00,0x1b,0x00,0x00,0x00,0x1a,0x00,0x00,0x00,
+          0x12,0x00,0x00,0x00,0x41,0x00,0x06,0x00,0x0e,0x00,0x00,0x00,0x1c,0x00,0x00,0x00,0x10,0x00,0x00,0x00,
+          0x11,0x00,0x00,0x00,0x18,0x00,0x00,0x00,0x3e,0x00,0x03,0x00,0x1c,0x00,0x00,0x00,0x1b,0x00,0x00,0x00,
+          0xfd,0x00,0x01,0x00,0x38,0x00,0x01,0x00 };
+    return SmolKernelCreate(arr, sizeof(arr), "kernelFunc", specs, 2);
+}
+
 static bool SmokeTest()
 {
     bool ok = false;
@@ -13,7 +172,14 @@ static bool SmokeTest()
     SmolBuffer* bufInput = nullptr;
     SmolBuffer* bufMid = nullptr;
     SmolBuffer* bufOutput = nullptr;
+    SmolBuffer* bufArgs = nullptr;
     SmolKernel* cs = nullptr;
+    SmolKernel* csConstants = nullptr;
+    SmolKernel* csSpec[3] = {};
+    SmolContext* context = nullptr;
+    SmolCommandList* list = nullptr;
+    SmolFence fence;
+    SmolReadback* readback = nullptr;
     const char* kernelCode = nullptr;
     size_t kernelCodeSize = 0;
     const SmolBackend backend = SmolComputeGetBackend();
@@ -23,8 +189,8 @@ static bool SmokeTest()
     const int kMidSize = kInputSize / kGroupSize;
     const int kOutputSize = kMidSize / kGroupSize;
     bufInput = SmolBufferCreate(kInputSize*4, SmolBufferType::Structured, 4);
-    bufMid = SmolBufferCreate(kMidSize * 4, SmolBufferType::Structured, 4);
-    bufOutput = SmolBufferCreate(kOutputSize*4, SmolBufferType::Structured, 4);
+    bufMid = SmolBufferCreate(kMidSize * 4, SmolBufferType::Structured, 4, SmolBufferUsage::GpuOnly);
+    bufOutput = SmolBufferCreate(kOutputSize*4, SmolBufferType::Structured, 4, SmolBufferUsage::Readback);
     int input[kInputSize];
     for (int i = 0; i < kInputSize; ++i)
         input[i] = i * 17;
@@ -182,24 +348,598 @@ kernel void kernelFunc(
         goto _cleanup;
     }
     
+    // mapped buffer should see the same results
+    const int* mapped;
+    mapped = (const int*)SmolBufferMap(bufOutput, SmolBufferMapAccess::Read);
+    if (mapped == nullptr || memcmp(mapped, outputCheck, sizeof(outputCheck)) != 0)
+    {
+        printf("ERROR: SmokeTest: mapped buffer did not contain expected data\n");
+        if (mapped != nullptr)
+            SmolBufferUnmap(bufOutput);
+        goto _cleanup;
+    }
+    SmolBufferUnmap(bufOutput);
+
+    // dispatch on second half of input data, bound as a buffer range
+    SmolKernelSet(cs);
+    SmolKernelSetBufferRange(bufInput, 0, kInputSize/2*4, kInputSize/2*4);
+    SmolKernelSetBuffer(bufMid, 1, SmolBufferBinding::Output);
+    SmolKernelDispatch(kMidSize/2, 1, 1, kGroupSize, 1, 1);
+    // submit explicitly, and wait for the GPU to finish before reading the results
+    fence = SmolComputeFlush();
+    if (!SmolFenceWait(fence) || !SmolFenceIsComplete(fence))
+    {
+        printf("ERROR: SmokeTest: fence did not complete after waiting on it\n");
+        goto _cleanup;
+    }
+    if (backend == SmolBackend::Vulkan && (SmolComputeGetSubmitStats().submitCount == 0 || SmolComputeGetSubmitStats().queueDepth != 0))
+    {
+        printf("ERROR: SmokeTest: submit stats do not match submitted work\n");
+        goto _cleanup;
+    }
+    int midOutput[kMidSize/2];
+    SmolBufferGetData(bufMid, midOutput, sizeof(midOutput));
+    if (memcmp(midOutput, midCheck + kMidSize/2, sizeof(midOutput)) != 0)
+    {
+        printf("ERROR: SmokeTest: compute shader on buffer range did not produce expected data\n");
+        goto _cleanup;
+    }
+
+    // constants set for the dispatch are added to input values
+    csConstants = CreateConstantsKernel(backend);
+    if (csConstants == nullptr)
+    {
+        printf("ERROR: SmokeTest: failed to create compute shader with constants\n");
+        goto _cleanup;
+    }
+    {
+        const uint32_t add = 1000;
+        SmolKernelSet(csConstants);
+        SmolKernelSetBuffer(bufInput, 0);
+        SmolKernelSetBuffer(bufMid, 1, SmolBufferBinding::Output);
+        SmolKernelSetConstants(&add, sizeof(add), backend == SmolBackend::Metal ? 2 : 0);
+        SmolKernelDispatch(kMidSize, 1, 1, kGroupSize, 1, 1);
+        int midConstants[kMidSize];
+        SmolBufferGetData(bufMid, midConstants, sizeof(midConstants));
+        for (int i = 0; i < kMidSize; ++i)
+        {
+            if (midConstants[i] != input[i] + (int)add)
+            {
+                printf("ERROR: SmokeTest: compute shader with constants did not produce expected data\n");
+                goto _cleanup;
+            }
+        }
+    }
+
+    // specialized kernel variants: same values share a kernel (on Vulkan), which stays alive until
+    // deleted as many times as created; output depends on the specialization value
+    csSpec[0] = CreateSpecializedKernel(backend, 3, kGroupSize);
+    csSpec[1] = CreateSpecializedKernel(backend, 3, kGroupSize);
+    csSpec[2] = CreateSpecializedKernel(backend, 5, kGroupSize);
+    if (csSpec[0] == nullptr || csSpec[1] == nullptr || csSpec[2] == nullptr)
+    {
+        printf("ERROR: SmokeTest: failed to create specialized compute shaders\n");
+        goto _cleanup;
+    }
+    if (backend == SmolBackend::Vulkan && (csSpec[0] != csSpec[1] || csSpec[0] == csSpec[2]))
+    {
+        printf("ERROR: SmokeTest: specialized compute shader variants are not shared as expected\n");
+        goto _cleanup;
+    }
+    SmolKernelDelete(csSpec[1]);
+    csSpec[1] = nullptr;
+    for (int variant = 0; variant < 3; variant += 2)
+    {
+        const int multiplier = variant == 0 ? 3 : 5;
+        SmolKernelSet(csSpec[variant]);
+        SmolKernelSetBuffer(bufInput, 0);
+        SmolKernelSetBuffer(bufMid, 1, SmolBufferBinding::Output);
+        SmolKernelDispatch(kMidSize, 1, 1, kGroupSize, 1, 1);
+        int midSpec[kMidSize];
+        SmolBufferGetData(bufMid, midSpec, sizeof(midSpec));
+        for (int i = 0; i < kMidSize; ++i)
+        {
+            if (midSpec[i] != input[i] * multiplier)
+            {
+                printf("ERROR: SmokeTest: specialized compute shader did not produce expected data\n");
+                goto _cleanup;
+            }
+        }
+    }
+
+    // indirect dispatch, with thread group counts uploaded to the GPU
+    {
+        const uint32_t args[3] = { kMidSize / kGroupSize, 1, 1 };
+        bufArgs = SmolBufferCreate(sizeof(args), SmolBufferType::Indirect, 0, SmolBufferUsage::GpuOnly);
+        SmolBufferSetData(bufArgs, args, sizeof(args));
+        int midIndirect[kMidSize] = {};
+        SmolBufferSetData(bufMid, midIndirect, sizeof(midIndirect));
+        SmolKernelSet(cs);
+        SmolKernelSetBuffer(bufInput, 0);
+        SmolKernelSetBuffer(bufMid, 1, SmolBufferBinding::Output);
+        SmolKernelDispatchIndirect(bufArgs, 0, kGroupSize, 1, 1);
+        SmolBufferGetData(bufMid, midIndirect, sizeof(midIndirect));
+        if (memcmp(midIndirect, midCheck, sizeof(midIndirect)) != 0)
+        {
+            printf("ERROR: SmokeTest: indirect dispatch did not produce expected data\n");
+            goto _cleanup;
+        }
+    }
+
+    // same dispatch recorded into a separate context
+    context = SmolContextCreate();
+    SmolContextSetCurrent(context);
+    SmolKernelSet(cs);
+    SmolKernelSetBuffer(bufInput, 0);
+    SmolKernelSetBuffer(bufMid, 1, SmolBufferBinding::Output);
+    SmolKernelDispatch(kInputSize, 1, 1, kGroupSize, 1, 1);
+    SmolContextFlush();
+    int midContext[kMidSize];
+    SmolBufferGetData(bufMid, midContext, sizeof(midContext));
+    if (memcmp(midContext, midCheck, sizeof(midContext)) != 0)
+    {
+        SmolContextSetCurrent(nullptr);
+        printf("ERROR: SmokeTest: compute shader in a separate context did not produce expected data\n");
+        goto _cleanup;
+    }
+
+    // flush policy submits each dispatch on its own, without flushing explicitly
+    {
+        SmolFlushPolicy policy;
+        policy.maxDispatches = 1;
+        SmolContextSetFlushPolicy(context, policy);
+        const uint64_t submitsBefore = SmolComputeGetSubmitStats().submitCount;
+        memset(output, 0, sizeof(output));
+        SmolBufferSetData(bufOutput, output, sizeof(output));
+        SmolKernelSet(cs);
+        SmolKernelSetBuffer(bufInput, 0);
+        SmolKernelSetBuffer(bufMid, 1, SmolBufferBinding::Output);
+        SmolKernelDispatch(kInputSize, 1, 1, kGroupSize, 1, 1);
+        SmolKernelSet(cs);
+        SmolKernelSetBuffer(bufMid, 0);
+        SmolKernelSetBuffer(bufOutput, 1, SmolBufferBinding::Output);
+        SmolKernelDispatch(kMidSize, 1, 1, kGroupSize, 1, 1);
+        SmolFenceWait(SmolComputeFlush());
+        SmolBufferGetData(bufOutput, output, sizeof(output));
+        SmolContextSetCurrent(nullptr);
+        if (memcmp(output, outputCheck, sizeof(output)) != 0 || (backend == SmolBackend::Vulkan && SmolComputeGetSubmitStats().submitCount < submitsBefore + 2))
+        {
+            printf("ERROR: SmokeTest: flush policy did not submit expected work\n");
+            goto _cleanup;
+        }
+    }
+
+    // backpressure: with at most one batch in flight, non-blocking flushes go through once the GPU catches up
+    {
+        SmolBackpressureLimits limits;
+        limits.maxInFlightBatches = 1;
+        limits.nonBlocking = true;
+        SmolComputeSetBackpressureLimits(limits);
+        memset(output, 0, sizeof(output));
+        SmolBufferSetData(bufOutput, output, sizeof(output));
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            SmolKernelSet(cs);
+            SmolKernelSetBuffer(pass == 0 ? bufInput : bufMid, 0);
+            SmolKernelSetBuffer(pass == 0 ? bufMid : bufOutput, 1, SmolBufferBinding::Output);
+            SmolKernelDispatch(pass == 0 ? kInputSize : kMidSize, 1, 1, kGroupSize, 1, 1);
+            SmolResult result;
+            while (fence = SmolComputeFlush(&result), result == SmolResult::WouldBlock)
+                std::this_thread::yield();
+        }
+        SmolComputeSetBackpressureLimits(SmolBackpressureLimits());
+        SmolFenceWait(fence);
+        SmolBufferGetData(bufOutput, output, sizeof(output));
+        if (memcmp(output, outputCheck, sizeof(output)) != 0)
+        {
+            printf("ERROR: SmokeTest: work submitted under backpressure limits did not produce expected data\n");
+            goto _cleanup;
+        }
+    }
+    SmolContextDelete(context);
+    context = nullptr;
+
+    // asynchronous readback gets the data at the point it was recorded, even if later work overwrites it
+    memset(midContext, 0, sizeof(midContext));
+    readback = SmolBufferGetDataAsync(bufMid, midContext, sizeof(midContext));
+    SmolKernelSet(cs);
+    SmolKernelSetBufferRange(bufInput, 0, kInputSize/2*4, kInputSize/2*4);
+    SmolKernelSetBuffer(bufMid, 1, SmolBufferBinding::Output);
+    SmolKernelDispatch(kMidSize/2, 1, 1, kGroupSize, 1, 1);
+    SmolComputeFlush();
+    if (readback == nullptr || !SmolReadbackWait(readback) || !SmolReadbackIsComplete(readback) || memcmp(midContext, midCheck, sizeof(midContext)) != 0)
+    {
+        printf("ERROR: SmokeTest: asynchronous readback did not produce expected data\n");
+        goto _cleanup;
+    }
+    SmolReadbackDelete(readback);
+    readback = nullptr;
+
+    // completion callback fulfils a promise once the readback data is in place
+    {
+        std::promise<void> completed;
+        std::future<void> completedFuture = completed.get_future();
+        memset(midContext, 0, sizeof(midContext));
+        readback = SmolBufferGetDataAsync(bufMid, midContext, kMidSize/2*4, kMidSize/2*4);
+        if (readback == nullptr)
+        {
+            printf("ERROR: SmokeTest: failed to start asynchronous readback\n");
+            goto _cleanup;
+        }
+        SmolReadbackOnComplete(readback, [](void* userData) { ((std::promise<void>*)userData)->set_value(); }, &completed);
+        SmolComputeFlush();
+        completedFuture.wait();
+        if (memcmp(midContext, midCheck + kMidSize/2, kMidSize/2*4) != 0)
+        {
+            printf("ERROR: SmokeTest: readback completion callback did not see expected data\n");
+            goto _cleanup;
+        }
+        SmolReadbackDelete(readback);
+        readback = nullptr;
+    }
+
+    // both dispatches recorded in parallel, each by its own thread; parts execute in order
+    memset(output, 0, sizeof(output));
+    SmolBufferSetData(bufOutput, output, sizeof(output));
+    if (SmolContextBeginParts(nullptr, 2))
+    {
+        SmolContext* mainContext = SmolContextGetCurrent();
+        std::thread threads[2];
+        for (int part = 0; part < 2; ++part)
+        {
+            threads[part] = std::thread([&, part]()
+            {
+                SmolContextSetCurrent(SmolContextGetPart(mainContext, part));
+                SmolKernelSet(cs);
+                SmolKernelSetBuffer(part == 0 ? bufInput : bufMid, 0);
+                SmolKernelSetBuffer(part == 0 ? bufMid : bufOutput, 1, SmolBufferBinding::Output);
+                SmolKernelDispatch(part == 0 ? kInputSize : kMidSize, 1, 1, kGroupSize, 1, 1);
+                SmolContextSetCurrent(nullptr);
+            });
+        }
+        for (int part = 0; part < 2; ++part)
+            threads[part].join();
+        SmolContextEndParts(nullptr);
+        SmolBufferGetData(bufOutput, output, sizeof(output));
+        if (memcmp(output, outputCheck, sizeof(output)) != 0)
+        {
+            printf("ERROR: SmokeTest: compute shaders recorded in parallel did not produce expected data\n");
+            goto _cleanup;
+        }
+    }
+
+    // dispatches recorded once into a command list, executed again after input data changes
+    list = SmolCommandListBegin();
+    if (list != nullptr)
+    {
+        SmolKernelSet(cs);
+        SmolKernelSetBuffer(bufInput, 0);
+        SmolKernelSetBuffer(bufMid, 1, SmolBufferBinding::Output);
+        SmolKernelDispatch(kInputSize, 1, 1, kGroupSize, 1, 1);
+        SmolKernelSet(cs);
+        SmolKernelSetBuffer(bufMid, 0);
+        SmolKernelSetBuffer(bufOutput, 1, SmolBufferBinding::Output);
+        SmolKernelDispatch(kMidSize, 1, 1, kGroupSize, 1, 1);
+        SmolCommandListEnd(list);
+        for (int pass = 1; pass <= 2; ++pass)
+        {
+            for (int i = 0; i < kInputSize; ++i)
+                input[i] = i * 17 * pass;
+            SmolBufferSetData(bufInput, input, sizeof(input));
+            SmolCommandListExecute(list);
+            SmolBufferGetData(bufOutput, output, sizeof(output));
+            for (int i = 0; i < kOutputSize; ++i)
+            {
+                if (output[i] != outputCheck[i] * pass)
+                {
+                    printf("ERROR: SmokeTest: command list did not produce expected data\n");
+                    goto _cleanup;
+                }
+            }
+        }
+        // restore original data for the checks below
+        for (int i = 0; i < kInputSize; ++i)
+            input[i] = i * 17;
+        SmolBufferSetData(bufInput, input, sizeof(input));
+        SmolCommandListExecute(list);
+    }
+
+    // defragmenting moves buffers out of sparsely used memory blocks, and keeps their contents
+    {
+        const int kDefragCount = 128; // two memory blocks worth of slots for this size
+        const int kDefragSize = 64 * 1024;
+        std::vector<SmolBuffer*> buffers(kDefragCount);
+        std::vector<int> data(kDefragSize / 4);
+        for (int i = 0; i < kDefragCount; ++i)
+        {
+            for (size_t j = 0; j < data.size(); ++j)
+                data[j] = i * 100003 + (int)j;
+            buffers[i] = SmolBufferCreate(kDefragSize, SmolBufferType::Structured, 4, SmolBufferUsage::GpuOnly);
+            SmolBufferSetData(buffers[i], data.data(), kDefragSize);
+        }
+        // leave every other slot empty, and wait until the deleted buffers are gone
+        for (int i = 1; i < kDefragCount; i += 2)
+            SmolBufferDelete(buffers[i]);
+        SmolFenceWait(SmolComputeFlush());
+        const size_t blocksBefore = SmolComputeGetMemoryStats().blockCount;
+        SmolComputeDefragment();
+        SmolFenceWait(SmolComputeFlush());
+        const size_t blocksAfter = SmolComputeGetMemoryStats().blockCount;
+        bool dataOk = true;
+        for (int i = 0; i < kDefragCount; i += 2)
+        {
+            SmolBufferGetData(buffers[i], data.data(), kDefragSize);
+            for (size_t j = 0; j < data.size(); ++j)
+                dataOk &= data[j] == i * 100003 + (int)j;
+            SmolBufferDelete(buffers[i]);
+        }
+        if (!dataOk || (backend == SmolBackend::Vulkan && blocksAfter >= blocksBefore))
+        {
+            printf("ERROR: SmokeTest: defragment did not free memory blocks, or changed buffer data\n");
+            goto _cleanup;
+        }
+    }
+    SmolComputeDefragment();
+    SmolBufferGetData(bufOutput, output, kOutputSize*4);
+    if (memcmp(output, outputCheck, sizeof(output)) != 0)
+    {
+        printf("ERROR: SmokeTest: buffer data changed after defragment\n");
+        goto _cleanup;
+    }
+    
     printf("OK: SmokeTest passed\n");
     ok = true;
 
 _cleanup:
+    SmolContextSetCurrent(nullptr);
+    SmolContextDelete(context);
+    SmolCommandListDelete(list);
+    SmolReadbackDelete(readback);
     SmolBufferDelete(bufInput);
     SmolBufferDelete(bufMid);
     SmolBufferDelete(bufOutput);
+    SmolBufferDelete(bufArgs);
     SmolKernelDelete(cs);
+    SmolKernelDelete(csConstants);
+    for (int i = 0; i < 3; ++i)
+        SmolKernelDelete(csSpec[i]);
     return ok;
 }
 
-bool IspcCompressBC3Test();
+// Mapped GpuOnly buffer data stays valid while other buffers upload (enough to need more staging
+// memory) and read data, both for write and read maps.
+static bool BufferMapTest()
+{
+    const size_t kMapCount = 16 * 1024;
+    const size_t kBigSize = 24 * 1024 * 1024;
+    bool ok = false;
+    std::vector<unsigned> big(kBigSize / 4), check(kMapCount);
+    for (size_t i = 0; i < big.size(); ++i)
+        big[i] = unsigned(i * 3 + 1);
+    SmolBuffer* bufMap = SmolBufferCreate(kMapCount * 4, SmolBufferType::Structured, 4, SmolBufferUsage::GpuOnly);
+    SmolBuffer* bufBig = SmolBufferCreate(kBigSize, SmolBufferType::Structured, 4, SmolBufferUsage::GpuOnly);
+    unsigned* mapped = (unsigned*)SmolBufferMap(bufMap, SmolBufferMapAccess::Write);
+    if (mapped == nullptr)
+    {
+        printf("ERROR: BufferMapTest: failed to map buffer for writing\n");
+        goto _cleanup;
+    }
+    SmolBufferSetData(bufBig, big.data(), kBigSize);
+    for (size_t i = 0; i < kMapCount; ++i)
+        mapped[i] = unsigned(i * 5 + 2);
+    SmolBufferSetData(bufBig, big.data(), kBigSize);
+    SmolBufferUnmap(bufMap);
 
-int main()
+    mapped = (unsigned*)SmolBufferMap(bufMap, SmolBufferMapAccess::ReadWrite);
+    if (mapped == nullptr)
+    {
+        printf("ERROR: BufferMapTest: failed to map buffer for reading\n");
+        goto _cleanup;
+    }
+    SmolBufferGetData(bufBig, check.data(), kMapCount * 4);
+    for (size_t i = 0; i < kMapCount; ++i)
+    {
+        if (mapped[i] != unsigned(i * 5 + 2) || check[i] != big[i])
+        {
+            printf("ERROR: BufferMapTest: mapped data at %i was overwritten, exp %u got %u\n", (int)i, unsigned(i * 5 + 2), mapped[i]);
+            SmolBufferUnmap(bufMap);
+            goto _cleanup;
+        }
+        mapped[i] += 7;
+    }
+    SmolBufferUnmap(bufMap);
+    SmolBufferGetData(bufMap, check.data(), kMapCount * 4);
+    for (size_t i = 0; i < kMapCount; ++i)
+    {
+        if (check[i] != unsigned(i * 5 + 9))
+        {
+            printf("ERROR: BufferMapTest: did not get data written through map at %i, exp %u got %u\n", (int)i, unsigned(i * 5 + 9), check[i]);
+            goto _cleanup;
+        }
+    }
+    ok = true;
+    printf("OK: BufferMapTest passed\n");
+
+_cleanup:
+    SmolBufferDelete(bufMap);
+    SmolBufferDelete(bufBig);
+    return ok;
+}
+
+// Pipeline cache file gets written on shutdown, loaded on the next start, and ignored once its
+// header does not match. Initializes and shuts down the library by itself.
+static bool PipelineCacheTest(SmolComputeCreateFlags createFlags)
+{
+    const char* kCachePath = "smolcompute-test-pipeline-cache.bin";
+    remove(kCachePath);
+    bool ok = false;
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        if (!SmolComputeCreate(createFlags, kCachePath))
+        {
+            printf("ERROR: failed to initialize smol_compute\n");
+            remove(kCachePath);
+            return false;
+        }
+        const SmolBackend backend = SmolComputeGetBackend();
+        SmolKernel* kernel = CreateConstantsKernel(backend);
+        const SmolPipelineCacheStats stats = SmolComputeGetPipelineCacheStats();
+        SmolKernelDelete(kernel);
+        SmolComputeDelete();
+        if (kernel == nullptr)
+        {
+            printf("ERROR: PipelineCacheTest: failed to create compute shader\n");
+            goto _cleanup;
+        }
+        if (backend != SmolBackend::Vulkan)
+        {
+            ok = true; // pipeline cache is only used on Vulkan
+            goto _cleanup;
+        }
+        // first pass starts without a file, second one loads it, third one has a corrupted header
+        if (stats.pipelinesCreated == 0 || (pass == 1) != (stats.loadedBytes != 0))
+        {
+            printf("ERROR: PipelineCacheTest: pass %i pipeline cache stats do not match cache file (%i pipelines, %i bytes loaded)\n", pass, stats.pipelinesCreated, (int)stats.loadedBytes);
+            goto _cleanup;
+        }
+        if (pass == 1)
+        {
+            // bump version number in the file header
+            FILE* f = fopen(kCachePath, "r+b");
+            unsigned char version = 0;
+            bool corrupted = f != nullptr && fseek(f, 4, SEEK_SET) == 0 && fread(&version, 1, 1, f) == 1;
+            ++version;
+            corrupted = corrupted && fseek(f, 4, SEEK_SET) == 0 && fwrite(&version, 1, 1, f) == 1;
+            if (f != nullptr)
+                fclose(f);
+            if (!corrupted)
+            {
+                printf("ERROR: PipelineCacheTest: pipeline cache file was not written\n");
+                goto _cleanup;
+            }
+        }
+    }
+    ok = true;
+
+_cleanup:
+    remove(kCachePath);
+    return ok;
+}
+
+// Task scheduler that runs each task on its own thread, and counts the calls.
+struct CountingScheduler
+{
+    std::atomic<int> enqueueCalls { 0 };
+    std::atomic<int> waitCalls { 0 };
+    std::atomic<int> tasksRun { 0 };
+
+    static int WorkerCount(void* userData)
+    {
+        (void)userData;
+        return 3;
+    }
+    static void* Enqueue(void* userData, SmolTaskFunction task, void* taskData, int count)
+    {
+        CountingScheduler* self = (CountingScheduler*)userData;
+        ++self->enqueueCalls;
+        std::vector<std::thread>* group = new std::vector<std::thread>();
+        for (int i = 0; i < count; ++i)
+        {
+            group->push_back(std::thread([self, task, taskData, i]()
+            {
+                task(taskData, i);
+                ++self->tasksRun;
+            }));
+        }
+        return group;
+    }
+    static void Wait(void* userData, void* waitGroup)
+    {
+        CountingScheduler* self = (CountingScheduler*)userData;
+        ++self->waitCalls;
+        std::vector<std::thread>* group = (std::vector<std::thread>*)waitGroup;
+        for (size_t i = 0; i < group->size(); ++i)
+            (*group)[i].join();
+        delete group;
+    }
+};
+
+// Buffer data large enough to be copied in parallel tasks, with a custom scheduler and then with the
+// built-in one. Initializes and shuts down the library by itself.
+static bool TaskSchedulerTest(SmolComputeCreateFlags createFlags)
+{
+    const size_t kSize = 12 * 1024 * 1024;
+    std::vector<unsigned> src(kSize / 4), dst(kSize / 4);
+    for (size_t i = 0; i < src.size(); ++i)
+        src[i] = unsigned(i * 2654435761u);
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        CountingScheduler counter;
+        SmolTaskScheduler scheduler;
+        scheduler.userData = &counter;
+        scheduler.workerCount = CountingScheduler::WorkerCount;
+        scheduler.enqueue = CountingScheduler::Enqueue;
+        scheduler.wait = CountingScheduler::Wait;
+        if (!SmolComputeCreate(createFlags, nullptr, pass == 0 ? &scheduler : nullptr))
+        {
+            printf("ERROR: failed to initialize smol_compute\n");
+            return false;
+        }
+        bool ok = true;
+        const SmolBufferUsage usages[] = { SmolBufferUsage::Dynamic, SmolBufferUsage::GpuOnly };
+        for (int ui = 0; ui < 2 && ok; ++ui)
+        {
+            SmolBuffer* buffer = SmolBufferCreate(kSize, SmolBufferType::Structured, 4, usages[ui]);
+            memset(dst.data(), 0, kSize);
+            SmolBufferSetData(buffer, src.data(), kSize);
+            SmolBufferGetData(buffer, dst.data(), kSize);
+            SmolBufferDelete(buffer);
+            if (memcmp(src.data(), dst.data(), kSize) != 0)
+            {
+                printf("ERROR: TaskSchedulerTest: pass %i usage %i did not get expected data back\n", pass, ui);
+                ok = false;
+            }
+        }
+        SmolComputeDelete();
+        if (!ok)
+            return false;
+        if (pass == 0 && (counter.enqueueCalls == 0 || counter.waitCalls != counter.enqueueCalls || counter.tasksRun < counter.enqueueCalls * 2))
+        {
+            printf("ERROR: TaskSchedulerTest: scheduler was not used as expected (%i enqueues, %i waits, %i tasks)\n", counter.enqueueCalls.load(), counter.waitCalls.load(), counter.tasksRun.load());
+            return false;
+        }
+    }
+    printf("OK: TaskSchedulerTest passed\n");
+    return true;
+}
+
+bool IspcCompressBC3Test(bool checkStats);
+bool CoroTest();
+
+int main(int argc, char** argv)
 {
     stm_setup();
     uint64_t tStart = stm_now(), tDur = 0;
-    if (!SmolComputeCreate(SmolComputeCreateFlags::EnableDebugLayers))
+    SmolComputeCreateFlags createFlags = SmolComputeCreateFlags::EnableDebugLayers;
+    bool profile = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--software") == 0)
+            createFlags |= SmolComputeCreateFlags::UseSoftwareRenderer;
+        if (strcmp(argv[i], "--submit-thread") == 0)
+            createFlags |= SmolComputeCreateFlags::EnableSubmitThread;
+        if (strcmp(argv[i], "--profile") == 0)
+        {
+            createFlags |= SmolComputeCreateFlags::EnableProfiling | SmolComputeCreateFlags::EnableInvocationStats;
+            profile = true;
+        }
+    }
+    if (!PipelineCacheTest(createFlags))
+        return 1;
+    if (!TaskSchedulerTest(createFlags))
+        return 1;
+    if (!SmolComputeCreate(createFlags))
     {
         printf("ERROR: failed to initialize smol_compute\n");
         return 1;
@@ -219,7 +959,11 @@ int main()
     bool ok = false;
     if (!SmokeTest())
         goto _cleanup;
-    if (!IspcCompressBC3Test())
+    if (!BufferMapTest())
+        goto _cleanup;
+    if (!CoroTest())
+        goto _cleanup;
+    if (!IspcCompressBC3Test(profile))
     {
         printf("ERROR: IspcCompressBC3Test: failed\n");
         goto _cleanup;